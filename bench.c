@@ -0,0 +1,657 @@
+/*
+ * Microbenchmarks for the editor hot paths.
+ *
+ * Every benchmark runs against generated C source of the requested sizes and
+ * prints one JSON object per line on stdout, so results can be collected and
+ * compared across releases.
+ *
+ *   ./kilo-bench [-d dir] [size ...]      sizes accept K, M and G suffixes
+ */
+#define KILO_NO_MAIN
+#include "kilo.c"
+
+#include <malloc.h>
+
+#define BENCH_FRAMES 200
+#define BENCH_LOOKUPS 100000
+#define BENCH_SPLITS 10000
+
+char* bench_dir = "/tmp";
+
+double Seconds(long long ns)
+{
+    return ns / 1e9;
+}
+
+long long ParseSize(const char* s)
+{
+    char* end;
+    long long n = strtoll(s, &end, 10);
+    switch (*end)
+    {
+        case 'k':
+        case 'K':
+            n <<= 10;
+            break;
+        case 'm':
+        case 'M':
+            n <<= 20;
+            break;
+        case 'g':
+        case 'G':
+            n <<= 30;
+            break;
+    }
+    return n;
+}
+
+/* Writes about `bytes` of C source. With `comments` set, every 1000 lines
+ * open a block comment that runs for the next 400 lines. */
+void BenchGenerate(const char* path, long long bytes, int comments)
+{
+    FILE* fp = fopen(path, "w");
+    if (!fp)
+    {
+        Die("generate");
+    }
+
+    long long written = 0;
+    long long line = 0;
+    while (written < bytes)
+    {
+        int n;
+        if (comments && line % 1000 == 0)
+        {
+            n = fprintf(fp, "/* section %lld\n", line);
+        }
+        else if (comments && line % 1000 == 400)
+        {
+            n = fprintf(fp, " * end of section */\n");
+        }
+        else
+        {
+            switch (line % 4)
+            {
+                case 0:
+                    n = fprintf(fp, "int func%lld(int a, char* s)\n", line);
+                    break;
+                case 1:
+                    n = fprintf(fp, "\tfor (int i = 0; i < %lld; ++i) { if (s[i] == 'x') break; }\n", line);
+                    break;
+                case 2:
+                    n = fprintf(fp, "\twhile (a > 0.5) a -= 1; // \"not a string\" %lld\n", line);
+                    break;
+                default:
+                    n = fprintf(fp, "\treturn printf(\"%%d\\n\", a + %lld);\n", line);
+                    break;
+            }
+        }
+        written += n;
+        line += 1;
+    }
+    fclose(fp);
+}
+
+void BenchReset()
+{
+    for (int i = 0; i < E.numrows; ++i)
+    {
+        EditorFreeRow(&E.row[i]);
+    }
+    free(E.row);
+    free(E.filename);
+    FenwickFree(&E.offsets);
+    FenwickFree(&E.wrap.lines);
+    free(E.undo.buf);
+    EditorWordsCancel();
+    free(E.words.nodes);
+    free(E.brackets.blocks);
+    free(E.brackets.tree);
+    free(E.brackets.counts);
+    free(E.brackets.dirty);
+    free(E.macro.keys);
+    free(E.macro.timeouts);
+    if (E.snapshot.map)
+    {
+        munmap(E.snapshot.map, E.snapshot.size);
+    }
+    InitEditor();
+    E.headless = 1;
+    E.ofd = -1;
+    E.screenrows = 50;
+    E.screencols = 120;
+}
+
+void BenchReport(const char* name, const char* input, long long bytes, double secs, const char* unit, double rate)
+{
+    printf("{\"bench\": \"%s\", \"input\": \"%s\", \"bytes\": %lld, \"rows\": %d, \"secs\": %.6f, \"%s\": %.2f}\n",
+           name, input, bytes, E.numrows, secs, unit, rate);
+    fflush(stdout);
+}
+
+void BenchOpen(const char* path, const char* input, long long bytes)
+{
+    BenchReset();
+    long long t = NowNs();
+    EditorOpen(path);
+    double secs = Seconds(NowNs() - t);
+    BenchReport("open", input, bytes, secs, "mb_per_sec", bytes / 1048576.0 / secs);
+
+    /* how long a CTRL-N right after the load waits for the word index */
+    t = NowNs();
+    if (E.words.job)
+    {
+        EditorWordsTake();
+    }
+    secs = Seconds(NowNs() - t);
+    BenchReport("words_ready", input, bytes, secs, "ms", secs * 1e3);
+}
+
+/* Heap bytes held per row: the ERow slot plus every row allocation with its
+ * malloc header. */
+long long AllocBytes(void* p)
+{
+    return p ? malloc_usable_size(p) + sizeof(size_t) : 0;
+}
+
+void BenchMemory(const char* input, long long bytes)
+{
+    long long total = (long long)sizeof(ERow) * E.numrows;
+    for (int i = 0; i < E.numrows; ++i)
+    {
+        total += AllocBytes(E.row[i].chars) + AllocBytes(E.row[i].render) + AllocBytes(E.row[i].hl);
+    }
+    BenchReport("row_memory", input, bytes, 0, "bytes_per_row", E.numrows ? (double)total / E.numrows : 0);
+}
+
+void BenchUpdate(const char* input, long long bytes)
+{
+    long long t = NowNs();
+    for (int i = 0; i < E.numrows; ++i)
+    {
+        EditorUpdateRow(&E.row[i]);
+    }
+    double secs = Seconds(NowNs() - t);
+    BenchReport("update_row", input, bytes, secs, "rows_per_sec", E.numrows / secs);
+
+    /* opening a block comment on the first row outside one re-highlights
+     * every row down to the next close, or the rest of the file without one */
+    int at = 0;
+    while (at < E.numrows && (E.row[at].hl_open_comment || (at > 0 && E.row[at - 1].hl_open_comment)))
+    {
+        at += 1;
+    }
+    if (at == E.numrows)
+    {
+        return;
+    }
+    t = NowNs();
+    EditorRowInsertChar(&E.row[at], 0, '*');
+    EditorRowInsertChar(&E.row[at], 0, '/');
+    secs = Seconds(NowNs() - t);
+    BenchReport("comment_cascade", input, bytes, secs, "ms", secs * 1e3);
+
+    EditorRowDelChar(&E.row[at], 0);
+    EditorRowDelChar(&E.row[at], 0);
+}
+
+void BenchDraw(const char* input, long long bytes)
+{
+    long long built = 0;
+    long long t = NowNs();
+    for (int f = 0; f < BENCH_FRAMES; ++f)
+    {
+        struct ABuf ab = ABUF_INIT;
+        E.rowoff = (int)((long long)f * E.numrows / BENCH_FRAMES);
+        EditorDrawRows(&ab);
+        built += ab.len;
+        AbFree(&ab);
+    }
+    double secs = Seconds(NowNs() - t);
+    E.rowoff = 0;
+    BenchReport("draw_rows", input, bytes, secs, "us_per_frame", secs * 1e6 / BENCH_FRAMES);
+    (void)built;
+}
+
+/* Wraps the file in a brace pair and matches it from both ends, so each
+ * match steps over every row in between, after building the tree from the
+ * rows' sums. */
+void BenchBrackets(const char* input, long long bytes)
+{
+    E.undo.paused = 1;
+    EditorInsertRow(0, "{", 1);
+    EditorInsertRow(E.numrows, "}", 1);
+
+    long long t = NowNs();
+    EditorBracketsBuild();
+    double secs = Seconds(NowNs() - t);
+    BenchReport("bracket_build", input, bytes, secs, "ms", secs * 1e3);
+
+    int at[2];
+    int rx[2];
+    int found = 0;
+    t = NowNs();
+    for (int i = 0; i < BENCH_LOOKUPS; ++i)
+    {
+        E.cy = (i & 1) ? E.numrows - 1 : 0;
+        E.cx = 0;
+        found += EditorBracketMatch(at, rx);
+    }
+    secs = Seconds(NowNs() - t);
+    BenchReport("bracket_match", input, bytes, secs, "ns_per_match", secs * 1e9 / BENCH_LOOKUPS);
+
+    /* a row added inside the pair and one removed before each match, as the
+     * frame after Enter or a deleted line has it */
+    t = NowNs();
+    for (int i = 0; i < BENCH_SPLITS; ++i)
+    {
+        EditorInsertRow(E.numrows - 1, "", 0);
+        E.cy = 0;
+        found += EditorBracketMatch(at, rx);
+        EditorDelRow(E.numrows - 2);
+        found += EditorBracketMatch(at, rx);
+    }
+    secs = Seconds(NowNs() - t);
+    BenchReport("bracket_split", input, bytes, secs, "ns_per_match", secs * 1e9 / (2 * BENCH_SPLITS));
+
+    EditorDelRow(E.numrows - 1);
+    EditorDelRow(0);
+    E.cy = 0;
+    E.undo.paused = 0;
+    (void)found;
+}
+
+/* Maps offsets spread over the file to rows and back through the Fenwick
+ * index, after building it from scratch. */
+void BenchOffsets(const char* input, long long bytes)
+{
+    E.offsets.valid = 0;
+    long long t = NowNs();
+    long long total = EditorRowOffset(E.numrows);
+    double secs = Seconds(NowNs() - t);
+    BenchReport("offset_build", input, bytes, secs, "ms", secs * 1e3);
+
+    long long sum = 0;
+    t = NowNs();
+    for (int i = 0; i < BENCH_LOOKUPS; ++i)
+    {
+        sum += EditorRowOffset(EditorOffsetRow(total * i / BENCH_LOOKUPS));
+    }
+    secs = Seconds(NowNs() - t);
+    BenchReport("offset_lookup", input, bytes, secs, "ns_per_lookup", secs * 1e9 / BENCH_LOOKUPS);
+
+    /* rows added and removed mid-file in the tree alone (the row array's
+     * memmove is not its concern), each followed by the lookup a frame makes */
+    EditorRowOffset(0);
+    int mid = E.numrows / 2;
+    t = NowNs();
+    for (int i = 0; i < BENCH_SPLITS; ++i)
+    {
+        FenwickInsert(&E.offsets, mid + i % 64, 1);
+        sum += FenwickPrefix(&E.offsets, E.offsets.n);
+    }
+    for (int i = 0; i < BENCH_SPLITS; ++i)
+    {
+        FenwickDelete(&E.offsets, mid);
+        sum += FenwickPrefix(&E.offsets, E.offsets.n);
+    }
+    secs = Seconds(NowNs() - t);
+    BenchReport("offset_split", input, bytes, secs, "ns_per_row", secs * 1e9 / (2 * BENCH_SPLITS));
+    (void)sum;
+}
+
+void BenchFind(const char* input, long long bytes)
+{
+    long long t = NowNs();
+    EditorFindCallback("no such needle", 0);
+    double secs = Seconds(NowNs() - t);
+    EditorFindCallback("no such needle", '\r');
+    BenchReport("find", input, bytes, secs, "mb_per_sec", bytes / 1048576.0 / secs);
+}
+
+/* Builds the word index, then completes two-letter prefixes taken from rows
+ * spread through the buffer. */
+void BenchWords(const char* input, long long bytes)
+{
+    E.words.valid = 0;
+    long long t = NowNs();
+    EditorWordsBuild();
+    double secs = Seconds(NowNs() - t);
+    BenchReport("words_build", input, bytes, secs, "ms", secs * 1e3);
+
+    char* words[KILO_COMPLETE_MAX];
+    int queries = 0;
+    t = NowNs();
+    for (int i = 0; i < BENCH_LOOKUPS && E.numrows > 0; ++i)
+    {
+        ERow* row = &E.row[(long long)E.numrows * i / BENCH_LOOKUPS];
+        int at = 0;
+        while (at < row->size && is_separator((unsigned char)row->chars[at]))
+        {
+            ++at;
+        }
+        if (row->size - at < 2)
+        {
+            continue;
+        }
+        int n = EditorWordsComplete(&row->chars[at], 2, words, KILO_COMPLETE_MAX);
+        for (int w = 0; w < n; ++w)
+        {
+            free(words[w]);
+        }
+        queries += 1;
+    }
+    secs = Seconds(NowNs() - t);
+    BenchReport("complete", input, bytes, secs, "us_per_query", queries ? secs * 1e6 / queries : 0.0);
+}
+
+void BenchSave(const char* input, long long bytes)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/kilo-bench-save.c", bench_dir);
+    free(E.filename);
+    E.filename = strdup(path);
+
+    long long t = NowNs();
+    EditorSave();
+    double secs = Seconds(NowNs() - t);
+    BenchReport("save", input, bytes, secs, "mb_per_sec", bytes / 1048576.0 / secs);
+    unlink(path);
+}
+
+#ifdef KILO_ZLIB
+/* Saves the buffer gzip-compressed, then opens that through the decoder
+ * thread. Leaves the file it opened in the buffer. */
+void BenchGzip(const char* input, long long bytes)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/kilo-bench-save.c.gz", bench_dir);
+    free(E.filename);
+    E.filename = strdup(path);
+
+    long long t = NowNs();
+    EditorSave();
+    double secs = Seconds(NowNs() - t);
+    BenchReport("save_gz", input, bytes, secs, "mb_per_sec", bytes / 1048576.0 / secs);
+
+    BenchReset();
+    t = NowNs();
+    EditorOpen(path);
+    secs = Seconds(NowNs() - t);
+    BenchReport("open_gz", input, bytes, secs, "mb_per_sec", bytes / 1048576.0 / secs);
+    unlink(path);
+}
+#endif
+
+/* Pastes the whole file into the middle of itself, then takes the paste
+ * back and puts it in again through the undo journal. */
+void BenchUndo(const char* input, long long bytes)
+{
+    int len;
+    char* text = EditorRowsToString(&len);
+    int lines = E.numrows;
+    E.cy = E.numrows / 2;
+    E.cx = 0;
+    EditorUndoSeal();
+
+    long long t = NowNs();
+    EditorInsertText(text, len);
+    double secs = Seconds(NowNs() - t);
+    BenchReport("paste", input, bytes, secs, "lines_per_sec", lines / secs);
+    EditorUndoSeal();
+
+    t = NowNs();
+    EditorUndo();
+    secs = Seconds(NowNs() - t);
+    BenchReport("undo_paste", input, bytes, secs, "lines_per_sec", lines / secs);
+
+    t = NowNs();
+    EditorRedo();
+    secs = Seconds(NowNs() - t);
+    BenchReport("redo_paste", input, bytes, secs, "lines_per_sec", lines / secs);
+    free(text);
+}
+
+/* Types a char into a column block spanning every row, then takes it out
+ * again, each as one batch edit. */
+void BenchBlock(const char* input, long long bytes)
+{
+    E.cy = 0;
+    E.cx = 0;
+    EditorToggleBlock();
+    E.cy = E.numrows - 1;
+    EditorUndoSeal();
+
+    long long t = NowNs();
+    EditorBatchEdit('x');
+    double secs = Seconds(NowNs() - t);
+    BenchReport("block_insert", input, bytes, secs, "rows_per_sec", E.numrows / secs);
+    EditorUndoSeal();
+
+    t = NowNs();
+    EditorBatchEdit(BACKSPACE);
+    secs = Seconds(NowNs() - t);
+    BenchReport("block_delete", input, bytes, secs, "rows_per_sec", E.numrows / secs);
+    EditorCursorsClear();
+    E.cy = 0;
+    E.cx = 0;
+}
+
+/* Replays a macro that comments out a line and steps down, from the top to
+ * the end of the file. */
+void BenchMacro(const char* input, long long bytes)
+{
+    E.macro.keys = strdup("\x1b[H// \x1b[B");
+    E.macro.len = strlen(E.macro.keys);
+    E.cy = 0;
+    E.cx = 0;
+    int lines = E.numrows;
+
+    long long t = NowNs();
+    EditorMacroReplay(0);
+    double secs = Seconds(NowNs() - t);
+    BenchReport("macro_replay", input, bytes, secs, "lines_per_sec", lines / secs);
+    E.cy = 0;
+    E.cx = 0;
+}
+
+/* Sorts the whole buffer, drops its duplicate lines, then drops the lines
+ * with a digit 7 in them. */
+void BenchLines(const char* input, long long bytes)
+{
+    int lines = E.numrows;
+    long long t = NowNs();
+    EditorSortLines();
+    double secs = Seconds(NowNs() - t);
+    BenchReport("sort_lines", input, bytes, secs, "lines_per_sec", lines / secs);
+
+    lines = E.numrows;
+    t = NowNs();
+    EditorUniqueLines();
+    secs = Seconds(NowNs() - t);
+    BenchReport("unique_lines", input, bytes, secs, "lines_per_sec", lines / secs);
+
+    lines = E.numrows;
+    t = NowNs();
+    LinesFilter("7", 1);
+    secs = Seconds(NowNs() - t);
+    BenchReport("filter_lines", input, bytes, secs, "lines_per_sec", lines / secs);
+}
+
+/* Reopens the file and reloads it from a copy with one line in a thousand
+ * changed, as if another process had rewritten it. */
+void BenchReload(const char* path, const char* input, long long bytes)
+{
+    BenchReset();
+    EditorOpen(path);
+    EditorWordsCancel();
+    char copy[4096];
+    snprintf(copy, sizeof(copy), "%s/kilo-bench-reload.c", bench_dir);
+    FILE* fp = fopen(copy, "w");
+    if (!fp)
+    {
+        Die("reload");
+    }
+    for (int i = 0; i < E.numrows; ++i)
+    {
+        fprintf(fp, "%s%s\n", E.row[i].chars, i % 1000 == 500 ? " /* edited */" : "");
+    }
+    fclose(fp);
+    free(E.filename);
+    E.filename = strdup(copy);
+
+    long long t = NowNs();
+    EditorReload();
+    double secs = Seconds(NowNs() - t);
+    BenchReport("reload", input, bytes, secs, "mb_per_sec", bytes / 1048576.0 / secs);
+    unlink(copy);
+}
+
+/* Feeds the file through EditorStreamAppend in pipe-sized pieces, the way
+ * kilo - and kilo -f take it. */
+void BenchStream(const char* path, const char* input, long long bytes)
+{
+    BenchReset();
+    E.filename = strdup(path);
+    EditorSelectSyntaxHighlight();
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        Die("stream");
+    }
+
+    char buf[65536];
+    ssize_t n;
+    long long t = NowNs();
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+    {
+        EditorStreamAppend(buf, n);
+    }
+    double secs = Seconds(NowNs() - t);
+    close(fd);
+    BenchReport("stream_append", input, bytes, secs, "lines_per_sec", E.numrows / secs);
+}
+
+/* Snapshots the buffer left by BenchStream, then restores it in place of
+ * opening the file. */
+void BenchSnapshot(const char* path, const char* input, long long bytes)
+{
+    E.snapshot.enabled = 1;
+    long long t = NowNs();
+    EditorSnapshotWrite();
+    double secs = Seconds(NowNs() - t);
+    BenchReport("snapshot_write", input, bytes, secs, "mb_per_sec", bytes / 1048576.0 / secs);
+
+    BenchReset();
+    t = NowNs();
+    if (EditorOpenSnapshot(path) == -1)
+    {
+        Die("snapshot");
+    }
+    secs = Seconds(NowNs() - t);
+    BenchReport("snapshot_restore", input, bytes, secs, "mb_per_sec", bytes / 1048576.0 / secs);
+
+    char snapshot[4096];
+    snprintf(snapshot, sizeof(snapshot), "%s.ksnap", path);
+    unlink(snapshot);
+}
+
+/* Searches a directory of hard links to the file for a needle that never
+ * matches, so the rate is the pool's scan throughput. */
+void BenchGrep(const char* path, const char* input, long long bytes)
+{
+    char dir[4096];
+    char link_path[4200];
+    snprintf(dir, sizeof(dir), "%s/kilo-bench-grep", bench_dir);
+    mkdir(dir, 0755);
+    for (int i = 0; i < 8; ++i)
+    {
+        snprintf(link_path, sizeof(link_path), "%s/%d.c", dir, i);
+        unlink(link_path);
+        if (link(path, link_path) == -1)
+        {
+            Die("grep");
+        }
+    }
+
+    long long t = NowNs();
+    if (EditorGrepStart(dir, "no such needle", 0) == -1)
+    {
+        Die("grep");
+    }
+    EditorGrepWait();
+    double secs = Seconds(NowNs() - t);
+    BenchReport("grep", input, bytes, secs, "mb_per_sec", 8 * bytes / 1048576.0 / secs);
+
+    for (int i = 0; i < 8; ++i)
+    {
+        snprintf(link_path, sizeof(link_path), "%s/%d.c", dir, i);
+        unlink(link_path);
+    }
+    rmdir(dir);
+}
+
+void BenchInput(long long bytes, int comments)
+{
+    const char* input = comments ? "c_comments" : "c";
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/kilo-bench-%lld-%s.c", bench_dir, bytes, input);
+    BenchGenerate(path, bytes, comments);
+
+    BenchOpen(path, input, bytes);
+    BenchMemory(input, bytes);
+    BenchUpdate(input, bytes);
+    BenchDraw(input, bytes);
+    BenchOffsets(input, bytes);
+    BenchBrackets(input, bytes);
+    BenchFind(input, bytes);
+    BenchWords(input, bytes);
+    BenchSave(input, bytes);
+#ifdef KILO_ZLIB
+    BenchGzip(input, bytes);
+#endif
+    BenchUndo(input, bytes);
+    BenchBlock(input, bytes);
+    BenchMacro(input, bytes);
+    BenchLines(input, bytes);
+    BenchReload(path, input, bytes);
+    BenchStream(path, input, bytes);
+    BenchSnapshot(path, input, bytes);
+    BenchGrep(path, input, bytes);
+
+    BenchReset();
+    unlink(path);
+}
+
+int main(int argc, char** argv)
+{
+    int i = 1;
+    if (i + 1 < argc && !strcmp(argv[i], "-d"))
+    {
+        bench_dir = argv[i + 1];
+        i += 2;
+    }
+
+    char* defaults[] = {"16K", "1M", "32M"};
+    char** sizes = &argv[i];
+    int nsizes = argc - i;
+    if (nsizes == 0)
+    {
+        sizes = defaults;
+        nsizes = sizeof(defaults) / sizeof(defaults[0]);
+    }
+
+    InitEditor();
+    for (int n = 0; n < nsizes; ++n)
+    {
+        long long bytes = ParseSize(sizes[n]);
+        if (bytes <= 0)
+        {
+            fprintf(stderr, "bad size: %s\n", sizes[n]);
+            return 1;
+        }
+        BenchInput(bytes, 0);
+        BenchInput(bytes, 1);
+    }
+    return 0;
+}
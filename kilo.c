@@ -14,16 +14,83 @@
 #include <time.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <regex.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef KILO_ZLIB
+#include <zlib.h>
+#endif
+#ifdef KILO_ZSTD
+#include <zstd.h>
+#endif
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define KILO_VERSION "0.0.1"
 #define ABUF_INIT {NULL, 0}
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
+#define KILO_TRACE_EVENTS 65536
+#define KILO_LOAD_CHUNK (4 << 20)
+#define KILO_LOAD_THREADS 16
+#define KILO_STREAM_BATCH (1 << 20)
+#define KILO_INDEX_MAGIC "KILOIDX"
+#define KILO_INDEX_VERSION 1
+#define KILO_INDEX_HASHED 4096
+#define KILO_INDEX_COMMENT (1ULL << 63)
+#define KILO_SNAPSHOT_MAGIC "KILOSNP"
+#define KILO_SNAPSHOT_VERSION 2
+#define KILO_SNAPSHOT_CACHED (1<<0)
+#define KILO_SNAPSHOT_RENDER (1<<1)
+#define KILO_SERVER_ROWS 24
+#define KILO_SERVER_COLS 80
+#define KILO_KEY_TIMEOUT_MS 100
+#define KILO_MSG_KEYS 'k'
+#define KILO_MSG_SIZE 'w'
+#define KILO_UNDO_MB 64
+#define KILO_PASTE_WAIT 20
+#define KILO_BATCH_PARALLEL 4096
+#define KILO_CODEC_BUF (256 << 10)
+#define KILO_CODEC_SLOTS 4
+#define KILO_WORD_MAX 64
+#define KILO_WORD_PARALLEL 65536
+#define KILO_WORD_BACKGROUND (1 << 20)
+#define KILO_WORD_WINDOW (1 << 20)
+#define KILO_WORD_LOG (16 << 20)
+#define KILO_COMPLETE_MAX 8
+#define KILO_GREP_HITS 100000
+#define KILO_GREP_TEXT 200
+#define KILO_GREP_WINDOW (4 << 20)
+#define KILO_SORT_PARALLEL 65536
+#define KILO_MACRO_POLL 256
+#define KILO_SERVER_BACKLOG (4 << 20)
+#define KILO_FENWICK_BLOCK 256
+#define KILO_BRACKET_BLOCK 256
 
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+#define KILO_SYNTAX_QUOTES 4
+#define KILO_SYNTAX_NODES 65536
+#define KILO_SEPARATORS ",.()+-/*=~%<>[];"
+
+#define ROW_CACHED (1<<0)
+#define ROW_REFERENCED (1<<1)
+#define ROW_MAPPED (1<<2)
+#define ROW_BRACKETS (1<<3)
+#define ROW_STALE (1<<4)
+
+struct SyntaxTable;
+
 struct EditorSyntax
 {
     char* filetype;
@@ -33,6 +100,9 @@ struct EditorSyntax
     char* multiline_comment_start;
     char* multiline_comment_end;
     int flags;
+    char* separators;
+    char* quotes;
+    struct SyntaxTable* table;
 };
 
 char* C_HL_extensions[] = {".c", ".h", ".cpp", NULL};
@@ -46,7 +116,10 @@ struct EditorSyntax HLDB[] = {
         "//",
         "/*",
         "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        KILO_SEPARATORS,
+        "\"'",
+        NULL
     },
 };
 
@@ -64,6 +137,7 @@ enum EditorKey
     END_KEY,
     PAGE_UP,
     PAGE_DOWN,
+    PASTE_START,
 };
 
 enum EditorHighlight
@@ -78,17 +152,649 @@ enum EditorHighlight
     HL_KEYWORD2
 };
 
+/* Byte classes and lexer states of the compiled highlighter. A quote class
+ * and its string/escape states exist for each of the syntax's quotes. */
+enum SyntaxClass
+{
+    SC_OTHER = 0,
+    SC_SEP,
+    SC_DIGIT,
+    SC_DOT,
+    SC_ESCAPE,
+    SC_QUOTE,
+    SC_CLASSES = SC_QUOTE + KILO_SYNTAX_QUOTES
+};
+
+enum SyntaxState
+{
+    SS_SEP = 0,
+    SS_WORD,
+    SS_NUMBER,
+    SS_STRING,
+    SS_ESCAPE = SS_STRING + KILO_SYNTAX_QUOTES,
+    SS_STATES = SS_ESCAPE + KILO_SYNTAX_QUOTES
+};
+
+#define SC_TOKEN 0x80
+#define TOK_SCS (1<<0)
+#define TOK_MCS (1<<1)
+#define TOK_KEYWORD1 (1<<2)
+#define TOK_KEYWORD2 (1<<3)
+
+/* A syntax compiled for EditorHighlightLine: the class of every byte (with
+ * SC_TOKEN set when a comment delimiter or keyword can start there), the
+ * transition table over (state, class) with the highlight of the byte in the
+ * high nibble, and a trie over comment starts and keywords whose states
+ * record the tokens ending there. */
+struct SyntaxTable
+{
+    unsigned char cls[256];
+    unsigned char step[SS_STATES][SC_CLASSES];
+    unsigned short (*trie)[256];
+    unsigned char* accept;
+    int nodes;
+    int cap;
+    const char* mce;
+    int mce_len;
+};
+
+/* The change in bracket depth across some text, opening brackets counting
+ * +1 and closing ones -1, and the lowest depth it reaches from its start
+ * (0 or below). Going back from its end it reaches total - low at most. */
+struct BracketSum
+{
+    int total;
+    int low;
+};
+
+/* render is NULL while it would be a copy of chars (no tabs); read it through
+ * EditorRowRender. hl holds (length, class) byte pairs, see EditorRowSetHighlight.
+ * render and hl are only valid while ROW_CACHED is set in cache, see EditorRowEnsure.
+ * brackets sums the row outside strings and comments while ROW_BRACKETS is set;
+ * it outlives eviction. ROW_STALE marks a row edited during a macro replay
+ * whose highlighting is still to be done, see EditorHighlightFlush. eol is
+ * the length of the line ending the row had on disk, 2 for a CRLF, which byte
+ * offsets count and a save writes back. */
 typedef struct ERow
 {
-    int idx;
-    int size;
-    int rsize;
     char* chars;
     char* render;
     unsigned char* hl;
-    int hl_open_comment;
+    int size;
+    int rsize;
+    int hlruns;
+    struct BracketSum brackets;
+    unsigned char hl_open_comment;
+    unsigned char cache;
+    unsigned char eol;
 } ERow;
 
+struct KeyLatency
+{
+    int enabled;
+    long long start;
+    long long* samples;
+    int count;
+    int cap;
+    long long rolling;
+};
+
+struct TraceEvent
+{
+    const char* name;
+    long long ts;
+    long long dur;
+};
+
+struct Trace
+{
+    int enabled;
+    char* path;
+    struct TraceEvent* events;
+    int head;
+    int count;
+    long long origin;
+};
+
+/* Derived render/hl bytes are kept under budget (0 = unlimited) by a clock
+ * sweep over E.row that evicts rows not drawn since the hand last passed. */
+struct RowCache
+{
+    long long budget;
+    long long bytes;
+    int hand;
+    long long hits;
+    long long misses;
+};
+
+/* Input that keeps arriving after the first frame: a pipe on stdin, or a file
+ * being followed through inotify. open_line is set while the last row has not
+ * seen its newline yet. */
+struct Stream
+{
+    int fd;
+    int file;
+    int wd;
+    char* path;
+    off_t offset;
+    int open_line;
+};
+
+/* The file a buffer was read from or last saved to, as it was then, so that
+ * a change by another process can be told from our own save. wd is the
+ * inotify watch on its directory, which buffers in one directory share;
+ * changed is set when it reports the file, until the buffer is reloaded. */
+struct Disk
+{
+    int wd;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    int changed;
+};
+
+/* One inotify instance for the watched directories. The tools that drive
+ * the editor headless leave it disabled. Reloads wait for idle, set while
+ * the editor waits for the next command rather than inside one (a prompt),
+ * whose saved state a reload would pull the rows out from under. */
+struct Watch
+{
+    int enabled;
+    int fd;
+    int changed;
+    int idle;
+};
+
+/* Project search (CTRL-X g/G): worker threads walk the tree, each taking
+ * paths off the back of its own queue and, when that runs dry, off the front
+ * of another's. pending counts the paths queued or being worked on; work
+ * changes whenever some are queued, so an idle worker knows to look again.
+ * Files are scanned through mmap and their hits gathered in out, and the
+ * main loop is woken through the wake pipe to move them into the results
+ * buffer between keys. */
+struct GrepPath
+{
+    char* path;
+    int dir;
+};
+
+struct GrepQueue
+{
+    pthread_mutex_t lock;
+    struct GrepPath* paths;
+    int head;
+    int count;
+    int cap;
+};
+
+struct Grep
+{
+    int running;
+    int nthreads;
+    pthread_t threads[KILO_LOAD_THREADS];
+    struct GrepQueue queues[KILO_LOAD_THREADS];
+    char* pattern;
+    int len;
+    int regex;
+    regex_t re;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending;
+    long long work;
+    int cancel;
+    int exited;
+    int woken;
+    char* out;
+    int outlen;
+    int outcap;
+    long long hits;
+    long long files;
+    long long start;
+    int wake[2];
+    int buffer;
+};
+
+/* Sidecar <file>.kidx: this header, then one entry per row holding the row's
+ * byte offset, with KILO_INDEX_COMMENT set when the row starts inside a block
+ * comment. Entries are only ever appended when the file grows. */
+struct IndexHeader
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int reserved;
+    unsigned long long size;
+    long long mtime_sec;
+    long long mtime_nsec;
+    unsigned long long hash;
+    unsigned long long rows;
+    char filetype[16];
+};
+
+/* Sidecar <file>.ksnap: this header, a SnapshotRow per row, then each row's
+ * chars, render and hl runs. Offsets count from the start of the snapshot,
+ * so a restore maps it and points the rows into the mapping. */
+struct SnapshotHeader
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int reserved;
+    unsigned long long size;
+    long long mtime_sec;
+    long long mtime_nsec;
+    unsigned long long hash;
+    unsigned long long rows;
+    char filetype[16];
+    int cx;
+    int cy;
+    int rowoff;
+    int coloff;
+};
+
+/* A row's chars are followed by its render, if it has tabs, and its hl runs.
+ * Rows that were evicted from the render cache are stored with neither and
+ * rebuilt when shown. */
+struct SnapshotRow
+{
+    unsigned long long chars;
+    int size;
+    int rsize;
+    int hlruns;
+    unsigned char flags;
+    unsigned char hl_open_comment;
+    unsigned char eol;
+    unsigned char reserved;
+};
+
+/* A buffer restored from a snapshot (-s). Its rows are ROW_MAPPED, pointing
+ * into map, until EditorRowOwn copies them out to change them. */
+struct Snapshot
+{
+    int enabled;
+    char* map;
+    off_t size;
+};
+
+/* A file opened through its index. Rows stay unloaded (chars == NULL) until
+ * EditorRowLoad copies them out of the mapping; the buffer is read-only. */
+struct LineIndex
+{
+    char* map;
+    off_t size;
+    char* idxmap;
+    size_t idxlen;
+    unsigned long long* entries;
+};
+
+/* A value per row, kept in blocks of up to 2 * KILO_FENWICK_BLOCK rows with
+ * Fenwick trees over the blocks' row counts and sums (1..nblocks). Prefix
+ * sums and the row holding a given sum take O(log n) plus a walk within one
+ * block, and a row inserted or deleted anywhere only moves the rest of its
+ * block. A block that fills up is split and an emptied one dropped, which
+ * rebuilds the trees over the blocks: once per KILO_FENWICK_BLOCK changes at
+ * most. valid is cleared to have it rebuilt from the rows on the next query. */
+struct FenwickBlock
+{
+    long long* values;
+    long long sum;
+    int n;
+};
+
+struct Fenwick
+{
+    struct FenwickBlock* blocks;
+    long long* counts;
+    long long* sums;
+    int nblocks;
+    int cap;
+    int n;
+    int valid;
+};
+
+/* Bracket matching: the rows in blocks of about KILO_BRACKET_BLOCK, and a
+ * segment tree over the blocks (node 1 the root, block i the leaf size + i)
+ * of their combined BracketSums and row counts, so the rows between a
+ * bracket and its match are stepped over in O(log n) and only the rows of the
+ * blocks at either end are scanned. A row rehighlighted, added or removed
+ * only marks its block dirty; before the next match the dirty blocks are
+ * summed again from the sums kept in the rows, and split or dropped if they
+ * grew too big or emptied. at and rx are the brackets shown in the frame
+ * being drawn. */
+struct BracketBlock
+{
+    struct BracketSum sum;
+    int n;
+    int dirty;
+};
+
+struct Brackets
+{
+    struct BracketBlock* blocks;
+    int nblocks;
+    struct BracketSum* tree;
+    int* counts;
+    int size;
+    int* dirty;
+    int ndirty;
+    int dirtycap;
+    int n;
+    int valid;
+    int shown;
+    int at[2];
+    int rx[2];
+};
+
+/* Soft wrap: rows are folded into screen-wide visual lines. The number of
+ * visual lines of every row is kept in a Fenwick tree so the view and the
+ * cursor move in visual lines without walking from the top. sub is the first
+ * visual line of row rowoff shown at the top of the screen. built is whether
+ * the tree counts wrapped lines: windows onto one buffer wrap separately. */
+struct Wrap
+{
+    int enabled;
+    int cols;
+    int built;
+    int sub;
+    struct Fenwick lines;
+};
+
+/* Folded regions as disjoint row ranges sorted by start. Row start stays on
+ * screen as the fold's header and rows start + 1 to end are hidden: they
+ * count as no visual lines, so the view steps over them through the same
+ * Fenwick tree soft wrap uses. Rows added or removed shift the ranges. */
+struct Fold
+{
+    int start;
+    int end;
+};
+
+struct Folds
+{
+    struct Fold* ranges;
+    int count;
+    int cap;
+};
+
+/* Compressed files: gzip through zlib and zstd through libzstd, each when
+ * built in. Which one a file is comes from its magic on open, and E.codec
+ * keeps it for the save; a new file (codec -1) goes by its name. */
+enum Codec
+{
+    CODEC_NONE = 0,
+    CODEC_GZIP,
+    CODEC_ZSTD,
+};
+
+enum UndoType
+{
+    UNDO_INSERT = 1,
+    UNDO_DELETE,
+    UNDO_INSERT_ROWS,
+    UNDO_DELETE_ROWS,
+    UNDO_ENDING,
+};
+
+/* One edit in the undo arena: this header, the text the edit added or
+ * removed padded to 4 bytes, then the record's size so undo can step back
+ * over it. Row edits hold count rows, each an int length, the row's line
+ * ending and its text. An ending change keeps the old ending in col and the
+ * new one in count. The cursor is where it was before the key (cx, cy) and after it (ax, ay). */
+struct UndoRecord
+{
+    int type;
+    int row;
+    int col;
+    int len;
+    int count;
+    int cx;
+    int cy;
+    int ax;
+    int ay;
+    unsigned int group;
+};
+
+/* Edit history as records packed into one arena, oldest first. Records
+ * before pos are applied: undo steps back over them a key (group) at a time
+ * and redo replays the ones after. Typing next to the last record extends
+ * it instead of adding another. Past budget bytes (0 = unlimited) the oldest
+ * keys are dropped. saved is pos when the file was last written, or -1 once
+ * that state is gone. cx and cy are the cursor as the current key began. */
+struct Undo
+{
+    char* buf;
+    long long len;
+    long long cap;
+    long long pos;
+    long long saved;
+    long long budget;
+    unsigned int group;
+    unsigned int lastkey;
+    int cx;
+    int cy;
+    int touched;
+    int paused;
+};
+
+/* Extra cursors (CTRL-D) and the column block (CTRL-V), besides the primary
+ * cursor in E.cx/E.cy. Cursors are kept sorted by row and column. The block
+ * runs from its anchor, row by at render column bx, to the primary cursor.
+ * A typed char or deletion applies at every cursor, or on every row of the
+ * block, where len is the selected chars. */
+struct Cursor
+{
+    int row;
+    int col;
+    int len;
+};
+
+struct Cursors
+{
+    struct Cursor* at;
+    int count;
+    int cap;
+    int block;
+    int bx;
+    int by;
+};
+
+/* Word index for completion: a trie over the buffer's words (runs of bytes
+ * between is_separator boundaries, up to KILO_WORD_MAX long) with the number
+ * of times each occurs. best is the highest count in a node's subtree, so the
+ * most frequent completions of a prefix are found without visiting the rest.
+ * Built on the first completion, or in the background after a file of
+ * KILO_WORD_BACKGROUND bytes or more loads; from then on the row edits keep it
+ * up to date, taking out a row's words before it changes and adding them after. */
+struct WordNode
+{
+    int parent;
+    int child;
+    int next;
+    int count;
+    int best;
+    unsigned char c;
+};
+
+struct Words
+{
+    struct WordNode* nodes;
+    int n;
+    int cap;
+    int valid;
+    struct WordsJob* job;
+};
+
+/* A background build of the word index, read from the file as it was
+ * loaded. The row edits made meanwhile are logged, each as a row's text with
+ * the delta it was scanned with, and replayed over the result when it is
+ * taken. The build fails if the file changes under it, and is cancelled if
+ * the log outgrows KILO_WORD_LOG; either way the first completion builds the
+ * index from the rows instead. */
+struct WordsJob
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int fd;
+    off_t size;
+    struct stat st;
+    struct Words words;
+    int done;
+    int failed;
+    int cancel;
+    char* log;
+    long long loglen;
+    long long logcap;
+};
+
+/* The candidates CTRL-N cycles through, while it is pressed in a row. The
+ * last one shown went in as len chars after the prefix, which ends at row, col. */
+struct Complete
+{
+    int active;
+    int row;
+    int col;
+    int prefix;
+    int len;
+    int pick;
+    int n;
+    char* words[KILO_COMPLETE_MAX];
+};
+
+/* Hashes of the text lines as the terminal last showed them, so a frame only
+ * sends lines that changed and turns a vertical scroll into a scroll-region
+ * move. A hash of 0 marks a line whose contents are unknown. */
+struct Screen
+{
+    unsigned long long* lines;
+    int rows;
+    int cols;
+    long long top;
+    int coloff;
+    int valid;
+};
+
+/* A window's view of a buffer: the part of E that differs between windows. */
+struct View
+{
+    int buffer;
+    int top;
+    int height;
+    int cx;
+    int cy;
+    int rx;
+    int rowoff;
+    int coloff;
+    int wrap;
+    int sub;
+    long long drawn_top;
+    int drawn_coloff;
+};
+
+/* The part of E that belongs to an open file. Every view of a buffer shares
+ * its rows, and with them the render and highlight caches, so an extra
+ * window costs a View. cx and cy are where the last view to leave it was. */
+struct Buffer
+{
+    int numrows;
+    int rowcap;
+    ERow* row;
+    char* filename;
+    char dirty;
+    struct EditorSyntax* syntax;
+    struct RowCache cache;
+    struct LineIndex index;
+    int readonly;
+    struct Fenwick offsets;
+    struct Snapshot snapshot;
+    int wrapcols;
+    int wrapbuilt;
+    struct Fenwick wraplines;
+    struct Folds folds;
+    struct Undo undo;
+    struct Disk disk;
+    int codec;
+    struct Words words;
+    struct Brackets brackets;
+    int cx;
+    int cy;
+};
+
+/* Windows stacked top to bottom, each followed by its status bar. E holds
+ * the buffer and view of the current window; the others wait here. Until
+ * the first split or second file there are none and E is the only view. */
+struct Windows
+{
+    struct Buffer* buffers;
+    int nbuffers;
+    struct View* views;
+    int nviews;
+    int current;
+    int rows;
+};
+
+/* Terminal bytes read ahead of the key decoder, so a paste costs a read per
+ * buffer rather than one per byte. */
+struct Input
+{
+    char buf[4096];
+    int len;
+    int at;
+};
+
+/* A client's socket is non-blocking: in collects a message until it is
+ * whole and out holds the frames the socket has not taken yet. */
+struct ServerClient
+{
+    int fd;
+    int rows;
+    int cols;
+    unsigned char in[2 + 255];
+    int inlen;
+    char* out;
+    int outlen;
+    int outcap;
+};
+
+/* Daemon mode (kilo -S): the editor keeps its buffers loaded without a
+ * terminal and kilo -a attaches to it over a Unix socket. Clients send
+ * messages of a type byte, a length byte and the payload: key bytes, or the
+ * window size as two big-endian 16-bit rows and columns. They get back plain
+ * terminal output. All clients share the session: keys from any of them are
+ * processed and every frame goes to all of them, drawn at the smallest
+ * attached size. pending holds the keys of the last message, from client
+ * `from`. */
+struct Server
+{
+    int fd;
+    const char* path;
+    struct ServerClient* clients;
+    int nclients;
+    int from;
+    char pending[256];
+    int npending;
+    int at;
+};
+
+/* A keyboard macro: the terminal bytes read between CTRL-X ( and CTRL-X ),
+ * and the offsets at which a read came back empty, so a lone ESC replays as
+ * one. While replaying, EditorReadByte takes from keys instead of the
+ * terminal, nothing is drawn and edited rows are highlighted once at the
+ * end. keystart is where the key being processed began. */
+struct Macro
+{
+    char* keys;
+    int len;
+    int cap;
+    int* timeouts;
+    int ntimeouts;
+    int tcap;
+    int recording;
+    int replaying;
+    int keystart;
+    int at;
+    int timeout;
+    int stale;
+};
+
 struct EditorConfig
 {
     int cx;
@@ -99,6 +805,7 @@ struct EditorConfig
     int screenrows;
     int screencols;
     int numrows;
+    int rowcap;
     ERow* row;
     char* filename;
     char statusmsg[80];
@@ -106,6 +813,35 @@ struct EditorConfig
     time_t statusmsg_time;
     struct EditorSyntax* syntax;
     struct termios orig_termios;
+    int ifd;
+    int ofd;
+    int recordfd;
+    struct Input input;
+    int headless;
+    long long outbytes;
+    struct KeyLatency lat;
+    struct Trace trace;
+    struct RowCache cache;
+    struct Stream stream;
+    struct LineIndex index;
+    int readonly;
+    struct Fenwick offsets;
+    struct Snapshot snapshot;
+    struct Wrap wrap;
+    struct Folds folds;
+    struct Undo undo;
+    struct Cursors cursors;
+    struct Words words;
+    struct Complete complete;
+    struct Brackets brackets;
+    struct Disk disk;
+    int codec;
+    struct Watch watch;
+    struct Grep grep;
+    struct Screen screen;
+    struct Windows win;
+    struct Server server;
+    struct Macro macro;
 };
 
 struct EditorConfig E;
@@ -117,10 +853,74 @@ struct ABuf
 };
 
 void EditorRefreshScreen();
+char* EditorRowRender(ERow* row);
+void EditorRowGetHighlight(ERow* row, unsigned char* hl);
+void EditorRowSetHighlight(ERow* row, unsigned char* hl);
 char* EditorPrompt(char* prompt, void (*callback)(char*, int));
 int EditorRowRxToCx(ERow* row, int rx);
+int EditorRowCxToRx(ERow* row, int cx);
 void EditorSelectSyntaxHighlight();
 void EditorUpdateRow(ERow* row);
+void EditorRowEnsure(ERow* row);
+void EditorRowLoad(ERow* row);
+void EditorRowOwn(ERow* row);
+void EditorRowDelChars(ERow* row, int at, int len);
+void EditorUndoEnding(int at, int from, int to);
+int EditorReadOnly();
+void EditorSnapshotWrite();
+void EditorSnapshotAll();
+ERow* EditorRowAt(int at);
+int EditorIndexRowContains(int at, const char* query);
+void EditorWrapUpdate(ERow* row);
+void EditorWrapLocate(long long line, int* row, int* sub);
+long long EditorWrapCursor(int* col);
+void EditorWrapMoveTo(long long line, int col);
+long long EditorScreenTop();
+int EditorVisualLines();
+int EditorFoldHiding(int at);
+void EditorFoldShift(int at, int delta);
+void EditorFoldReveal(int at);
+void EditorDrawFoldMarker(struct ABuf* aBuf, int at, int from);
+void EditorToggleFold();
+int EditorCursorsActive();
+void EditorCursorsClear();
+void EditorCursorsMove(int key);
+void EditorAddCursor();
+void EditorToggleBlock();
+int EditorCursorMarks(int at, int* marks, int max);
+void EditorBatchEdit(int key);
+void EditorWordsRow(ERow* row, int delta);
+void EditorComplete();
+void EditorCompleteClear();
+void EditorRowBrackets(ERow* row, const char* render, const unsigned char* hl);
+void EditorBracketsUpdate(int at);
+void EditorBracketsInsert(int at, int n);
+void EditorBracketsDelete(int at, int n);
+int EditorBracketMatch(int* at, int* rx);
+void EditorJumpBracket();
+int EditorOpenFile(const char* name);
+void EditorGrep(int regex);
+void EditorGrepRead();
+int EditorGrepResults();
+void EditorGrepOpen();
+void EditorSortLines();
+void EditorUniqueLines();
+void EditorFilterLines(int invert);
+void EditorIndexRow(int at, const char** start, int* len);
+void EditorWindowCommand();
+int EditorAnyDirty();
+int ServerReadByte(char* c);
+void ServerBroadcast(const char* s, int len);
+void ServerDetach();
+off_t EditorOpen(const char* filename);
+void EditorWatch();
+void EditorReload();
+void EditorWatchApply();
+void EditorStreamAppend(const char* buf, int len);
+int WriteAll(int fd, const char* s, int len);
+int CodecFromName(const char* filename, int* suffix);
+int CodecBuilt(int codec);
+long long EditorWriteEncoded(int fd, int codec);
 
 int EditorSyntaxToColor(int hl)
 {
@@ -152,6 +952,10 @@ int is_separator(int c)
 
 void AbAppend(struct ABuf* ab, const char* s, int len)
 {
+    if (len == 0)
+    {
+        return;
+    }
     char* newBuf = (char*)(realloc(ab->b, ab->len + len));
 
     if (newBuf == NULL)
@@ -179,7 +983,8 @@ void Die(const char* s)
 
 void DisableRawModel()
 {
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
+    if (tcsetattr(E.ifd, TCSAFLUSH, &E.orig_termios) == -1)
     {
         Die("tcsetattr");
     }
@@ -187,7 +992,7 @@ void DisableRawModel()
 
 void EnableRawModel()
 {
-    if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1)
+    if (tcgetattr(E.ifd, &E.orig_termios) == -1)
     {
         Die("tcsgetattr");
     }
@@ -199,10 +1004,128 @@ void EnableRawModel()
     raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
     raw.c_cc[VMIN] = 0;
     raw.c_cc[VTIME] = 1;
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
+    if (tcsetattr(E.ifd, TCSAFLUSH, &raw) == -1)
     {
         Die("tcsetattr");
     }
+    /* bracketed paste: pasted text arrives between \x1b[200~ and \x1b[201~ */
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+long long NowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void EditorWrite(const char* s, int len)
+{
+    E.outbytes += len;
+    if (E.server.fd != -1)
+    {
+        ServerBroadcast(s, len);
+    }
+    else if (E.ofd != -1)
+    {
+        write(E.ofd, s, len);
+    }
+}
+
+void KeyLatencyStart()
+{
+    E.lat.start = NowNs();
+}
+
+void KeyLatencyStop()
+{
+    if (E.lat.start == 0)
+    {
+        return;
+    }
+
+    long long dur = NowNs() - E.lat.start;
+    if (E.headless)
+    {
+        if (E.lat.count == E.lat.cap)
+        {
+            E.lat.cap = E.lat.cap ? E.lat.cap * 2 : 1024;
+            E.lat.samples = (long long*)realloc(E.lat.samples, sizeof(long long) * E.lat.cap);
+        }
+        E.lat.samples[E.lat.count++] = dur;
+    }
+    E.lat.rolling = E.lat.rolling ? (E.lat.rolling * 7 + dur) / 8 : dur;
+    E.lat.start = 0;
+}
+
+long long TraceBegin()
+{
+    return E.trace.enabled ? NowNs() : 0;
+}
+
+void TraceEnd(const char* name, long long start)
+{
+    if (!E.trace.enabled)
+    {
+        return;
+    }
+
+    struct TraceEvent* ev = &E.trace.events[E.trace.head];
+    ev->name = name;
+    ev->ts = start;
+    ev->dur = NowNs() - start;
+    E.trace.head = (E.trace.head + 1) % KILO_TRACE_EVENTS;
+    if (E.trace.count < KILO_TRACE_EVENTS)
+    {
+        E.trace.count += 1;
+    }
+}
+
+int TraceDump()
+{
+    if (!E.trace.enabled)
+    {
+        return -1;
+    }
+
+    FILE* fp = fopen(E.trace.path, "w");
+    if (!fp)
+    {
+        return -1;
+    }
+
+    fprintf(fp, "{\"traceEvents\": [\n");
+    int first = (E.trace.head - E.trace.count + KILO_TRACE_EVENTS) % KILO_TRACE_EVENTS;
+    for (int i = 0; i < E.trace.count; ++i)
+    {
+        struct TraceEvent* ev = &E.trace.events[(first + i) % KILO_TRACE_EVENTS];
+        fprintf(fp, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f, \"dur\": %.3f}%s\n",
+                ev->name, (ev->ts - E.trace.origin) / 1e3, ev->dur / 1e3, i + 1 < E.trace.count ? "," : "");
+    }
+    fprintf(fp, "]}\n");
+    fclose(fp);
+    return E.trace.count;
+}
+
+void TraceDumpAtExit()
+{
+    TraceDump();
+}
+
+void TraceInit()
+{
+    char* path = getenv("KILO_TRACE");
+    if (path == NULL || *path == '\0')
+    {
+        return;
+    }
+
+    E.trace.enabled = 1;
+    E.trace.path = path;
+    E.trace.events = (struct TraceEvent*)malloc(sizeof(struct TraceEvent) * KILO_TRACE_EVENTS);
+    E.trace.origin = NowNs();
+    E.lat.enabled = 1;
+    atexit(TraceDumpAtExit);
 }
 
 void EditorSetStatusMessage(const char* fmt, ...)
@@ -219,7 +1142,7 @@ char* EditorRowsToString(int* bufLen)
     int totlen = 0;
     for (int i = 0; i < E.numrows; ++i)
     {
-        totlen += E.row[i].size + 1;
+        totlen += E.row[i].size + E.row[i].eol;
     }
 
     if (bufLen)
@@ -233,6 +1156,8 @@ char* EditorRowsToString(int* bufLen)
     {
         memcpy(p, E.row[i].chars, E.row[i].size);
         p += E.row[i].size;
+        memset(p, '\r', E.row[i].eol - 1);
+        p += E.row[i].eol - 1;
         *p = '\n';
         ++p;
     }
@@ -247,12 +1172,23 @@ void EditorFindCallback(char* query, int key)
 
 
     static int saved_hl_line;
+    static int saved_hl_runs;
     static unsigned char* saved_hl = NULL;
 
     if (saved_hl)
     {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
+        ERow* row = &E.row[saved_hl_line];
+        if (row->cache & ROW_CACHED)
+        {
+            E.cache.bytes += (saved_hl_runs - row->hlruns) * 2;
+            free(row->hl);
+            row->hl = saved_hl;
+            row->hlruns = saved_hl_runs;
+        }
+        else
+        {
+            free(saved_hl);
+        }
         saved_hl = NULL; 
     }
 
@@ -294,18 +1230,35 @@ void EditorFindCallback(char* query, int key)
         }
 
         ERow* row = &E.row[current];
-        char* match = strstr(row->render, query);
+        if (row->chars == NULL && !EditorIndexRowContains(current, query))
+        {
+            continue;
+        }
+        EditorRowEnsure(row);
+        char* render = EditorRowRender(row);
+        char* match = strstr(render, query);
         if (match)
         {
             last_match = current;
+            EditorFoldReveal(current);
             E.cy = current;
-            E.cx = EditorRowRxToCx(row, match - row->render);
+            E.cx = EditorRowRxToCx(row, match - render);
             E.rowoff = E.numrows;
+            E.wrap.sub = 0;
 
+            EditorRowOwn(row);
             saved_hl_line = current;
-            saved_hl = (unsigned char*)malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
+            saved_hl_runs = row->hlruns;
+            saved_hl = row->hl;
+
+            unsigned char* hl = (unsigned char*)malloc(row->rsize + 1);
+            EditorRowGetHighlight(row, hl);
+            memset(&hl[match - render], HL_MATCH, strlen(query));
+            E.cache.bytes -= row->hlruns * 2;
+            row->hl = NULL;
+            row->hlruns = 0;
+            EditorRowSetHighlight(row, hl);
+            free(hl);
             break;
         }
     }
@@ -317,6 +1270,7 @@ void EditorFind()
     int saved_cy = E.cy;
     int saved_coloff = E.coloff;
     int saved_rowoff = E.rowoff;
+    int saved_sub = E.wrap.sub;
 
     char* query = EditorPrompt("Search %s (ESC to cancel", EditorFindCallback);
     if (query == NULL)
@@ -325,6 +1279,7 @@ void EditorFind()
         E.cy = saved_cy;
         E.coloff = saved_coloff;
         E.rowoff = saved_rowoff;
+        E.wrap.sub = saved_sub;
     }
     else
     {
@@ -343,53 +1298,154 @@ void EditorSave()
             return;
         }
         EditorSelectSyntaxHighlight();
+        E.codec = -1;
     }
 
-    int len;
-    char* buf = EditorRowsToString(&len);
+    /* a file is written back as it was read; a new one goes by its suffix */
+    long long t = TraceBegin();
+    int suffix;
+    int codec = E.codec != -1 ? E.codec : CodecFromName(E.filename, &suffix);
+    if (!CodecBuilt(codec))
+    {
+        codec = CODEC_NONE;
+    }
+    int len = 0;
+    char* buf = codec ? NULL : EditorRowsToString(&len);
 
     int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != 0)
+    int err = errno;
+    if (fd != -1)
     {
-        if (ftruncate(fd, len) != -1)
+        long long written = -1;
+        if (codec)
         {
-            if (write(fd, buf, len) == len)
-            {
-                E.dirty = 0;
-                close(fd);
-                free(buf);
-                EditorSetStatusMessage("%d bytes written to disk", len);
-                E.dirty = 0;
-                return;
-            }
+            written = EditorWriteEncoded(fd, codec);
+        }
+        else if (ftruncate(fd, len) != -1 && write(fd, buf, len) == len)
+        {
+            written = len;
+        }
+        if (written != -1)
+        {
+            close(fd);
+            free(buf);
+            EditorSetStatusMessage("%lld bytes written to disk", written);
+            E.dirty = 0;
+            E.undo.saved = E.undo.pos;
+            EditorWatch();
+            EditorSnapshotWrite();
+            TraceEnd("EditorSave", t);
+            return;
         }
+        err = errno;
         close(fd);
     }
 
     free(buf);
-    EditorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    EditorSetStatusMessage("Can't save! I/O error: %s", strerror(err));
+    TraceEnd("EditorSave", t);
 }
 
-int EditorReadKey()
+/* The next byte of the macro being replayed, 0 where the recording read
+ * nothing, or -1 once it has run out. */
+int MacroReadByte(char* c)
 {
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
+    struct Macro* m = &E.macro;
+    if (m->timeout < m->ntimeouts && m->timeouts[m->timeout] == m->at)
     {
-        if (nread == -1 && errno != EAGAIN)
-            Die("read");
+        m->timeout += 1;
+        return 0;
+    }
+    if (m->at == m->len)
+    {
+        return -1;
+    }
+    *c = m->keys[m->at++];
+    return 1;
+}
+
+void MacroRecord(const char* c, int nread)
+{
+    struct Macro* m = &E.macro;
+    if (nread == 1)
+    {
+        if (m->len == m->cap)
+        {
+            m->cap = m->cap ? m->cap * 2 : 256;
+            m->keys = (char*)realloc(m->keys, m->cap);
+        }
+        m->keys[m->len++] = *c;
+    }
+    else if (nread == 0 && (m->ntimeouts == 0 || m->timeouts[m->ntimeouts - 1] != m->len))
+    {
+        if (m->ntimeouts == m->tcap)
+        {
+            m->tcap = m->tcap ? m->tcap * 2 : 64;
+            m->timeouts = (int*)realloc(m->timeouts, sizeof(int) * m->tcap);
+        }
+        m->timeouts[m->ntimeouts++] = m->len;
+    }
+}
+
+int EditorReadByte(char* c)
+{
+    int nread = 1;
+    if (E.macro.replaying)
+    {
+        nread = MacroReadByte(c);
+        if (nread != -1)
+        {
+            return nread;
+        }
+        /* ran out inside a prompt: the terminal finishes it */
+        E.macro.replaying = 0;
+        nread = 1;
+    }
+    if (E.server.fd != -1)
+    {
+        nread = ServerReadByte(c);
+    }
+    else
+    {
+        if (E.input.at == E.input.len)
+        {
+            nread = read(E.ifd, E.input.buf, sizeof(E.input.buf));
+            E.input.len = nread > 0 ? nread : 0;
+            E.input.at = 0;
+        }
+        if (E.input.at < E.input.len)
+        {
+            *c = E.input.buf[E.input.at++];
+            nread = 1;
+        }
+    }
+    if (nread == 0 && E.headless)
+    {
+        exit(0);
+    }
+    if (nread == 1 && E.recordfd != -1)
+    {
+        write(E.recordfd, c, 1);
+    }
+    if (E.macro.recording)
+    {
+        MacroRecord(c, nread);
     }
+    return nread;
+}
 
+int EditorDecodeKey(char c)
+{
     if (c == '\x1b')
     {
         char seq[3];
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1)
+        if (EditorReadByte(&seq[0]) != 1)
         {
             return '\x1b';
         }
 
-        if (read(STDIN_FILENO, &seq[1], 1) != 1)
+        if (EditorReadByte(&seq[1]) != 1)
         {
             return '\x1b';
         }
@@ -398,7 +1454,7 @@ int EditorReadKey()
         {
             if (seq[1] > '0' && seq[1] <= '9')
             {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1)
+                if (EditorReadByte(&seq[2]) != 1)
                 {
                     return '\x1b';
                 }
@@ -422,6 +1478,24 @@ int EditorReadKey()
                             return END_KEY;
                     }
                 }
+                else if (seq[2] >= '0' && seq[2] <= '9')
+                {
+                    /* longer codes: function keys, and 200 opening a bracketed paste */
+                    int code = (seq[1] - '0') * 10 + (seq[2] - '0');
+                    char d;
+                    while (EditorReadByte(&d) == 1 && d != '~')
+                    {
+                        if (d < '0' || d > '9')
+                        {
+                            return '\x1b';
+                        }
+                        code = code * 10 + (d - '0');
+                    }
+                    if (code == 200)
+                    {
+                        return PASTE_START;
+                    }
+                }
             }
             else
             {
@@ -461,9 +1535,35 @@ int EditorReadKey()
     }
 }
 
+int EditorReadKey()
+{
+    if (E.lat.enabled)
+    {
+        KeyLatencyStop();
+    }
+
+    int nread;
+    char c;
+    while ((nread = EditorReadByte(&c)) != 1)
+    {
+        if (nread == -1 && errno != EAGAIN)
+            Die("read");
+    }
+
+    long long t = TraceBegin();
+    int key = EditorDecodeKey(c);
+    TraceEnd("EditorReadKey", t);
+
+    if (E.lat.enabled)
+    {
+        KeyLatencyStart();
+    }
+    return key;
+}
+
 void EditorMoveKey(int key)
 {
-    ERow* row = (E.cy >= E.numrows)? NULL : &E.row[E.cy];
+    ERow* row = (E.cy >= E.numrows)? NULL : EditorRowAt(E.cy);
 
     switch(key)
     {
@@ -475,7 +1575,12 @@ void EditorMoveKey(int key)
             else if (E.cy != 0)
             {
                 E.cy -= 1;
-                E.cx = E.row[E.cy].size;
+                int f = E.folds.count ? EditorFoldHiding(E.cy) : -1;
+                if (f != -1)
+                {
+                    E.cy = E.folds.ranges[f].start;
+                }
+                E.cx = EditorRowAt(E.cy)->size;
             }
             break; 
         case ARROW_RIGHT:
@@ -486,24 +1591,34 @@ void EditorMoveKey(int key)
             else if (row && E.cx == row->size)
             {
                 E.cy += 1;
+                int f = E.folds.count ? EditorFoldHiding(E.cy) : -1;
+                if (f != -1)
+                {
+                    E.cy = E.folds.ranges[f].end + 1;
+                }
                 E.cx = 0;
             }
             break;
         case ARROW_UP: 
-            if (E.cy != 0)
+        case ARROW_DOWN:
+            if (EditorVisualLines())
+            {
+                int col;
+                long long line = EditorWrapCursor(&col);
+                EditorWrapMoveTo(line + (key == ARROW_DOWN ? 1 : -1), col);
+            }
+            else if (key == ARROW_UP && E.cy != 0)
             {
                 E.cy -= 1;
             }
-            break;
-        case ARROW_DOWN:
-            if (E.cy != E.numrows)
+            else if (key == ARROW_DOWN && E.cy != E.numrows)
             {
                 E.cy += 1;
             }
             break;
     }
 
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = (E.cy >= E.numrows) ? NULL : EditorRowAt(E.cy);
     int rowlen = row ? row->size : 0;
     if (E.cx > rowlen)
     {
@@ -511,864 +1626,9265 @@ void EditorMoveKey(int key)
     }
 }
 
-void EditorUpdateSyntax(ERow* row)
+char* EditorRowRender(ERow* row)
 {
-    row->hl = (unsigned char*)realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
+    return row->render ? row->render : row->chars;
+}
 
-    if (E.syntax == NULL)
+void EditorRowGetHighlight(ERow* row, unsigned char* hl)
+{
+    int i = 0;
+    for (int r = 0; r < row->hlruns; ++r)
     {
-        return;
+        memset(&hl[i], row->hl[r * 2 + 1], row->hl[r * 2]);
+        i += row->hl[r * 2];
     }
+    memset(&hl[i], HL_NORMAL, row->rsize - i);
+}
 
-    char** keywords = E.syntax->keywords;
-
-    char* scs = E.syntax->singleline_comment_start;
-    char* mcs = E.syntax->multiline_comment_start;
-    char* mce = E.syntax->multiline_comment_end;
-
-    int scs_len = scs? strlen(scs) : 0;
-    int mcs_len = mcs? strlen(mcs) : 0;
-    int mce_len = mce? strlen(mce) : 0;
+/* Stores the per-column classes in hl as runs of at most 255 columns. The
+ * trailing HL_NORMAL run is left implicit, so a plain line needs no runs.
+ * Does not touch E.cache, so it is safe to call from loader threads. */
+void EditorRowStoreHighlight(ERow* row, unsigned char* hl)
+{
+    int end = row->rsize;
+    while (end > 0 && hl[end - 1] == HL_NORMAL)
+    {
+        end -= 1;
+    }
 
-    int prev_sep = 1;
-    int in_string = 0;
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+    int runs = 0;
+    for (int i = 0; i < end; ++runs)
+    {
+        int j = i + 1;
+        while (j < end && j - i < 255 && hl[j] == hl[i])
+        {
+            j += 1;
+        }
+        i = j;
+    }
 
-    for (int i = 0; i < row->rsize; ++i)
+    if (runs != row->hlruns || row->hl == NULL)
     {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+        free(row->hl);
+        row->hl = runs ? (unsigned char*)malloc(runs * 2) : NULL;
+        row->hlruns = runs;
+    }
 
-        if (scs_len && !in_string && !in_comment)
+    unsigned char* run = row->hl;
+    for (int i = 0; i < end; run += 2)
+    {
+        int j = i + 1;
+        while (j < end && j - i < 255 && hl[j] == hl[i])
         {
-            if (!strncmp(&row->render[i], scs, scs_len))
-            {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - 1);
-                break;
-            }
+            j += 1;
         }
+        run[0] = j - i;
+        run[1] = hl[i];
+        i = j;
+    }
+}
+
+void EditorRowSetHighlight(ERow* row, unsigned char* hl)
+{
+    EditorRowOwn(row);
+    int before = row->hlruns;
+    EditorRowStoreHighlight(row, hl);
+    E.cache.bytes += (row->hlruns - before) * 2;
+}
+
+/* A byte ends a word when it would move the lexer out of one. */
+int SyntaxIsSeparator(const struct SyntaxTable* t, unsigned char c)
+{
+    return (t->step[SS_WORD][t->cls[c] & ~SC_TOKEN] & 0x0f) == SS_SEP;
+}
+
+/* Highlights one line of rendered text into hl, starting inside a multi-line
+ * comment when in_comment is set. Returns whether the line ends inside one.
+ * Reads only E.syntax, so loader threads can call it concurrently. */
+int EditorHighlightLine(char* render, int rsize, int in_comment, unsigned char* hl)
+{
+    const struct SyntaxTable* t = E.syntax->table;
+    const unsigned char* text = (const unsigned char*)render;
+    int state = SS_SEP;
+    int i = 0;
+
+    if (t->mce == NULL)
+    {
+        in_comment = 0;
+    }
 
-        if (mcs_len && mce_len && !in_string)
+    while (i < rsize)
+    {
+        if (in_comment)
         {
-            if (in_comment)
+            /* only the closing delimiter matters until it turns up */
+            const char* end = NULL;
+            for (const char* p = &render[i]; (p = memchr(p, t->mce[0], &render[rsize] - p)) != NULL; ++p)
             {
-                row->hl[i] = HL_MLCOMMENT;
-                if (!strncmp(&row->render[i], mce, mce_len))
+                if (&render[rsize] - p >= t->mce_len && !memcmp(p, t->mce, t->mce_len))
                 {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-                    i += mce_len;
-                    in_comment = 0;
-                    prev_sep = 1;
-                    continue;
+                    end = p + t->mce_len;
+                    break;
                 }
             }
-            else if (!strncmp(&row->render[i], mcs, mcs_len))
+            int stop = end ? end - render : rsize;
+            memset(&hl[i], HL_MLCOMMENT, stop - i);
+            if (!end)
             {
-                memset(&row->hl[i], HL_COMMENT, mcs_len);
-                i += mcs_len;
-                in_comment = 1;
-                continue;
+                return 1;
             }
+            i = stop;
+            in_comment = 0;
+            state = SS_SEP;
+            continue;
         }
 
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS)
+        unsigned char c = t->cls[text[i]];
+        if ((c & SC_TOKEN) && state < SS_STRING)
         {
-            if (in_string)
+            int mcs = 0;
+            int keyword = 0;
+            int kind = 0;
+            int node = 0;
+            for (int j = i; j < rsize && (node = t->trie[node][text[j]]) != 0; ++j)
             {
-                row->hl[i] = HL_STRING;
-                if (c == '\\' && i + 1 < row->rsize)
+                int accept = t->accept[node];
+                int len = j - i + 1;
+                if (accept & TOK_SCS)
                 {
-                    row->hl[i + 1] = HL_STRING;
-                    i += 1;
-                    continue;
+                    memset(&hl[i], HL_COMMENT, rsize - i);
+                    return 0;
                 }
-                if (c == in_string)
+                if (accept & TOK_MCS)
                 {
-                    in_string = 0;
+                    mcs = len;
                 }
-                prev_sep = 1;
-                continue;
-            }
-            else
-            {
-                if (c == '"' || c == '\'')
+                if ((accept & (TOK_KEYWORD1 | TOK_KEYWORD2)) && state == SS_SEP &&
+                    (j + 1 == rsize || SyntaxIsSeparator(t, text[j + 1])))
                 {
-                    in_string = c;
-                    row->hl[i] = HL_STRING;
-                    continue;
+                    keyword = len;
+                    kind = accept;
                 }
             }
-        }
 
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS)
-        {
-            if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_sep == HL_NUMBER))
+            if (mcs)
             {
-                row->hl[i] = HL_NUMBER;
-                prev_sep = 0;
+                memset(&hl[i], HL_COMMENT, mcs);
+                i += mcs;
+                in_comment = 1;
                 continue;
             }
-        }
-
-        if (prev_sep)
-        {
-            int j = 0;
-            for (; keywords[j] != NULL; ++j)
-            {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-                if (kw2)
-                {
-                    klen -= 1;
-                }
-
-                if (!strncmp(&row->render[i], keywords[j], klen) && is_separator(row->render[i + klen]))
-                {
-                    memset(&row->hl[i], kw2? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
-                    break;
-                }
-            }
-
-            if (keywords[j] != NULL)
+            if (keyword)
             {
-                prev_sep = 0;
+                memset(&hl[i], (kind & TOK_KEYWORD1) ? HL_KEYWORD1 : HL_KEYWORD2, keyword);
+                i += keyword;
+                state = SS_WORD;
                 continue;
             }
         }
 
-        prev_sep = is_separator(c);
+        unsigned char next = t->step[state][c & ~SC_TOKEN];
+        hl[i] = next >> 4;
+        state = next & 0x0f;
+        i += 1;
+    }
+
+    return in_comment;
+}
+
+/* Highlights a row whose render is current. Returns whether the row's
+ * hl_open_comment changed, in which case the next row needs re-highlighting. */
+int EditorUpdateSyntax(ERow* row)
+{
+    static unsigned char* hlbuf = NULL;
+    static int hlcap = 0;
+
+    if (row->rsize + 1 > hlcap)
+    {
+        hlcap = row->rsize + 1;
+        hlbuf = (unsigned char*)realloc(hlbuf, hlcap);
+    }
+    unsigned char* hl = hlbuf;
+
+    if (E.syntax == NULL)
+    {
+        memset(hl, HL_NORMAL, row->rsize);
+        EditorRowSetHighlight(row, hl);
+        EditorRowBrackets(row, EditorRowRender(row), hl);
+        EditorBracketsUpdate(row - E.row);
+        return 0;
+    }
+
+    long long t = TraceBegin();
+    int idx = row - E.row;
+    int in_comment = (idx > 0 && E.row[idx - 1].hl_open_comment);
+    if (idx > 0 && E.row[idx - 1].chars == NULL)
+    {
+        /* unloaded rows of an indexed file carry their state in the index */
+        in_comment = (E.index.entries[idx] & KILO_INDEX_COMMENT) != 0;
     }
+    in_comment = EditorHighlightLine(EditorRowRender(row), row->rsize, in_comment, hl);
 
     int changed = (row->hl_open_comment != in_comment);
     row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < E.numrows)
-        EditorUpdateRow(&E.row[row->idx + 1]);
+    TraceEnd("EditorUpdateSyntax", t);
+    EditorRowSetHighlight(row, hl);
+    EditorRowBrackets(row, EditorRowRender(row), hl);
+    EditorBracketsUpdate(idx);
+    return changed;
 }
 
-void EditorUpdateRow(ERow* row)
+long long EditorRowCacheBytes(ERow* row)
 {
-    int tabs = 0;
-    for (int j = 0; j < row->size; ++j)
+    if (row->cache & ROW_MAPPED)
     {
-        if (row->chars[j] == '\t')
-        {
-            tabs += 1;
-        }
+        return 0;
     }
+    return (row->render ? row->rsize + 1 : 0) + row->hlruns * 2;
+}
 
-    free(row->render);
-    row->render = (char*)malloc(row->size + tabs * (KILO_TAB_STOP - 1) + 1);
+int CountTabs(const char* chars, int size)
+{
+    int tabs = 0;
+    const char* end = chars + size;
+    while ((chars = (const char*)memchr(chars, '\t', end - chars)) != NULL)
+    {
+        tabs += 1;
+        chars += 1;
+    }
+    return tabs;
+}
 
+/* Expands tabs from chars into out, which needs room for
+ * size + tabs * (KILO_TAB_STOP - 1) + 1 bytes. Returns the rendered length. */
+int RenderTabs(const char* chars, int size, char* out)
+{
     int idx = 0;
-    for (int j = 0; j < row->size; ++j)
+    for (int j = 0; j < size; ++j)
     {
-        if (row->chars[j] == '\t')
+        if (chars[j] == '\t')
         {
-            row->render[idx++] = ' ';
+            out[idx++] = ' ';
             while (idx % KILO_TAB_STOP != 0)
             {
-                row->render[idx++] = ' ';
+                out[idx++] = ' ';
             }
         }
         else
         {
-            row->render[idx++] = row->chars[j];
+            out[idx++] = chars[j];
         }
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
-    EditorUpdateSyntax(row);
+    out[idx] = '\0';
+    return idx;
 }
 
-void EditorInsertRow(int at, char* s, size_t len)
+/* Like EditorRowBuildRender but leaves E.cache alone, for loader threads. */
+void EditorRowStoreRender(ERow* row)
 {
-    if (at < 0 || at > E.numrows)
-    {
-        return;
-    }
-    E.row = (ERow*)realloc(E.row, sizeof(ERow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(ERow) * (E.numrows - at));
-    for (int j = at + 1; j <= E.numrows; ++j)
+    int tabs = CountTabs(row->chars, row->size);
+
+    free(row->render);
+    row->render = NULL;
+    row->rsize = row->size;
+    if (tabs)
     {
-        E.row[j].idx += 1;
+        row->render = (char*)malloc(row->size + tabs * (KILO_TAB_STOP - 1) + 1);
+        row->rsize = RenderTabs(row->chars, row->size, row->render);
     }
-
-    E.row[at].idx = at;
-    E.row[at].size = len;
-    E.row[at].chars = (char*)malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
-
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    EditorUpdateRow(&E.row[at]);
-
-    E.numrows += 1;
-    E.dirty += 1;
+    row->cache |= ROW_CACHED | ROW_REFERENCED;
 }
 
-void EditorInsertNewLine()
+void EditorRowBuildRender(ERow* row)
 {
-    if (E.cx == 0)
-    {
-        EditorInsertRow(E.cy, "", 0);
-    }
-    else
-    {
-        ERow* row = &E.row[E.cy];
-        EditorInsertRow(E.cy + 1, &row->chars[E.cy], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        EditorUpdateRow(row);
-    }
-    E.cy += 1;
-    E.cx = 0;
+    EditorRowOwn(row);
+    E.cache.bytes -= row->render ? row->rsize + 1 : 0;
+    EditorRowStoreRender(row);
+    E.cache.bytes += row->render ? row->rsize + 1 : 0;
+    EditorWrapUpdate(row);
 }
 
-void EditorFreeRow(ERow* row)
+void EditorRowEvict(ERow* row)
 {
-    free(row->chars);
+    E.cache.bytes -= EditorRowCacheBytes(row);
     free(row->render);
     free(row->hl);
+    row->render = NULL;
+    row->hl = NULL;
+    row->hlruns = 0;
+    row->cache &= ROW_BRACKETS | ROW_STALE;
 }
 
-void EditorDelRow(int at)
+void EditorCacheTrim()
 {
-    if (at < 0 || at >= E.numrows)
+    if (E.cache.budget == 0)
     {
         return;
     }
-    EditorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(ERow) * (E.numrows - at - 1));
-    for (int j = at; j < E.numrows - 1; ++j)
+
+    for (int n = 0; n < E.numrows && E.cache.bytes > E.cache.budget; ++n)
     {
-        E.row[j].idx -= 1;
+        if (E.cache.hand >= E.numrows)
+        {
+            E.cache.hand = 0;
+        }
+
+        ERow* row = &E.row[E.cache.hand++];
+        if (row->cache & ROW_REFERENCED)
+        {
+            row->cache &= ~ROW_REFERENCED;
+        }
+        else if ((row->cache & (ROW_CACHED | ROW_MAPPED)) == ROW_CACHED)
+        {
+            /* mapped rows hold no heap; the kernel reclaims their pages */
+            EditorRowEvict(row);
+        }
     }
-    E.numrows -= 1;
-    E.dirty += 1;
 }
 
-void EditorRowAppendString(ERow* row, char* s, size_t len)
+/* Regenerates render/hl for an evicted row. Only chars and the previous row's
+ * hl_open_comment are needed, and both stay resident. */
+void EditorRowEnsure(ERow* row)
 {
-    row->chars = (char*)realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    EditorUpdateRow(row);
-    E.dirty += 1;
+    EditorRowLoad(row);
+    if (row->cache & ROW_CACHED)
+    {
+        E.cache.hits += 1;
+        row->cache |= ROW_REFERENCED;
+        return;
+    }
+
+    E.cache.misses += 1;
+    EditorRowBuildRender(row);
+    EditorUpdateSyntax(row);
+    EditorCacheTrim();
 }
 
-void EditorRowInsertChar(ERow* row, int at, int c)
+void EditorUpdateRow(ERow* row)
 {
-    if (at < 0 || at > row->size)
+    ERow* end = &E.row[E.numrows];
+
+    if (E.macro.replaying)
     {
-        at = row->size;
+        /* the old runs would not fit the new render, so the row goes plain */
+        EditorRowBuildRender(row);
+        E.cache.bytes -= row->hlruns * 2;
+        free(row->hl);
+        row->hl = NULL;
+        row->hlruns = 0;
+        row->cache |= ROW_STALE;
+        E.macro.stale = 1;
+        return;
     }
 
-    row->chars = (char*)realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size += 1;
-    row->chars[at] = c;
-    EditorUpdateRow(row);
-    E.dirty += 1;
+    EditorRowBuildRender(row);
+    while (EditorUpdateSyntax(row) && row + 1 < end)
+    {
+        row += 1;
+        if (!(row->cache & ROW_CACHED))
+        {
+            EditorRowBuildRender(row);
+        }
+    }
+    EditorCacheTrim();
 }
 
-void EditorInsertChar(int c)
+/* Highlights the rows a macro replay left stale, top down so a block comment
+ * opened in one carries on into the rows after it as EditorUpdateRow would. */
+void EditorHighlightFlush()
 {
-    if (E.cy == E.numrows)
+    if (!E.macro.stale)
     {
-        EditorInsertRow(E.numrows, "", 0);
+        return;
     }
+    E.macro.stale = 0;
 
-    EditorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx += 1;
+    long long t = TraceBegin();
+    for (int i = 0; i < E.numrows; ++i)
+    {
+        if (!(E.row[i].cache & ROW_STALE))
+        {
+            continue;
+        }
+        while (1)
+        {
+            ERow* row = &E.row[i];
+            row->cache &= ~ROW_STALE;
+            if (!(row->cache & ROW_CACHED))
+            {
+                EditorRowBuildRender(row);
+            }
+            if (!EditorUpdateSyntax(row) || i + 1 == E.numrows)
+            {
+                break;
+            }
+            i += 1;
+        }
+    }
+    EditorCacheTrim();
+    TraceEnd("EditorHighlightFlush", t);
 }
 
-void EditorRowDelChar(ERow* row, int at)
+void FenwickReserve(struct Fenwick* f, int nblocks)
 {
-    if (at < 0 || at >= row->size) return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size -= 1;
-    EditorUpdateRow(row);
-    E.dirty += 1;
+    if (nblocks + 1 > f->cap)
+    {
+        f->cap = (nblocks + 1) * 2;
+        f->blocks = (struct FenwickBlock*)realloc(f->blocks, sizeof(struct FenwickBlock) * f->cap);
+        f->counts = (long long*)realloc(f->counts, sizeof(long long) * f->cap);
+        f->sums = (long long*)realloc(f->sums, sizeof(long long) * f->cap);
+    }
 }
 
-void EditorDelChar()
+/* Rebuilds the trees over the blocks after blocks were split or dropped. */
+void FenwickIndex(struct Fenwick* f)
 {
-    if (E.cy >= E.numrows)
+    int n = f->nblocks;
+    for (int i = 1; i <= n; ++i)
     {
-        return;
+        f->counts[i] = f->blocks[i - 1].n;
+        f->sums[i] = f->blocks[i - 1].sum;
     }
+    for (int i = 1; i <= n; ++i)
+    {
+        int parent = i + (i & -i);
+        if (parent <= n)
+        {
+            f->counts[parent] += f->counts[i];
+            f->sums[parent] += f->sums[i];
+        }
+    }
+}
 
-    if (E.cy == 0 && E.cx == 0)
+void FenwickFree(struct Fenwick* f)
+{
+    for (int i = 0; i < f->nblocks; ++i)
     {
-        return;
+        free(f->blocks[i].values);
     }
+    free(f->blocks);
+    free(f->counts);
+    free(f->sums);
+    memset(f, 0, sizeof(*f));
+}
 
-    ERow* row = &E.row[E.cy];
-    if (E.cx > 0)
+void FenwickBuild(struct Fenwick* f, int n, long long (*value)(int at))
+{
+    for (int i = 0; i < f->nblocks; ++i)
     {
-        EditorRowDelChar(row, E.cx - 1);
-        E.cx -= 1;
+        free(f->blocks[i].values);
     }
-    else
+    f->nblocks = n > 0 ? (n + KILO_FENWICK_BLOCK - 1) / KILO_FENWICK_BLOCK : 1;
+    FenwickReserve(f, f->nblocks);
+    for (int i = 0; i < f->nblocks; ++i)
     {
-        E.cx = E.row[E.cy - 1].size;
-        EditorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        EditorDelRow(E.cy);
-        E.cy -= 1;
+        struct FenwickBlock* b = &f->blocks[i];
+        int first = i * KILO_FENWICK_BLOCK;
+        b->n = n - first < KILO_FENWICK_BLOCK ? n - first : KILO_FENWICK_BLOCK;
+        b->values = (long long*)malloc(sizeof(long long) * KILO_FENWICK_BLOCK * 2);
+        b->sum = 0;
+        for (int j = 0; j < b->n; ++j)
+        {
+            b->values[j] = value(first + j);
+            b->sum += b->values[j];
+        }
     }
+    FenwickIndex(f);
+    f->n = n;
+    f->valid = 1;
 }
 
-char* EditorPrompt(char* prompt, void (*callback)(char*, int))
+void FenwickTreeAdd(long long* tree, int n, int at, long long delta)
 {
-    size_t bufsize = 128;
-    char* buf = (char*)malloc(bufsize);
-
-    size_t buflen = 0;
-    buf[0] = '\0';
+    for (int i = at + 1; i <= n; i += i & -i)
+    {
+        tree[i] += delta;
+    }
+}
 
-    while (1)
+long long FenwickTreePrefix(const long long* tree, int at)
+{
+    long long sum = 0;
+    for (int i = at; i > 0; i -= i & -i)
     {
-        EditorSetStatusMessage(prompt, buf);
-        EditorRefreshScreen();
+        sum += tree[i];
+    }
+    return sum;
+}
 
-        int c = EditorReadKey();
-        if (c == '\r')
-        {
-            if (buflen != 0)
-            {
-                EditorSetStatusMessage("");
-                if (callback)
-                {
-                    callback(buf, c);
-                }
-                return buf;
-            }
-        }
-        else if(!iscntrl(c) && c < 128)
-        {
-            if (buflen == bufsize - 1)
-            {
-                bufsize *= 2;
-                buf = (char*)realloc(buf, bufsize);
-            }
-            buf[buflen++] = c;
-            buf[buflen] = '\0';
-        }
-        else if (c == '\x1b')
-        {
-            EditorSetStatusMessage("");
-            if (callback)
-            {
-                callback(buf, c);
-            }
-            free(buf);
-            return NULL;
-        }
-        else if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
+/* The block holding row `at`, and the row's place in it; `at` may be n. */
+int FenwickLocate(struct Fenwick* f, int at, int* off)
+{
+    int b = 0;
+    int step = 1;
+    while (step * 2 <= f->nblocks)
+    {
+        step *= 2;
+    }
+    for (; step > 0; step >>= 1)
+    {
+        if (b + step <= f->nblocks && f->counts[b + step] <= at)
         {
-            if (buflen != 0)
-            {
-                buf[--buflen] = '\0';
-            }
+            b += step;
+            at -= f->counts[b];
         }
+    }
+    if (b == f->nblocks)
+    {
+        b -= 1;
+        at = f->blocks[b].n;
+    }
+    *off = at;
+    return b;
+}
 
-        if (callback)
-        {
-            callback(buf, c);
-        }
+/* The value of row `at` changed by delta. */
+void FenwickAdd(struct Fenwick* f, int at, long long delta)
+{
+    if (!f->valid)
+    {
+        return;
     }
+    int off;
+    int b = FenwickLocate(f, at, &off);
+    f->blocks[b].values[off] += delta;
+    f->blocks[b].sum += delta;
+    FenwickTreeAdd(f->sums, f->nblocks, b, delta);
 }
 
-void EditorProcessKey()
+/* Row `at` was inserted with the given value. */
+void FenwickInsert(struct Fenwick* f, int at, long long value)
 {
-    static int quit_times = KILO_QUIT_TIMES; 
-    int c = EditorReadKey();
+    if (!f->valid)
+    {
+        return;
+    }
+    int off;
+    int b = FenwickLocate(f, at, &off);
+    struct FenwickBlock* blk = &f->blocks[b];
+    memmove(&blk->values[off + 1], &blk->values[off], sizeof(long long) * (blk->n - off));
+    blk->values[off] = value;
+    blk->sum += value;
+    blk->n += 1;
+    f->n += 1;
+    if (blk->n < KILO_FENWICK_BLOCK * 2)
+    {
+        FenwickTreeAdd(f->counts, f->nblocks, b, 1);
+        FenwickTreeAdd(f->sums, f->nblocks, b, value);
+        return;
+    }
 
-    switch (c)
+    /* full: the upper half moves to a new block after it */
+    FenwickReserve(f, f->nblocks + 1);
+    blk = &f->blocks[b];
+    memmove(&f->blocks[b + 2], &f->blocks[b + 1], sizeof(struct FenwickBlock) * (f->nblocks - b - 1));
+    struct FenwickBlock* upper = &f->blocks[b + 1];
+    upper->values = (long long*)malloc(sizeof(long long) * KILO_FENWICK_BLOCK * 2);
+    upper->n = KILO_FENWICK_BLOCK;
+    upper->sum = 0;
+    for (int j = 0; j < KILO_FENWICK_BLOCK; ++j)
     {
-        case '\r':
-            EditorInsertNewLine();
-            break;
-        case CTRL_KEY('q'):
-            if (E.dirty && quit_times > 0)
-            {
-                EditorSetStatusMessage("WARNNING!! File has unsaved change."
-                "Press Ctrl-Q %d more times to quit.", quit_times);
-                quit_times -= 1;
-                return;
-            }
-            write(STDOUT_FILENO, "\x1b[2J", 4);
-            write(STDOUT_FILENO, "\x1b[H", 3);
-            exit(0);
-            break;
-        case CTRL_KEY('s'):
-            EditorSave();
-            break;
-        case HOME_KEY:
-            E.cx = 0;
-            break;
-        case END_KEY:
-            if (E.cy < E.numrows)
-            {
-                E.cx = E.row[E.cy].size;
-            }
-            break;
-        case PAGE_UP:
-        case PAGE_DOWN:
-        {
-            if (c == PAGE_UP)
-            {
-                E.cy = E.rowoff;
-            }
-            else if (c == PAGE_DOWN)
-            {
-                E.cy = E.rowoff + E.screenrows - 1;
-                if (E.cy > E.numrows)
-                {
-                    E.cy  = E.numrows;
-                }
-            }
-            int iTimes = E.screenrows;
-            while(--iTimes)
-            {
-                EditorMoveKey(c == PAGE_UP? ARROW_UP : ARROW_DOWN);
-            }
-        }
-            break;
-        case ARROW_UP: 
-        case ARROW_DOWN: 
-        case ARROW_LEFT: 
-        case ARROW_RIGHT: 
-            EditorMoveKey(c);
-            break;
-            
-        case BACKSPACE:
-        case CTRL_KEY('h'):
-        case DEL_KEY:
-            if (c == DEL_KEY)
-            {
-                EditorMoveKey(ARROW_RIGHT);
-            }
-            EditorDelChar();
-            break;
+        upper->values[j] = blk->values[KILO_FENWICK_BLOCK + j];
+        upper->sum += upper->values[j];
+    }
+    blk->n = KILO_FENWICK_BLOCK;
+    blk->sum -= upper->sum;
+    f->nblocks += 1;
+    FenwickIndex(f);
+}
 
-        case CTRL_KEY('l'):
-        case '\x1b':
-            break;
-        case CTRL_KEY('f'):
-            EditorFind();
-            break;
-        default:
-            EditorInsertChar(c);
-            break;
+void FenwickDelete(struct Fenwick* f, int at)
+{
+    if (!f->valid)
+    {
+        return;
+    }
+    int off;
+    int b = FenwickLocate(f, at, &off);
+    struct FenwickBlock* blk = &f->blocks[b];
+    long long value = blk->values[off];
+    memmove(&blk->values[off], &blk->values[off + 1], sizeof(long long) * (blk->n - off - 1));
+    blk->sum -= value;
+    blk->n -= 1;
+    f->n -= 1;
+    if (blk->n > 0 || f->nblocks == 1)
+    {
+        FenwickTreeAdd(f->counts, f->nblocks, b, -1);
+        FenwickTreeAdd(f->sums, f->nblocks, b, -value);
+        return;
     }
 
-    quit_times = KILO_QUIT_TIMES;
+    free(blk->values);
+    memmove(&f->blocks[b], &f->blocks[b + 1], sizeof(struct FenwickBlock) * (f->nblocks - b - 1));
+    f->nblocks -= 1;
+    FenwickIndex(f);
 }
 
-void EditorDrawRows(struct ABuf* aBuf)
+/* Sum of the values of rows before `at`. */
+long long FenwickPrefix(struct Fenwick* f, int at)
+{
+    if (f->nblocks == 0)
+    {
+        return 0;
+    }
+    int off;
+    int b = FenwickLocate(f, at, &off);
+    long long sum = FenwickTreePrefix(f->sums, b);
+    const long long* values = f->blocks[b].values;
+    for (int j = 0; j < off; ++j)
+    {
+        sum += values[j];
+    }
+    return sum;
+}
+
+long long FenwickGet(struct Fenwick* f, int at)
 {
-    int y;
+    if (at >= f->n)
+    {
+        return 0;
+    }
+    int off;
+    int b = FenwickLocate(f, at, &off);
+    return f->blocks[b].values[off];
+}
 
-    for (y = 0; y < E.screenrows; ++y)
+/* Last row whose prefix sum is <= sum, that is the row holding it, or n
+ * when sum is past the total. */
+int FenwickFind(struct Fenwick* f, long long sum)
+{
+    int b = 0;
+    int row = 0;
+    int step = 1;
+    while (step * 2 <= f->nblocks)
+    {
+        step *= 2;
+    }
+    for (; step > 0; step >>= 1)
     {
-        int filerow = y + E.rowoff;
-        if (filerow >= E.numrows)
+        if (b + step <= f->nblocks && f->sums[b + step] <= sum)
         {
-            if (E.numrows == 0 && y == E.screenrows / 3)
-            {
-                char welcome[80];
+            b += step;
+            sum -= f->sums[b];
+            row += f->counts[b];
+        }
+    }
+    if (b < f->nblocks)
+    {
+        const struct FenwickBlock* blk = &f->blocks[b];
+        for (int j = 0; j < blk->n && blk->values[j] <= sum; ++j)
+        {
+            sum -= blk->values[j];
+            row += 1;
+        }
+    }
+    return row;
+}
 
-                int welcomelen = snprintf(welcome, sizeof(welcome), "Kilo editor -- version %s", KILO_VERSION);
-                if (welcomelen > E.screencols)
-                {
-                    welcomelen = E.screencols;
-                }
+long long OffsetValue(int at)
+{
+    return E.row[at].size + E.row[at].eol;
+}
 
-                int padding = (E.screencols - welcomelen) / 2;
-                if (padding)
-                {
-                    AbAppend(aBuf, "~", 1);
-                    --padding;
-                }
+/* Drops the carriage returns before a line's newline from len and returns
+ * the length of the line ending they make with it. */
+unsigned char LineEnding(const char* p, int* len)
+{
+    int eol = 1;
+    while (*len > 0 && p[*len - 1] == '\r' && eol < 255)
+    {
+        *len -= 1;
+        eol += 1;
+    }
+    return eol;
+}
 
-                while (padding--)
-                {
-                    AbAppend(aBuf, " ", 1);
-                }
+void EditorRowSetEnding(int at, int eol)
+{
+    EditorUndoEnding(at, E.row[at].eol, eol);
+    FenwickAdd(&E.offsets, at, eol - E.row[at].eol);
+    E.row[at].eol = eol;
+}
+
+/* Byte offset of the start of row `at`; `at` may be E.numrows. */
+long long EditorRowOffset(int at)
+{
+    if (E.readonly)
+    {
+        return at < E.numrows ? (long long)(E.index.entries[at] & ~KILO_INDEX_COMMENT) : E.index.size;
+    }
+    if (!E.offsets.valid || E.offsets.n != E.numrows)
+    {
+        FenwickBuild(&E.offsets, E.numrows, OffsetValue);
+    }
+    return FenwickPrefix(&E.offsets, at);
+}
 
-                AbAppend(aBuf, welcome, welcomelen);
+/* Row containing byte offset `off`, clamped to the last row. */
+int EditorOffsetRow(long long off)
+{
+    int row = 0;
+    if (E.readonly)
+    {
+        int lo = 0;
+        int hi = E.numrows;
+        while (hi - lo > 1)
+        {
+            int mid = lo + (hi - lo) / 2;
+            if ((long long)(E.index.entries[mid] & ~KILO_INDEX_COMMENT) <= off)
+            {
+                lo = mid;
             }
             else
             {
-                AbAppend(aBuf, "~", 1);
+                hi = mid;
             }
         }
-        else
+        row = lo;
+    }
+    else
+    {
+        if (!E.offsets.valid || E.offsets.n != E.numrows)
         {
-            int len = E.row[filerow].rsize - E.coloff;
-            if (len < 0)
-            {
-                len = 0;
-            }
-            if (len > E.screencols)
-            {
-                len = E.screencols;
-            }
-
-            char* c = &E.row[filerow].render[E.coloff];
-            unsigned char* hl = &E.row[filerow].hl[E.coloff];
-            int current_color = -1;
-            for (int j = 0; j < len; ++j)
-            {
-                if (iscntrl(c[j]))
-                {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    AbAppend(aBuf, "\x1b[7m", 4);
-                    AbAppend(aBuf, &sym, 1);
-                    AbAppend(aBuf, "\x1b[m", 3);
-                    if (current_color != -1)
-                    {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                        AbAppend(aBuf, buf, clen);
-                    }
-                }
-                else if (hl[j] == HL_NORMAL)
-                {
-                    if (current_color != -1)
-                    {
-                        current_color = -1;
-                        AbAppend(aBuf, "\x1b[39m", 5);
-                    }
-                    AbAppend(aBuf, &c[j], 1);
-                }
-                else
-                {
-                    int color = EditorSyntaxToColor(hl[j]);
-                    if (current_color != color)
-                    {
-                        current_color = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        AbAppend(aBuf, buf, clen);
-                    }
-                    AbAppend(aBuf, &c[j], 1);
-                }
-            }
-            AbAppend(aBuf, "\x1b[39m", 5);
+            FenwickBuild(&E.offsets, E.numrows, OffsetValue);
         }
-
-        AbAppend(aBuf, "\x1b[K", 3);
-        AbAppend(aBuf, "\r\n", 2);
+        row = FenwickFind(&E.offsets, off);
     }
+    return (row < E.numrows || E.numrows == 0) ? row : E.numrows - 1;
 }
 
-int EditorRowCxToRx(ERow* row, int cx)
+/* +1 for an opening bracket, -1 for a closing one, else 0. */
+int BracketDelta(int c)
 {
-    int rx = 0;
-    
-    for (int j = 0; j < cx; ++j)
+    switch (c)
     {
-        if (row->chars[j] == '\t')
-        {
-            rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-        }
-        ++rx;
+        case '(':
+        case '[':
+        case '{':
+            return 1;
+        case ')':
+        case ']':
+        case '}':
+            return -1;
+        default:
+            return 0;
     }
+}
 
-    return rx;
+/* Brackets in strings and comments do not count. */
+int BracketIgnored(int hl)
+{
+    return hl == HL_STRING || hl == HL_COMMENT || hl == HL_MLCOMMENT;
 }
 
-int EditorRowRxToCx(ERow* row, int rx)
+struct BracketSum BracketCombine(struct BracketSum a, struct BracketSum b)
 {
-    int cur_rx = 0;
-    
+    struct BracketSum s;
+    s.total = a.total + b.total;
+    s.low = (a.total + b.low < a.low) ? a.total + b.low : a.low;
+    return s;
+}
+
+/* Sets row's summary from its render and unpacked hl. */
+void EditorRowBrackets(ERow* row, const char* render, const unsigned char* hl)
+{
+    struct BracketSum s = {0, 0};
+    for (int i = 0; i < row->rsize; ++i)
+    {
+        int d = BracketDelta(render[i]);
+        if (d != 0 && !BracketIgnored(hl[i]))
+        {
+            s.total += d;
+            if (s.total < s.low)
+            {
+                s.low = s.total;
+            }
+        }
+    }
+    row->brackets = s;
+    row->cache |= ROW_BRACKETS;
+}
+
+/* The row's hl, unpacked into a buffer that lasts until the next call. */
+unsigned char* BracketsHighlight(ERow* row)
+{
+    static unsigned char* hl = NULL;
+    static int cap = 0;
+    EditorRowEnsure(row);
+    if (row->rsize + 1 > cap)
+    {
+        cap = row->rsize + 1;
+        hl = (unsigned char*)realloc(hl, cap);
+    }
+    memset(hl, HL_NORMAL, row->rsize);
+    EditorRowGetHighlight(row, hl);
+    return hl;
+}
+
+/* The row's summary, worked out first if it has none yet. */
+struct BracketSum BracketsRow(ERow* row)
+{
+    if (!(row->cache & ROW_BRACKETS))
+    {
+        unsigned char* hl = BracketsHighlight(row);
+        EditorRowBrackets(row, EditorRowRender(row), hl);
+    }
+    return row->brackets;
+}
+
+/* The summary of rows first to first + n - 1. */
+struct BracketSum BracketsRange(int first, int n)
+{
+    struct BracketSum s = {0, 0};
+    for (int i = first; i < first + n; ++i)
+    {
+        s = BracketCombine(s, BracketsRow(&E.row[i]));
+    }
+    return s;
+}
+
+/* Lays the tree over the blocks out again. */
+void BracketsIndex()
+{
+    struct Brackets* b = &E.brackets;
+    int size = 1;
+    while (size < b->nblocks)
+    {
+        size *= 2;
+    }
+    if (size != b->size)
+    {
+        b->size = size;
+        b->tree = (struct BracketSum*)realloc(b->tree, sizeof(struct BracketSum) * size * 2);
+        b->counts = (int*)realloc(b->counts, sizeof(int) * size * 2);
+    }
+    memset(&b->tree[size], 0, sizeof(struct BracketSum) * size);
+    memset(&b->counts[size], 0, sizeof(int) * size);
+    for (int i = 0; i < b->nblocks; ++i)
+    {
+        b->tree[size + i] = b->blocks[i].sum;
+        b->counts[size + i] = b->blocks[i].n;
+    }
+    for (int i = size - 1; i >= 1; --i)
+    {
+        b->tree[i] = BracketCombine(b->tree[2 * i], b->tree[2 * i + 1]);
+        b->counts[i] = b->counts[2 * i] + b->counts[2 * i + 1];
+    }
+}
+
+void BracketsSet(int block)
+{
+    struct Brackets* b = &E.brackets;
+    int i = b->size + block;
+    b->tree[i] = b->blocks[block].sum;
+    b->counts[i] = b->blocks[block].n;
+    for (i /= 2; i >= 1; i /= 2)
+    {
+        b->tree[i] = BracketCombine(b->tree[2 * i], b->tree[2 * i + 1]);
+        b->counts[i] = b->counts[2 * i] + b->counts[2 * i + 1];
+    }
+}
+
+/* The block holding row `at` and the row's place in it; `at` may be n. */
+int BracketsLocate(int at, int* off)
+{
+    struct Brackets* b = &E.brackets;
+    int node = 1;
+    while (node < b->size)
+    {
+        if (b->counts[2 * node] > at)
+        {
+            node = 2 * node;
+        }
+        else
+        {
+            at -= b->counts[2 * node];
+            node = 2 * node + 1;
+        }
+    }
+    int block = node - b->size;
+    if (block >= b->nblocks)
+    {
+        block = b->nblocks - 1;
+        at = b->blocks[block].n;
+    }
+    *off = at;
+    return block;
+}
+
+/* The first row of a block. */
+int BracketsStart(int block)
+{
+    struct Brackets* b = &E.brackets;
+    int rows = 0;
+    for (int i = b->size + block; i > 1; i /= 2)
+    {
+        if (i & 1)
+        {
+            rows += b->counts[i - 1];
+        }
+    }
+    return rows;
+}
+
+void BracketsDirty(int block)
+{
+    struct Brackets* b = &E.brackets;
+    if (b->blocks[block].dirty)
+    {
+        return;
+    }
+    if (b->ndirty == b->dirtycap)
+    {
+        b->dirtycap = b->dirtycap ? b->dirtycap * 2 : 64;
+        b->dirty = (int*)realloc(b->dirty, sizeof(int) * b->dirtycap);
+    }
+    b->blocks[block].dirty = 1;
+    b->dirty[b->ndirty++] = block;
+}
+
+/* Called with a row's new summary: marks its block if the tree is built. */
+void EditorBracketsUpdate(int at)
+{
+    int off;
+    if (E.brackets.valid && at < E.brackets.n)
+    {
+        BracketsDirty(BracketsLocate(at, &off));
+    }
+}
+
+/* Rows at to at + n - 1 were added. */
+void EditorBracketsInsert(int at, int n)
+{
+    struct Brackets* b = &E.brackets;
+    if (!b->valid)
+    {
+        return;
+    }
+    int off;
+    int block = BracketsLocate(at, &off);
+    b->blocks[block].n += n;
+    b->n += n;
+    BracketsSet(block);
+    BracketsDirty(block);
+}
+
+/* Rows at to at + n - 1 were removed. */
+void EditorBracketsDelete(int at, int n)
+{
+    struct Brackets* b = &E.brackets;
+    if (!b->valid)
+    {
+        return;
+    }
+    b->n -= n;
+    while (n > 0)
+    {
+        int off;
+        int block = BracketsLocate(at, &off);
+        int gone = b->blocks[block].n - off < n ? b->blocks[block].n - off : n;
+        b->blocks[block].n -= gone;
+        n -= gone;
+        BracketsSet(block);
+        BracketsDirty(block);
+    }
+}
+
+/* Sums the dirty blocks again, then splits those that grew past twice the
+ * block size and drops the empty ones. */
+void BracketsRefresh()
+{
+    struct Brackets* b = &E.brackets;
+    int reshape = 0;
+    for (int i = 0; i < b->ndirty; ++i)
+    {
+        struct BracketBlock* blk = &b->blocks[b->dirty[i]];
+        blk->sum = BracketsRange(BracketsStart(b->dirty[i]), blk->n);
+        blk->dirty = 0;
+        BracketsSet(b->dirty[i]);
+        reshape |= (blk->n == 0 || blk->n > KILO_BRACKET_BLOCK * 2);
+    }
+    b->ndirty = 0;
+    if (!reshape)
+    {
+        return;
+    }
+
+    int nblocks = 0;
+    for (int i = 0; i < b->nblocks; ++i)
+    {
+        nblocks += (b->blocks[i].n + KILO_BRACKET_BLOCK - 1) / KILO_BRACKET_BLOCK;
+    }
+    struct BracketBlock* blocks = (struct BracketBlock*)malloc(sizeof(struct BracketBlock) * (nblocks + 1));
+    int k = 0;
+    int first = 0;
+    for (int i = 0; i < b->nblocks; ++i)
+    {
+        struct BracketBlock* blk = &b->blocks[i];
+        if (blk->n <= KILO_BRACKET_BLOCK * 2 && blk->n > 0)
+        {
+            blocks[k++] = *blk;
+        }
+        for (int j = 0; blk->n > KILO_BRACKET_BLOCK * 2 && j < blk->n; j += KILO_BRACKET_BLOCK)
+        {
+            int n = blk->n - j < KILO_BRACKET_BLOCK ? blk->n - j : KILO_BRACKET_BLOCK;
+            blocks[k].n = n;
+            blocks[k].dirty = 0;
+            blocks[k++].sum = BracketsRange(first + j, n);
+        }
+        first += blk->n;
+    }
+    if (k == 0)
+    {
+        memset(&blocks[k++], 0, sizeof(struct BracketBlock));
+    }
+    free(b->blocks);
+    b->blocks = blocks;
+    b->nblocks = k;
+    BracketsIndex();
+}
+
+void EditorBracketsBuild()
+{
+    struct Brackets* b = &E.brackets;
+    b->nblocks = E.numrows > 0 ? (E.numrows + KILO_BRACKET_BLOCK - 1) / KILO_BRACKET_BLOCK : 1;
+    b->blocks = (struct BracketBlock*)realloc(b->blocks, sizeof(struct BracketBlock) * b->nblocks);
+    for (int i = 0; i < b->nblocks; ++i)
+    {
+        int first = i * KILO_BRACKET_BLOCK;
+        struct BracketBlock* blk = &b->blocks[i];
+        blk->n = E.numrows - first < KILO_BRACKET_BLOCK ? E.numrows - first : KILO_BRACKET_BLOCK;
+        blk->sum = BracketsRange(first, blk->n);
+        blk->dirty = 0;
+    }
+    BracketsIndex();
+    b->ndirty = 0;
+    b->n = E.numrows;
+    b->valid = 1;
+}
+
+/* The first block from `from` on where the depth, *depth at the start of
+ * `from`, falls to 0. Subtrees that stay above it are skipped whole, adding
+ * their change to *depth. */
+int BracketsFirstBlock(int node, int lo, int hi, int from, int* depth)
+{
+    struct BracketSum* s = &E.brackets.tree[node];
+    if (hi <= from)
+    {
+        return -1;
+    }
+    if (lo >= from && *depth + s->low > 0)
+    {
+        *depth += s->total;
+        return -1;
+    }
+    if (hi - lo == 1)
+    {
+        return lo;
+    }
+    int mid = (lo + hi) / 2;
+    int at = BracketsFirstBlock(node * 2, lo, mid, from, depth);
+    return at != -1 ? at : BracketsFirstBlock(node * 2 + 1, mid, hi, from, depth);
+}
+
+/* The same going up from block `to`, *depth counting the closing brackets
+ * still open at its end. A block can raise the depth by total - low. */
+int BracketsLastBlock(int node, int lo, int hi, int to, int* depth)
+{
+    struct BracketSum* s = &E.brackets.tree[node];
+    if (lo > to)
+    {
+        return -1;
+    }
+    if (hi - 1 <= to && *depth - (s->total - s->low) > 0)
+    {
+        *depth -= s->total;
+        return -1;
+    }
+    if (hi - lo == 1)
+    {
+        return lo;
+    }
+    int mid = (lo + hi) / 2;
+    int at = BracketsLastBlock(node * 2 + 1, mid, hi, to, depth);
+    return at != -1 ? at : BracketsLastBlock(node * 2, lo, mid, to, depth);
+}
+
+/* The first row from `from` on where the depth falls to 0: the rest of
+ * from's block is scanned, the blocks after it stepped over in the tree, and
+ * the block where it falls scanned. */
+int BracketsFirst(int from, int* depth)
+{
+    struct Brackets* b = &E.brackets;
+    if (from >= E.numrows)
+    {
+        return -1;
+    }
+    int off;
+    int block = BracketsLocate(from, &off);
+    int end = from - off + b->blocks[block].n;
+    while (1)
+    {
+        for (int r = from; r < end; ++r)
+        {
+            struct BracketSum s = E.row[r].brackets;
+            if (*depth + s.low <= 0)
+            {
+                return r;
+            }
+            *depth += s.total;
+        }
+        block = BracketsFirstBlock(1, 0, b->size, block + 1, depth);
+        if (block == -1 || block >= b->nblocks)
+        {
+            return -1;
+        }
+        from = BracketsStart(block);
+        end = from + b->blocks[block].n;
+    }
+}
+
+/* The same going up from row `to`. */
+int BracketsLast(int to, int* depth)
+{
+    if (to < 0)
+    {
+        return -1;
+    }
+    int off;
+    int block = BracketsLocate(to, &off);
+    int start = to - off;
+    while (1)
+    {
+        for (int r = to; r >= start; --r)
+        {
+            struct BracketSum s = E.row[r].brackets;
+            if (*depth - (s.total - s.low) <= 0)
+            {
+                return r;
+            }
+            *depth -= s.total;
+        }
+        block = BracketsLastBlock(1, 0, E.brackets.size, block - 1, depth);
+        if (block == -1)
+        {
+            return -1;
+        }
+        start = BracketsStart(block);
+        to = start + E.brackets.blocks[block].n - 1;
+    }
+}
+
+/* Scans the render of row from column x, forwards if dir is 1 and backwards
+ * if -1, until the depth counted from *depth comes to 0, and returns that
+ * column; -1 with the depth at the end of the scan if it does not. */
+int BracketsScan(ERow* row, int x, int dir, int* depth)
+{
+    unsigned char* hl = BracketsHighlight(row);
+    const char* render = EditorRowRender(row);
+    for (; x >= 0 && x < row->rsize; x += dir)
+    {
+        int d = BracketDelta(render[x]);
+        if (d != 0 && !BracketIgnored(hl[x]))
+        {
+            *depth += d * dir;
+            if (*depth == 0)
+            {
+                return x;
+            }
+        }
+    }
+    return -1;
+}
+
+/* Finds the bracket under the cursor, or else just before it, and the one
+ * that matches it: the cursor's row and the row of the match are scanned,
+ * the rows between are stepped over in the tree in O(log n). Returns 1 with
+ * both in at and rx (render columns), 0 when there is no bracket, and -1
+ * when it has no match or the match is of another kind. */
+int EditorBracketMatch(int* at, int* rx)
+{
+    if (E.cy >= E.numrows || E.index.map)
+    {
+        return 0;
+    }
+    ERow* row = &E.row[E.cy];
+    unsigned char* hl = BracketsHighlight(row);
+    const char* render = EditorRowRender(row);
+    int x = EditorRowCxToRx(row, E.cx);
+    if (x >= row->rsize || BracketDelta(render[x]) == 0 || BracketIgnored(hl[x]))
+    {
+        x -= 1;
+    }
+    if (x < 0 || x >= row->rsize || BracketDelta(render[x]) == 0 || BracketIgnored(hl[x]))
+    {
+        return 0;
+    }
+    char c = render[x];
+    int dir = BracketDelta(c);
+    at[0] = E.cy;
+    rx[0] = x;
+
+    if (!E.brackets.valid || E.brackets.n != E.numrows)
+    {
+        EditorBracketsBuild();
+    }
+    BracketsRefresh();
+    int depth = 0;
+    int y = E.cy;
+    int col = BracketsScan(row, x, dir, &depth);
+    if (col == -1)
+    {
+        y = (dir > 0) ? BracketsFirst(E.cy + 1, &depth) : BracketsLast(E.cy - 1, &depth);
+        if (y == -1 || y >= E.numrows)
+        {
+            return -1;
+        }
+        ERow* other = &E.row[y];
+        col = BracketsScan(other, dir > 0 ? 0 : other->rsize - 1, dir, &depth);
+    }
+    at[1] = y;
+    rx[1] = col;
+
+    const char* pairs = "()[]{}";
+    char m = EditorRowRender(&E.row[y])[col];
+    const char* p = strchr(pairs, dir > 0 ? c : m);
+    return (p[1] == (dir > 0 ? m : c)) ? 1 : -1;
+}
+
+/* CTRL-]: moves to the bracket matching the one at the cursor. */
+void EditorJumpBracket()
+{
+    int at[2];
+    int rx[2];
+    EditorHighlightFlush();
+    int found = EditorBracketMatch(at, rx);
+    if (found == 0)
+    {
+        EditorSetStatusMessage("No bracket at the cursor");
+        return;
+    }
+    if (found == -1)
+    {
+        EditorSetStatusMessage("Unmatched bracket");
+        return;
+    }
+    E.cy = at[1];
+    E.cx = EditorRowRxToCx(&E.row[at[1]], rx[1]);
+    EditorFoldReveal(E.cy);
+}
+
+long long UndoSize(int len)
+{
+    return sizeof(struct UndoRecord) + ((len + 3) & ~3) + sizeof(int);
+}
+
+/* The record ending at offset end of the arena. */
+struct UndoRecord* UndoBefore(long long end)
+{
+    int size;
+    memcpy(&size, E.undo.buf + end - sizeof(int), sizeof(int));
+    return (struct UndoRecord*)(E.undo.buf + end - size);
+}
+
+/* Makes the record at offset `at` the last one, sized for len bytes of text. */
+struct UndoRecord* UndoPlace(long long at, int len)
+{
+    struct Undo* u = &E.undo;
+    int size = UndoSize(len);
+    if (at + size > u->cap)
+    {
+        u->cap = (at + size) * 2;
+        u->buf = (char*)realloc(u->buf, u->cap);
+    }
+    memcpy(u->buf + at + size - sizeof(int), &size, sizeof(int));
+    u->len = u->pos = at + size;
+    u->lastkey = u->group;
+    u->touched = 1;
+
+    struct UndoRecord* r = (struct UndoRecord*)(u->buf + at);
+    r->len = len;
+    return r;
+}
+
+/* Starts a record of the current key. Whatever was undone can no longer be
+ * redone. */
+struct UndoRecord* UndoAppend(int type, int row, int col, int len, int count)
+{
+    struct Undo* u = &E.undo;
+    if (u->saved > u->pos)
+    {
+        u->saved = -1;
+    }
+    struct UndoRecord* r = UndoPlace(u->pos, len);
+    r->type = type;
+    r->row = row;
+    r->col = col;
+    r->count = count;
+    r->cx = u->cx;
+    r->cy = u->cy;
+    r->ax = E.cx;
+    r->ay = E.cy;
+    r->group = u->group;
+    return r;
+}
+
+/* Records len chars inserted or deleted at row, col. A char typed where the
+ * previous key left off, or backspaced into it, extends its record. */
+void EditorUndoChars(int type, int row, int col, const char* s, int len)
+{
+    struct Undo* u = &E.undo;
+    if (u->paused)
+    {
+        return;
+    }
+
+    if (len == 1 && u->pos > 0 && u->pos == u->len && u->lastkey + 1 >= u->group)
+    {
+        struct UndoRecord* r = UndoBefore(u->pos);
+        int append = (type == UNDO_INSERT && r->col + r->len == col);
+        int prepend = (type == UNDO_DELETE && col + len == r->col);
+        if (r->type == type && r->row == row && (append || prepend))
+        {
+            int old = r->len;
+            r = UndoPlace((char*)r - u->buf, old + len);
+            char* text = (char*)(r + 1);
+            if (prepend)
+            {
+                memmove(text + len, text, old);
+                r->col = col;
+            }
+            memcpy(prepend ? text : text + old, s, len);
+            return;
+        }
+    }
+
+    struct UndoRecord* r = UndoAppend(type, row, col, len, 0);
+    memcpy(r + 1, s, len);
+}
+
+/* Records n rows inserted or deleted at `at`, with their line endings. */
+void EditorUndoRows(int type, int at, int n, const char** lines, const int* lens, const unsigned char* eols)
+{
+    if (E.undo.paused)
+    {
+        return;
+    }
+
+    long long len = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        len += sizeof(int) + 1 + lens[i];
+    }
+    char* p = (char*)(UndoAppend(type, at, 0, len, n) + 1);
+    for (int i = 0; i < n; ++i)
+    {
+        memcpy(p, &lens[i], sizeof(int));
+        p[sizeof(int)] = eols[i];
+        memcpy(p + sizeof(int) + 1, lines[i], lens[i]);
+        p += sizeof(int) + 1 + lens[i];
+    }
+}
+
+/* Records row at's line ending changing from `from` to `to`. */
+void EditorUndoEnding(int at, int from, int to)
+{
+    if (E.undo.paused || from == to)
+    {
+        return;
+    }
+    UndoAppend(UNDO_ENDING, at, from, 0, to);
+}
+
+/* Splits a row record back into its rows; the lines point into the arena. */
+void UndoUnpack(struct UndoRecord* r, const char** lines, int* lens, unsigned char* eols)
+{
+    const char* p = (const char*)(r + 1);
+    for (int i = 0; i < r->count; ++i)
+    {
+        memcpy(&lens[i], p, sizeof(int));
+        eols[i] = p[sizeof(int)];
+        lines[i] = p + sizeof(int) + 1;
+        p += sizeof(int) + 1 + lens[i];
+    }
+}
+
+/* Drops the oldest keys until the history is back under half its budget,
+ * always keeping the latest one. */
+void EditorUndoTrim()
+{
+    struct Undo* u = &E.undo;
+    unsigned int keep = UndoBefore(u->len)->group;
+    long long off = 0;
+    while (u->len - off > u->budget / 2)
+    {
+        unsigned int group = ((struct UndoRecord*)(u->buf + off))->group;
+        if (group == keep)
+        {
+            break;
+        }
+        while (((struct UndoRecord*)(u->buf + off))->group == group)
+        {
+            off += UndoSize(((struct UndoRecord*)(u->buf + off))->len);
+        }
+    }
+    if (off == 0)
+    {
+        return;
+    }
+
+    memmove(u->buf, u->buf + off, u->len - off);
+    u->len -= off;
+    u->pos -= off;
+    u->saved = (u->saved >= off) ? u->saved - off : -1;
+    if (u->cap > 4 * u->len)
+    {
+        u->cap = 2 * u->len;
+        u->buf = (char*)realloc(u->buf, u->cap);
+    }
+}
+
+/* Closes the group of the key just processed, noting where it left the
+ * cursor, and starts the next one. */
+void EditorUndoSeal()
+{
+    struct Undo* u = &E.undo;
+    if (u->touched)
+    {
+        struct UndoRecord* r = UndoBefore(u->pos);
+        r->ax = E.cx;
+        r->ay = E.cy;
+        u->touched = 0;
+        if (u->budget && u->len > u->budget && u->pos == u->len)
+        {
+            EditorUndoTrim();
+        }
+    }
+    u->group += 1;
+    u->cx = E.cx;
+    u->cy = E.cy;
+}
+
+/* Inserts n rows at `at` with a single move of the rows below, so a paste
+ * costs O(rows) wherever it lands. Without eols the new rows end like the
+ * rows around them; loaders set what they read afterwards. */
+void EditorInsertRows(int at, int n, const char** lines, const int* lens, const unsigned char* eols)
+{
+    if (at < 0 || at > E.numrows || n <= 0)
+    {
+        return;
+    }
+    int eol = E.numrows == 0 ? 1 : E.row[at > 0 ? at - 1 : 0].eol;
+    if (!E.undo.paused)
+    {
+        unsigned char* fill = eols ? NULL : (unsigned char*)malloc(n);
+        if (fill)
+        {
+            memset(fill, eol, n);
+        }
+        EditorUndoRows(UNDO_INSERT_ROWS, at, n, lines, lens, eols ? eols : fill);
+        free(fill);
+    }
+
+    if (E.numrows + n > E.rowcap)
+    {
+        while (E.numrows + n > E.rowcap)
+        {
+            E.rowcap = E.rowcap ? E.rowcap * 2 : 16;
+        }
+        E.row = (ERow*)realloc(E.row, sizeof(ERow) * E.rowcap);
+    }
+    memmove(&E.row[at + n], &E.row[at], sizeof(ERow) * (E.numrows - at));
+
+    for (int i = 0; i < n; ++i)
+    {
+        ERow* row = &E.row[at + i];
+        row->size = lens[i];
+        row->chars = (char*)malloc(lens[i] + 1);
+        memcpy(row->chars, lines[i], lens[i]);
+        row->chars[lens[i]] = '\0';
+
+        row->rsize = 0;
+        row->render = NULL;
+        row->hl = NULL;
+        row->hlruns = 0;
+        row->hl_open_comment = 0;
+        row->cache = 0;
+        row->eol = eols ? eols[i] : eol;
+        EditorWordsRow(row, 1);
+    }
+    E.numrows += n;
+    EditorBracketsInsert(at, n);
+    for (int i = 0; i < n; ++i)
+    {
+        FenwickInsert(&E.offsets, at + i, lens[i] + E.row[at + i].eol);
+    }
+    if (E.folds.count)
+    {
+        EditorFoldShift(at, n);
+    }
+    for (int i = 0; i < n; ++i)
+    {
+        FenwickInsert(&E.wrap.lines, at + i, 1);
+    }
+    for (int i = 0; i < n; ++i)
+    {
+        EditorUpdateRow(&E.row[at + i]);
+    }
+    /* the row below was highlighted as following row at - 1 */
+    if (at + n < E.numrows && E.row[at + n - 1].hl_open_comment != (at > 0 ? E.row[at - 1].hl_open_comment : 0))
+    {
+        EditorUpdateRow(&E.row[at + n]);
+    }
+
+    E.dirty = 1;
+}
+
+void EditorInsertRow(int at, char* s, size_t len)
+{
+    const char* line = s;
+    int linelen = len;
+    EditorInsertRows(at, 1, &line, &linelen, NULL);
+}
+
+void EditorInsertNewLine()
+{
+    if (E.cx == 0)
+    {
+        EditorInsertRow(E.cy, "", 0);
+    }
+    else
+    {
+        ERow* row = &E.row[E.cy];
+        EditorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+        row = &E.row[E.cy];
+        EditorRowDelChars(row, E.cx, row->size - E.cx);
+    }
+    E.cy += 1;
+    E.cx = 0;
+    EditorFoldReveal(E.cy);
+}
+
+void EditorFreeRow(ERow* row)
+{
+    E.cache.bytes -= EditorRowCacheBytes(row);
+    if (row->cache & ROW_MAPPED)
+    {
+        return;
+    }
+    free(row->chars);
+    free(row->render);
+    free(row->hl);
+}
+
+/* Deletes rows at to at + n - 1 with a single move of the rows below. */
+void EditorDelRows(int at, int n)
+{
+    if (at < 0 || n <= 0 || at + n > E.numrows)
+    {
+        return;
+    }
+    if (!E.undo.paused)
+    {
+        const char* line;
+        int linelen;
+        unsigned char lineeol;
+        const char** lines = (n == 1) ? &line : (const char**)malloc(sizeof(char*) * n);
+        int* lens = (n == 1) ? &linelen : (int*)malloc(sizeof(int) * n);
+        unsigned char* eols = (n == 1) ? &lineeol : (unsigned char*)malloc(n);
+        for (int i = 0; i < n; ++i)
+        {
+            lines[i] = E.row[at + i].chars;
+            lens[i] = E.row[at + i].size;
+            eols[i] = E.row[at + i].eol;
+        }
+        EditorUndoRows(UNDO_DELETE_ROWS, at, n, lines, lens, eols);
+        if (n > 1)
+        {
+            free(lines);
+            free(lens);
+            free(eols);
+        }
+    }
+
+    int out = E.row[at + n - 1].hl_open_comment;
+    for (int i = 0; i < n; ++i)
+    {
+        EditorWordsRow(&E.row[at + i], -1);
+        EditorFreeRow(&E.row[at + i]);
+    }
+    memmove(&E.row[at], &E.row[at + n], sizeof(ERow) * (E.numrows - at - n));
+    E.numrows -= n;
+    EditorBracketsDelete(at, n);
+    for (int i = n - 1; i >= 0; --i)
+    {
+        FenwickDelete(&E.offsets, at + i);
+    }
+    if (E.folds.count)
+    {
+        EditorFoldShift(at, -n);
+    }
+    for (int i = n - 1; i >= 0; --i)
+    {
+        FenwickDelete(&E.wrap.lines, at + i);
+    }
+    /* the row below now follows another, which may end in a different state */
+    if (at < E.numrows && (at > 0 ? E.row[at - 1].hl_open_comment : 0) != out)
+    {
+        EditorUpdateRow(&E.row[at]);
+    }
+    E.dirty = 1;
+}
+
+void EditorDelRow(int at)
+{
+    EditorDelRows(at, 1);
+}
+
+void EditorRowInsertChars(ERow* row, int at, const char* s, int len)
+{
+    if (at < 0 || at > row->size)
+    {
+        at = row->size;
+    }
+    if (len <= 0)
+    {
+        return;
+    }
+    EditorUndoChars(UNDO_INSERT, row - E.row, at, s, len);
+
+    EditorWordsRow(row, -1);
+    EditorRowOwn(row);
+    row->chars = (char*)realloc(row->chars, row->size + len + 1);
+    memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+    memcpy(&row->chars[at], s, len);
+    row->size += len;
+    EditorWordsRow(row, 1);
+    FenwickAdd(&E.offsets, row - E.row, len);
+    EditorUpdateRow(row);
+    E.dirty = 1;
+}
+
+void EditorRowAppendString(ERow* row, char* s, size_t len)
+{
+    EditorRowInsertChars(row, row->size, s, len);
+}
+
+void EditorRowInsertChar(ERow* row, int at, int c)
+{
+    char ch = c;
+    EditorRowInsertChars(row, at, &ch, 1);
+}
+
+void EditorInsertChar(int c)
+{
+    if (E.cy == E.numrows)
+    {
+        EditorInsertRow(E.numrows, "", 0);
+    }
+
+    EditorRowInsertChar(&E.row[E.cy], E.cx, c);
+    E.cx += 1;
+}
+
+void EditorRowDelChars(ERow* row, int at, int len)
+{
+    if (at < 0 || len <= 0 || at + len > row->size)
+    {
+        return;
+    }
+    EditorUndoChars(UNDO_DELETE, row - E.row, at, &row->chars[at], len);
+
+    EditorWordsRow(row, -1);
+    EditorRowOwn(row);
+    memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+    row->size -= len;
+    EditorWordsRow(row, 1);
+    FenwickAdd(&E.offsets, row - E.row, -len);
+    EditorUpdateRow(row);
+    E.dirty = 1;
+}
+
+void EditorRowDelChar(ERow* row, int at)
+{
+    EditorRowDelChars(row, at, 1);
+}
+
+void EditorDelChar()
+{
+    if (E.cy >= E.numrows)
+    {
+        return;
+    }
+
+    if (E.cy == 0 && E.cx == 0)
+    {
+        return;
+    }
+
+    ERow* row = &E.row[E.cy];
+    if (E.cx > 0)
+    {
+        EditorRowDelChar(row, E.cx - 1);
+        E.cx -= 1;
+    }
+    else
+    {
+        E.cx = E.row[E.cy - 1].size;
+        EditorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+        EditorRowSetEnding(E.cy - 1, row->eol);
+        EditorDelRow(E.cy);
+        E.cy -= 1;
+        EditorFoldReveal(E.cy);
+    }
+}
+
+/* Applies record r again (redo) or takes it back (undo). */
+void EditorUndoApply(struct UndoRecord* r, int forward)
+{
+    int insert = (r->type == UNDO_INSERT || r->type == UNDO_INSERT_ROWS) == forward;
+    if (r->type == UNDO_ENDING)
+    {
+        EditorRowSetEnding(r->row, forward ? r->count : r->col);
+    }
+    else if (r->type == UNDO_INSERT || r->type == UNDO_DELETE)
+    {
+        if (insert)
+        {
+            EditorRowInsertChars(&E.row[r->row], r->col, (const char*)(r + 1), r->len);
+        }
+        else
+        {
+            EditorRowDelChars(&E.row[r->row], r->col, r->len);
+        }
+    }
+    else if (insert)
+    {
+        const char** lines = (const char**)malloc(sizeof(char*) * r->count);
+        int* lens = (int*)malloc(sizeof(int) * r->count);
+        unsigned char* eols = (unsigned char*)malloc(r->count);
+        UndoUnpack(r, lines, lens, eols);
+        EditorInsertRows(r->row, r->count, lines, lens, eols);
+        free(lines);
+        free(lens);
+        free(eols);
+    }
+    else
+    {
+        EditorDelRows(r->row, r->count);
+    }
+}
+
+/* Takes back the last key that changed the buffer. */
+void EditorUndo()
+{
+    struct Undo* u = &E.undo;
+    if (u->pos == 0)
+    {
+        EditorSetStatusMessage("Nothing to undo");
+        return;
+    }
+
+    u->paused = 1;
+    unsigned int group = UndoBefore(u->pos)->group;
+    struct UndoRecord* r;
+    do
+    {
+        r = UndoBefore(u->pos);
+        EditorUndoApply(r, 0);
+        u->pos -= UndoSize(r->len);
+    } while (u->pos > 0 && UndoBefore(u->pos)->group == group);
+    u->paused = 0;
+
+    E.cx = r->cx;
+    E.cy = r->cy;
+    E.dirty = (u->pos != u->saved);
+    EditorFoldReveal(E.cy);
+}
+
+void EditorRedo()
+{
+    struct Undo* u = &E.undo;
+    if (u->pos == u->len)
+    {
+        EditorSetStatusMessage("Nothing to redo");
+        return;
+    }
+
+    u->paused = 1;
+    unsigned int group = ((struct UndoRecord*)(u->buf + u->pos))->group;
+    struct UndoRecord* r;
+    do
+    {
+        r = (struct UndoRecord*)(u->buf + u->pos);
+        EditorUndoApply(r, 1);
+        u->pos += UndoSize(r->len);
+    } while (u->pos < u->len && ((struct UndoRecord*)(u->buf + u->pos))->group == group);
+    u->paused = 0;
+
+    E.cx = r->ax;
+    E.cy = r->ay;
+    E.dirty = (u->pos != u->saved);
+    EditorFoldReveal(E.cy);
+}
+
+/* Reads the text of a bracketed paste up to its closing \x1b[201~, with
+ * line endings turned into \n. */
+char* EditorReadPaste(int* len)
+{
+    int cap = 4096;
+    int n = 0;
+    char* text = (char*)malloc(cap);
+    char c;
+    for (int idle = 0; idle < KILO_PASTE_WAIT;)
+    {
+        int nread = EditorReadByte(&c);
+        if (nread != 1)
+        {
+            if (nread == -1 && errno != EAGAIN)
+            {
+                Die("read");
+            }
+            idle += 1;
+            continue;
+        }
+        idle = 0;
+
+        if (n == cap)
+        {
+            cap *= 2;
+            text = (char*)realloc(text, cap);
+        }
+        text[n++] = c;
+        if (n >= 6 && !memcmp(&text[n - 6], "\x1b[201~", 6))
+        {
+            n -= 6;
+            break;
+        }
+    }
+
+    int w = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        if (text[i] == '\r')
+        {
+            text[w++] = '\n';
+            i += (i + 1 < n && text[i + 1] == '\n');
+        }
+        else
+        {
+            text[w++] = text[i];
+        }
+    }
+    *len = w;
+    return text;
+}
+
+/* Inserts text at the cursor: its first line goes into the cursor's row and
+ * the rest in one batch of rows, the last of them taking the row's tail. */
+void EditorInsertText(const char* text, int len)
+{
+    if (E.cy == E.numrows)
+    {
+        EditorInsertRow(E.numrows, "", 0);
+    }
+    ERow* row = &E.row[E.cy];
+
+    int n = 1;
+    const char* end = text + len;
+    for (const char* p = text; (p = (const char*)memchr(p, '\n', end - p)) != NULL; ++p)
+    {
+        n += 1;
+    }
+    if (n == 1)
+    {
+        EditorRowInsertChars(row, E.cx, text, len);
+        E.cx += len;
+        return;
+    }
+
+    const char** lines = (const char**)malloc(sizeof(char*) * n);
+    int* lens = (int*)malloc(sizeof(int) * n);
+    const char* p = text;
+    for (int i = 0; i < n; ++i)
+    {
+        const char* nl = (i + 1 < n) ? (const char*)memchr(p, '\n', end - p) : end;
+        lines[i] = p;
+        lens[i] = nl - p;
+        p = nl + 1;
+    }
+
+    int last = lens[n - 1];
+    int tail = row->size - E.cx;
+    char* joined = (char*)malloc(last + tail + 1);
+    memcpy(joined, lines[n - 1], last);
+    memcpy(joined + last, &row->chars[E.cx], tail);
+    lines[n - 1] = joined;
+    lens[n - 1] = last + tail;
+
+    EditorRowDelChars(row, E.cx, tail);
+    EditorRowInsertChars(&E.row[E.cy], E.cx, lines[0], lens[0]);
+    EditorInsertRows(E.cy + 1, n - 1, &lines[1], &lens[1], NULL);
+    E.cy += n - 1;
+    E.cx = last;
+
+    free(joined);
+    free(lines);
+    free(lens);
+    EditorFoldReveal(E.cy);
+}
+
+/* A bracketed paste goes in as a whole rather than a key at a time, so it
+ * is a single undo step however many lines it has. */
+void EditorPaste()
+{
+    int len;
+    char* text = EditorReadPaste(&len);
+    if (!EditorReadOnly())
+    {
+        EditorInsertText(text, len);
+    }
+    free(text);
+
+    /* keeps the next key from typing into the paste's record */
+    EditorUndoSeal();
+}
+
+char* EditorPrompt(char* prompt, void (*callback)(char*, int))
+{
+    size_t bufsize = 128;
+    char* buf = (char*)malloc(bufsize);
+
+    size_t buflen = 0;
+    buf[0] = '\0';
+
+    while (1)
+    {
+        EditorSetStatusMessage(prompt, buf);
+        EditorRefreshScreen();
+
+        int c = EditorReadKey();
+        if (c == '\r')
+        {
+            if (buflen != 0)
+            {
+                EditorSetStatusMessage("");
+                if (callback)
+                {
+                    callback(buf, c);
+                }
+                return buf;
+            }
+        }
+        else if(!iscntrl(c) && c < 128)
+        {
+            if (buflen == bufsize - 1)
+            {
+                bufsize *= 2;
+                buf = (char*)realloc(buf, bufsize);
+            }
+            buf[buflen++] = c;
+            buf[buflen] = '\0';
+        }
+        else if (c == PASTE_START)
+        {
+            int len;
+            char* text = EditorReadPaste(&len);
+            for (int i = 0; i < len; ++i)
+            {
+                if (!iscntrl((unsigned char)text[i]))
+                {
+                    if (buflen == bufsize - 1)
+                    {
+                        bufsize *= 2;
+                        buf = (char*)realloc(buf, bufsize);
+                    }
+                    buf[buflen++] = text[i];
+                    buf[buflen] = '\0';
+                }
+            }
+            free(text);
+        }
+        else if (c == '\x1b')
+        {
+            EditorSetStatusMessage("");
+            if (callback)
+            {
+                callback(buf, c);
+            }
+            free(buf);
+            return NULL;
+        }
+        else if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
+        {
+            if (buflen != 0)
+            {
+                buf[--buflen] = '\0';
+            }
+        }
+
+        if (callback)
+        {
+            callback(buf, c);
+        }
+    }
+}
+
+int EditorReadOnly()
+{
+    if (E.readonly)
+    {
+        EditorSetStatusMessage("Read-only! Opened through its line index (-i).");
+    }
+    return E.readonly;
+}
+
+void EditorGotoLine()
+{
+    char* input = EditorPrompt("Goto line: %s", NULL);
+    if (input == NULL)
+    {
+        return;
+    }
+
+    long line = atol(input);
+    free(input);
+    if (line > E.numrows)
+    {
+        line = E.numrows;
+    }
+    E.cy = (line > 1) ? line - 1 : 0;
+    E.cx = 0;
+    EditorFoldReveal(E.cy);
+}
+
+/* Moves to a byte offset, given in decimal or as 0x hex. */
+void EditorGotoByte()
+{
+    char* input = EditorPrompt("Goto byte: %s", NULL);
+    if (input == NULL)
+    {
+        return;
+    }
+
+    long long off = strtoll(input, NULL, 0);
+    free(input);
+    if (E.numrows == 0)
+    {
+        return;
+    }
+    if (off < 0)
+    {
+        off = 0;
+    }
+
+    E.cy = EditorOffsetRow(off);
+    long long cx = off - EditorRowOffset(E.cy);
+    int size = EditorRowAt(E.cy)->size;
+    E.cx = cx < size ? cx : size;
+    EditorFoldReveal(E.cy);
+}
+
+void EditorProcessKey()
+{
+    static int quit_times = KILO_QUIT_TIMES; 
+    E.macro.keystart = E.macro.len;
+    E.watch.idle = !E.macro.replaying;
+    int c = EditorReadKey();
+    E.watch.idle = 0;
+    long long t = TraceBegin();
+    EditorUndoSeal();
+
+    switch (c)
+    {
+        case '\r':
+            if (EditorGrepResults())
+            {
+                EditorGrepOpen();
+                break;
+            }
+            if (EditorReadOnly())
+            {
+                break;
+            }
+            EditorCursorsClear();
+            EditorInsertNewLine();
+            break;
+        case CTRL_KEY('q'):
+            if (EditorAnyDirty() && quit_times > 0)
+            {
+                EditorSetStatusMessage("WARNNING!! File has unsaved change."
+                "Press Ctrl-Q %d more times to quit.", quit_times);
+                quit_times -= 1;
+                TraceEnd("EditorProcessKey", t);
+                return;
+            }
+            EditorSnapshotAll();
+            EditorWrite("\x1b[2J", 4);
+            EditorWrite("\x1b[H", 3);
+            exit(0);
+            break;
+        case CTRL_KEY('s'):
+            if (EditorReadOnly())
+            {
+                break;
+            }
+            EditorSave();
+            break;
+        case HOME_KEY:
+            E.cx = 0;
+            EditorCursorsMove(c);
+            break;
+        case END_KEY:
+            if (E.cy < E.numrows)
+            {
+                E.cx = EditorRowAt(E.cy)->size;
+            }
+            EditorCursorsMove(c);
+            break;
+        case PAGE_UP:
+        case PAGE_DOWN:
+        {
+            if (EditorVisualLines())
+            {
+                long long top = EditorScreenTop();
+                long long total = FenwickPrefix(&E.wrap.lines, E.numrows);
+                long long line = (c == PAGE_UP) ? top : top + E.screenrows - 1;
+                EditorWrapMoveTo(line < total ? line : total, 0);
+            }
+            else if (c == PAGE_UP)
+            {
+                E.cy = E.rowoff;
+            }
+            else if (c == PAGE_DOWN)
+            {
+                E.cy = E.rowoff + E.screenrows - 1;
+                if (E.cy > E.numrows)
+                {
+                    E.cy  = E.numrows;
+                }
+            }
+            int iTimes = E.screenrows;
+            while(--iTimes)
+            {
+                EditorMoveKey(c == PAGE_UP? ARROW_UP : ARROW_DOWN);
+            }
+        }
+            break;
+        case ARROW_UP: 
+        case ARROW_DOWN: 
+        case ARROW_LEFT: 
+        case ARROW_RIGHT: 
+            EditorMoveKey(c);
+            EditorCursorsMove(c);
+            break;
+            
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+        case DEL_KEY:
+            if (EditorReadOnly())
+            {
+                break;
+            }
+            if (EditorCursorsActive())
+            {
+                EditorBatchEdit(c == DEL_KEY ? DEL_KEY : BACKSPACE);
+                break;
+            }
+            if (c == DEL_KEY)
+            {
+                EditorMoveKey(ARROW_RIGHT);
+            }
+            EditorDelChar();
+            break;
+
+        case CTRL_KEY('l'):
+            E.screen.valid = 0;
+            break;
+        case '\x1b':
+            EditorCursorsClear();
+            break;
+        case CTRL_KEY('f'):
+            EditorFind();
+            break;
+        case CTRL_KEY('t'):
+        {
+            int n = TraceDump();
+            if (n == -1)
+            {
+                EditorSetStatusMessage("Trace off! Set KILO_TRACE to a file path.");
+            }
+            else
+            {
+                EditorSetStatusMessage("%d trace events written to %s", n, E.trace.path);
+            }
+        }
+            break;
+        case CTRL_KEY('g'):
+            EditorGotoLine();
+            break;
+        case CTRL_KEY('b'):
+            EditorGotoByte();
+            break;
+        case CTRL_KEY('x'):
+            EditorWindowCommand();
+            break;
+        case CTRL_KEY('k'):
+            EditorToggleFold();
+            break;
+        case CTRL_KEY('r'):
+            if (EditorReadOnly())
+            {
+                break;
+            }
+            EditorCursorsClear();
+            EditorReload();
+            break;
+        case CTRL_KEY('z'):
+        case CTRL_KEY('y'):
+            if (EditorReadOnly())
+            {
+                break;
+            }
+            EditorCursorsClear();
+            if (c == CTRL_KEY('z'))
+            {
+                EditorUndo();
+            }
+            else
+            {
+                EditorRedo();
+            }
+            break;
+        case PASTE_START:
+            EditorCursorsClear();
+            EditorPaste();
+            break;
+        case CTRL_KEY('d'):
+        case CTRL_KEY('v'):
+            if (EditorReadOnly())
+            {
+                break;
+            }
+            if (c == CTRL_KEY('d'))
+            {
+                EditorAddCursor();
+            }
+            else
+            {
+                EditorToggleBlock();
+            }
+            break;
+        case CTRL_KEY('n'):
+            if (EditorReadOnly())
+            {
+                break;
+            }
+            EditorCursorsClear();
+            EditorComplete();
+            break;
+        case CTRL_KEY(']'):
+            EditorJumpBracket();
+            break;
+        case CTRL_KEY('w'):
+            /* every row's count changes, and edits made with wrap off were
+             * not counted */
+            E.wrap.enabled = !E.wrap.enabled;
+            E.wrap.lines.valid = 0;
+            E.wrap.sub = 0;
+            E.coloff = 0;
+            EditorSetStatusMessage("Soft wrap %s", E.wrap.enabled ? "on" : "off");
+            break;
+        default:
+            if (EditorReadOnly())
+            {
+                break;
+            }
+            if (EditorCursorsActive())
+            {
+                EditorBatchEdit(c);
+                break;
+            }
+            EditorInsertChar(c);
+            break;
+    }
+
+    quit_times = KILO_QUIT_TIMES;
+    if (c != CTRL_KEY('n') && E.complete.active)
+    {
+        EditorCompleteClear();
+    }
+    TraceEnd("EditorProcessKey", t);
+}
+
+/* Draws at most a screen width of row's render starting at column from,
+ * reversing the columns covered by the nmarks start, end pairs in marks. It
+ * walks the highlight runs overlapping the visible columns, so a colour
+ * change costs one escape per run and text goes out in spans, not bytes. */
+void EditorDrawRow(struct ABuf* aBuf, ERow* row, int from, const int* marks, int nmarks)
+{
+    int len = row->rsize - from;
+    if (len < 0)
+    {
+        len = 0;
+    }
+    if (len > E.screencols)
+    {
+        len = E.screencols;
+    }
+
+    char* c = EditorRowRender(row);
+    int end = from + len;
+    int current_color = -1;
+    int run = 0;
+    int runstart = 0;
+    int mark = 0;
+    int inmark = 0;
+    while (mark < nmarks && marks[mark * 2 + 1] <= from)
+    {
+        mark += 1;
+    }
+    for (int at = from; at < end;)
+    {
+        while (run < row->hlruns && runstart + row->hl[run * 2] <= at)
+        {
+            runstart += row->hl[run * 2];
+            run += 1;
+        }
+        while (mark < nmarks && (inmark ? marks[mark * 2 + 1] : marks[mark * 2]) <= at)
+        {
+            AbAppend(aBuf, inmark ? "\x1b[27m" : "\x1b[7m", inmark ? 5 : 4);
+            mark += inmark;
+            inmark = !inmark;
+        }
+
+        int hl = HL_NORMAL;
+        int runend = end;
+        if (run < row->hlruns)
+        {
+            hl = row->hl[run * 2 + 1];
+            if (runstart + row->hl[run * 2] < end)
+            {
+                runend = runstart + row->hl[run * 2];
+            }
+        }
+        if (mark < nmarks)
+        {
+            int edge = inmark ? marks[mark * 2 + 1] : marks[mark * 2];
+            if (edge < runend)
+            {
+                runend = edge;
+            }
+        }
+
+        int color = (hl == HL_NORMAL) ? -1 : EditorSyntaxToColor(hl);
+        if (current_color != color)
+        {
+            current_color = color;
+            if (color == -1)
+            {
+                AbAppend(aBuf, "\x1b[39m", 5);
+            }
+            else
+            {
+                char buf[16];
+                int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+                AbAppend(aBuf, buf, clen);
+            }
+        }
+
+        int span = at;
+        for (int j = at; j < runend; ++j)
+        {
+            if (iscntrl(c[j]))
+            {
+                AbAppend(aBuf, &c[span], j - span);
+                span = j + 1;
+
+                char sym = (c[j] <= 26) ? '@' + c[j] : '?';
+                AbAppend(aBuf, "\x1b[7m", 4);
+                AbAppend(aBuf, &sym, 1);
+                AbAppend(aBuf, "\x1b[m", 3);
+                if (current_color != -1)
+                {
+                    char buf[16];
+                    int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
+                    AbAppend(aBuf, buf, clen);
+                }
+                if (inmark)
+                {
+                    AbAppend(aBuf, "\x1b[7m", 4);
+                }
+            }
+        }
+        AbAppend(aBuf, &c[span], runend - span);
+        at = runend;
+    }
+
+    /* cursors and block columns past the end of the text */
+    if (inmark)
+    {
+        AbAppend(aBuf, "\x1b[27m", 5);
+    }
+    int limit = from + E.screencols;
+    for (int at = end; mark < nmarks; ++mark)
+    {
+        int s = marks[mark * 2] > at ? marks[mark * 2] : at;
+        int e = marks[mark * 2 + 1] < limit ? marks[mark * 2 + 1] : limit;
+        if (s >= e)
+        {
+            continue;
+        }
+        for (; at < s; ++at)
+        {
+            AbAppend(aBuf, " ", 1);
+        }
+        AbAppend(aBuf, "\x1b[7m", 4);
+        for (; at < e; ++at)
+        {
+            AbAppend(aBuf, " ", 1);
+        }
+        AbAppend(aBuf, "\x1b[27m", 5);
+    }
+    AbAppend(aBuf, "\x1b[39m", 5);
+}
+
+void EditorDrawLine(struct ABuf* aBuf, int y)
+{
+    int filerow = y + E.rowoff;
+    int from = E.coloff;
+    if (EditorVisualLines())
+    {
+        EditorWrapLocate(EditorScreenTop() + y, &filerow, &from);
+        from = E.wrap.enabled ? from * E.screencols : E.coloff;
+    }
+
+    if (filerow >= E.numrows)
+    {
+        if (E.numrows == 0 && y == E.screenrows / 3)
+        {
+            char welcome[80];
+
+            int welcomelen = snprintf(welcome, sizeof(welcome), "Kilo editor -- version %s", KILO_VERSION);
+            if (welcomelen > E.screencols)
+            {
+                welcomelen = E.screencols;
+            }
+
+            int padding = (E.screencols - welcomelen) / 2;
+            if (padding)
+            {
+                AbAppend(aBuf, "~", 1);
+                --padding;
+            }
+
+            while (padding--)
+            {
+                AbAppend(aBuf, " ", 1);
+            }
+
+            AbAppend(aBuf, welcome, welcomelen);
+        }
+        else
+        {
+            AbAppend(aBuf, "~", 1);
+        }
+    }
+    else
+    {
+        int marks[16];
+        int nmarks = EditorCursorsActive() ? EditorCursorMarks(filerow, marks, 8) : 0;
+        struct Brackets* b = &E.brackets;
+        if (nmarks == 0 && b->shown)
+        {
+            /* in column order, as EditorDrawRow takes them */
+            int first = (b->at[0] == b->at[1] && b->rx[1] < b->rx[0]);
+            for (int i = 0; i < 2; ++i)
+            {
+                int k = i ^ first;
+                if (b->at[k] == filerow)
+                {
+                    marks[nmarks * 2] = b->rx[k];
+                    marks[nmarks * 2 + 1] = b->rx[k] + 1;
+                    nmarks += 1;
+                }
+            }
+        }
+        EditorRowEnsure(&E.row[filerow]);
+        EditorDrawRow(aBuf, &E.row[filerow], from, marks, nmarks);
+        if (E.folds.count)
+        {
+            EditorDrawFoldMarker(aBuf, filerow, from);
+        }
+    }
+}
+
+void EditorDrawRows(struct ABuf* aBuf)
+{
+    E.brackets.shown = (EditorBracketMatch(E.brackets.at, E.brackets.rx) == 1);
+    for (int y = 0; y < E.screenrows; ++y)
+    {
+        EditorDrawLine(aBuf, y);
+        AbAppend(aBuf, "\x1b[K", 3);
+        AbAppend(aBuf, "\r\n", 2);
+    }
+}
+
+/* Draws only the text lines that differ from what the terminal shows. When
+ * the view moved vertically, the lines still visible are first shifted with
+ * a scroll region (DECSTBM with SU/SD) instead of being sent again. */
+void EditorDrawChanged(struct ABuf* aBuf, int origin)
+{
+    struct Screen* sc = &E.screen;
+    int total = E.win.nviews ? E.win.rows : E.screenrows;
+    if (!sc->valid || sc->rows != total || sc->cols != E.screencols)
+    {
+        sc->lines = (unsigned long long*)realloc(sc->lines, sizeof(unsigned long long) * total);
+        memset(sc->lines, 0, sizeof(unsigned long long) * total);
+        sc->rows = total;
+        sc->cols = E.screencols;
+        sc->top = EditorScreenTop();
+        sc->coloff = E.coloff;
+        sc->valid = 1;
+    }
+
+    /* this window's slice of the terminal */
+    unsigned long long* lines = &sc->lines[origin];
+    int rows = E.screenrows;
+
+    long long d = EditorScreenTop() - sc->top;
+    if (d != 0 && E.coloff == sc->coloff && d > -rows && d < rows)
+    {
+        char buf[64];
+        int n = d > 0 ? d : -d;
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dr\x1b[%d%c\x1b[r", origin + 1, origin + rows, n, d > 0 ? 'S' : 'T');
+        AbAppend(aBuf, buf, strlen(buf));
+
+        if (d > 0)
+        {
+            memmove(lines, &lines[n], sizeof(unsigned long long) * (rows - n));
+            memset(&lines[rows - n], 0, sizeof(unsigned long long) * n);
+        }
+        else
+        {
+            memmove(&lines[n], lines, sizeof(unsigned long long) * (rows - n));
+            memset(lines, 0, sizeof(unsigned long long) * n);
+        }
+    }
+    sc->top = EditorScreenTop();
+    sc->coloff = E.coloff;
+    E.brackets.shown = (EditorBracketMatch(E.brackets.at, E.brackets.rx) == 1);
+
+    static struct ABuf line = ABUF_INIT;
+    for (int y = 0; y < rows; ++y)
+    {
+        line.len = 0;
+        EditorDrawLine(&line, y);
+
+        unsigned long long h = 14695981039346656037ULL;
+        for (int i = 0; i < line.len; ++i)
+        {
+            h = (h ^ (unsigned char)line.b[i]) * 1099511628211ULL;
+        }
+        h |= 1;
+        if (h == lines[y])
+        {
+            continue;
+        }
+        lines[y] = h;
+
+        char buf[32];
+        snprintf(buf, sizeof(buf), "\x1b[%d;1H", origin + y + 1);
+        AbAppend(aBuf, buf, strlen(buf));
+        AbAppend(aBuf, line.b, line.len);
+        AbAppend(aBuf, "\x1b[K", 3);
+    }
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "\x1b[%d;1H", origin + rows + 1);
+    AbAppend(aBuf, buf, strlen(buf));
+}
+
+int EditorRowCxToRx(ERow* row, int cx)
+{
+    int rx = 0;
+    
+    for (int j = 0; j < cx; ++j)
+    {
+        if (row->chars[j] == '\t')
+        {
+            rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+        }
+        ++rx;
+    }
+
+    return rx;
+}
+
+int EditorRowRxToCx(ERow* row, int rx)
+{
+    int cur_rx = 0;
+    
     int cx = 0;
     for (; cx < row->size; ++cx)
     {
-        if (row->chars[cx] == '\t')
+        if (row->chars[cx] == '\t')
+        {
+            cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
+        }
+        cur_rx += 1;
+
+        if (cur_rx > rx)
+        {
+            return cx;
+        }
+    }
+
+    return cx;
+}
+
+/* Raw text of row `at`, straight from the index for rows not loaded. */
+void EditorRowText(int at, const char** s, int* len)
+{
+    if (E.row[at].chars)
+    {
+        *s = E.row[at].chars;
+        *len = E.row[at].size;
+        return;
+    }
+    EditorIndexRow(at, s, len);
+}
+
+/* First fold starting at or after row `at`. */
+int FoldLowerBound(int at)
+{
+    int lo = 0;
+    int hi = E.folds.count;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (E.folds.ranges[mid].start < at)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* The fold hiding row `at`, or -1. */
+int EditorFoldHiding(int at)
+{
+    int f = FoldLowerBound(at) - 1;
+    return (f >= 0 && E.folds.ranges[f].end >= at) ? f : -1;
+}
+
+/* The fold headed by row `at`, or -1. */
+int EditorFoldAt(int at)
+{
+    int f = FoldLowerBound(at);
+    return (f < E.folds.count && E.folds.ranges[f].start == at) ? f : -1;
+}
+
+/* Whether the view moves in visual lines rather than rows. */
+int EditorVisualLines()
+{
+    return E.wrap.enabled || E.folds.count > 0;
+}
+
+long long WrapValue(int at);
+
+/* Recounts the visual lines of rows first to last once a fold over them
+ * closed or opened; past an eighth of the file a rebuild is cheaper. */
+void EditorWrapRecount(int first, int last)
+{
+    if (!E.wrap.lines.valid || E.wrap.lines.n != E.numrows || (last - first) * 8LL > E.numrows)
+    {
+        E.wrap.lines.valid = 0;
+        return;
+    }
+    for (int r = first; r <= last; ++r)
+    {
+        long long delta = WrapValue(r) - FenwickGet(&E.wrap.lines, r);
+        if (delta)
+        {
+            FenwickAdd(&E.wrap.lines, r, delta);
+        }
+    }
+}
+
+/* Folds rows start + 1 to end, taking in the folds they overlap. */
+void EditorFoldAdd(int start, int end)
+{
+    int i = FoldLowerBound(start);
+    if (i > 0 && E.folds.ranges[i - 1].end >= start)
+    {
+        i -= 1;
+        start = E.folds.ranges[i].start;
+    }
+    int j = i;
+    while (j < E.folds.count && E.folds.ranges[j].start <= end)
+    {
+        if (E.folds.ranges[j].end > end)
+        {
+            end = E.folds.ranges[j].end;
+        }
+        ++j;
+    }
+
+    if (i == j && E.folds.count == E.folds.cap)
+    {
+        E.folds.cap = E.folds.cap ? E.folds.cap * 2 : 16;
+        E.folds.ranges = (struct Fold*)realloc(E.folds.ranges, sizeof(struct Fold) * E.folds.cap);
+    }
+    memmove(&E.folds.ranges[i + 1], &E.folds.ranges[j], sizeof(struct Fold) * (E.folds.count - j));
+    E.folds.count += 1 - (j - i);
+    E.folds.ranges[i].start = start;
+    E.folds.ranges[i].end = end;
+    EditorWrapRecount(start + 1, end);
+}
+
+void EditorFoldRemove(int f)
+{
+    struct Fold open = E.folds.ranges[f];
+    memmove(&E.folds.ranges[f], &E.folds.ranges[f + 1], sizeof(struct Fold) * (E.folds.count - f - 1));
+    E.folds.count -= 1;
+    EditorWrapRecount(open.start + 1, open.end);
+}
+
+/* Moves the folds over delta rows inserted (delta > 0) or -delta rows
+ * deleted (delta < 0) at `at`. Rows inserted inside a fold stay hidden;
+ * deleting a fold's header opens it. */
+void EditorFoldShift(int at, int delta)
+{
+    int kept = 0;
+    for (int i = 0; i < E.folds.count; ++i)
+    {
+        struct Fold f = E.folds.ranges[i];
+        if (f.start >= (delta > 0 ? at : at - delta))
+        {
+            f.start += delta;
+            f.end += delta;
+        }
+        else if (f.start >= at)
+        {
+            continue;
+        }
+        else if (f.end >= at)
+        {
+            f.end = (delta < 0 && f.end < at - delta) ? at - 1 : f.end + delta;
+        }
+
+        if (f.end > f.start)
+        {
+            E.folds.ranges[kept++] = f;
+        }
+    }
+    if (kept != E.folds.count)
+    {
+        E.folds.count = kept;
+        E.wrap.lines.valid = 0;
+    }
+}
+
+/* Opens the fold hiding row `at`, so the cursor can go there. */
+void EditorFoldReveal(int at)
+{
+    int f = E.folds.count ? EditorFoldHiding(at) : -1;
+    if (f != -1)
+    {
+        EditorFoldRemove(f);
+    }
+}
+
+/* Braces a line opens and, in *low, the most it closes on the way, leaving
+ * out quoted text and comments. */
+int FoldBraces(const char* s, int len, int* low)
+{
+    const char* quotes = (E.syntax && E.syntax->quotes) ? E.syntax->quotes : "\"'";
+    const char* scs = E.syntax ? E.syntax->singleline_comment_start : NULL;
+    int scs_len = scs ? strlen(scs) : 0;
+
+    int depth = 0;
+    char quote = 0;
+    *low = 0;
+    for (int i = 0; i < len; ++i)
+    {
+        if (quote)
+        {
+            if (s[i] == '\\')
+            {
+                ++i;
+            }
+            else if (s[i] == quote)
+            {
+                quote = 0;
+            }
+        }
+        else if (scs_len && len - i >= scs_len && !strncmp(&s[i], scs, scs_len))
+        {
+            break;
+        }
+        else if (s[i] && strchr(quotes, s[i]))
+        {
+            quote = s[i];
+        }
+        else if (s[i] == '{')
+        {
+            ++depth;
+        }
+        else if (s[i] == '}' && --depth < *low)
+        {
+            *low = depth;
+        }
+    }
+    return depth;
+}
+
+/* Indentation of a line in columns, or -1 if it is blank. */
+int FoldIndent(const char* s, int len)
+{
+    int col = 0;
+    for (int i = 0; i < len; ++i)
+    {
+        if (s[i] == '\t')
+        {
+            col += KILO_TAB_STOP - col % KILO_TAB_STOP;
+        }
+        else if (s[i] == ' ')
+        {
+            col += 1;
+        }
+        else
+        {
+            return col;
+        }
+    }
+    return -1;
+}
+
+/* Last row of the region row `at` heads: through the brace closing one the
+ * row, or a next row starting with '{', leaves open; or else the rows
+ * indented deeper than it. A closing row that opens the next block
+ * ("} else {") stays outside. -1 if none. */
+int EditorFoldRange(int at)
+{
+    const char* s;
+    int len;
+    int low;
+    EditorRowText(at, &s, &len);
+    int depth = FoldBraces(s, len, &low) - low;
+    int r = at + 1;
+    if (depth <= 0 && r < E.numrows)
+    {
+        const char* next;
+        int nextlen;
+        EditorRowText(r, &next, &nextlen);
+        int in = FoldIndent(next, nextlen);
+        if (in != -1 && next[strspn(next, " \t")] == '{')
+        {
+            depth = FoldBraces(next, nextlen, &low) - low;
+            r += 1;
+        }
+    }
+
+    if (depth > 0)
+    {
+        for (; r < E.numrows; ++r)
+        {
+            EditorRowText(r, &s, &len);
+            int net = FoldBraces(s, len, &low);
+            if (depth + low <= 0)
+            {
+                return net - low > 0 ? r - 1 : r;
+            }
+            depth += net;
+        }
+        return E.numrows - 1;
+    }
+
+    int indent = FoldIndent(s, len);
+    int end = -1;
+    for (int r = at + 1; indent != -1 && r < E.numrows; ++r)
+    {
+        EditorRowText(r, &s, &len);
+        int in = FoldIndent(s, len);
+        if (in == -1)
+        {
+            continue;
+        }
+        if (in <= indent)
+        {
+            break;
+        }
+        end = r;
+    }
+    return end;
+}
+
+/* CTRL-K: folds the region the cursor row heads, or opens the fold there. */
+void EditorToggleFold()
+{
+    if (E.cy >= E.numrows)
+    {
+        return;
+    }
+
+    int f = EditorFoldAt(E.cy);
+    if (f != -1)
+    {
+        EditorSetStatusMessage("Unfolded %d lines", E.folds.ranges[f].end - E.cy);
+        EditorFoldRemove(f);
+        return;
+    }
+
+    int end = EditorFoldRange(E.cy);
+    if (end <= E.cy)
+    {
+        EditorSetStatusMessage("Nothing to fold here");
+        return;
+    }
+    EditorFoldAdd(E.cy, end);
+    EditorSetStatusMessage("Folded %d lines", end - E.cy);
+}
+
+/* Counts a fold's hidden rows after its header's text, on the header's last
+ * screen line and only if it fits. */
+void EditorDrawFoldMarker(struct ABuf* aBuf, int at, int from)
+{
+    int f = EditorFoldAt(at);
+    if (f == -1)
+    {
+        return;
+    }
+    int shown = E.row[at].rsize - from;
+    if (shown < 0)
+    {
+        shown = 0;
+    }
+
+    char marker[32];
+    int len = snprintf(marker, sizeof(marker), " [+%d]", E.folds.ranges[f].end - at);
+    if (shown + len > E.screencols)
+    {
+        return;
+    }
+    AbAppend(aBuf, "\x1b[36m", 5);
+    AbAppend(aBuf, marker, len);
+    AbAppend(aBuf, "\x1b[39m", 5);
+}
+
+/* Visual lines of row `at`: none if folded away, one without wrapping. */
+long long WrapValue(int at)
+{
+    if (E.folds.count && EditorFoldHiding(at) != -1)
+    {
+        return 0;
+    }
+    if (!E.wrap.enabled)
+    {
+        return 1;
+    }
+
+    int len = E.row[at].rsize;
+    if (E.row[at].chars == NULL)
+    {
+        const char* start;
+        EditorIndexRow(at, &start, &len);
+    }
+    return len > E.wrap.cols ? (len + E.wrap.cols - 1) / E.wrap.cols : 1;
+}
+
+void EditorWrapIndex()
+{
+    if (!E.wrap.lines.valid || E.wrap.lines.n != E.numrows || E.wrap.cols != E.screencols ||
+        E.wrap.built != E.wrap.enabled)
+    {
+        E.wrap.cols = E.screencols;
+        E.wrap.built = E.wrap.enabled;
+        FenwickBuild(&E.wrap.lines, E.numrows, WrapValue);
+    }
+}
+
+/* Keeps a re-rendered row's visual line count current. With wrap off a row
+ * counts one line however long it is, so there is nothing to do, and the
+ * tree is built again when wrap is turned on (or a window showing the
+ * buffer with it on is entered, see built). */
+void EditorWrapUpdate(ERow* row)
+{
+    int at = row - E.row;
+    if (!E.wrap.enabled || E.wrap.built != E.wrap.enabled || !E.wrap.lines.valid || at >= E.wrap.lines.n)
+    {
+        return;
+    }
+    long long delta = WrapValue(at) - FenwickGet(&E.wrap.lines, at);
+    if (delta)
+    {
+        FenwickAdd(&E.wrap.lines, at, delta);
+    }
+}
+
+/* Maps a visual line to its row and the line within that row; past the end
+ * it gives E.numrows. */
+void EditorWrapLocate(long long line, int* row, int* sub)
+{
+    EditorWrapIndex();
+    *row = FenwickFind(&E.wrap.lines, line);
+    *sub = (*row < E.numrows) ? line - FenwickPrefix(&E.wrap.lines, *row) : 0;
+}
+
+/* The cursor's visual line and its column on that line. */
+long long EditorWrapCursor(int* col)
+{
+    EditorWrapIndex();
+    long long line = FenwickPrefix(&E.wrap.lines, E.cy < E.numrows ? E.cy : E.numrows);
+    *col = 0;
+    if (E.cy < E.numrows)
+    {
+        EditorRowEnsure(&E.row[E.cy]);
+        int rx = EditorRowCxToRx(&E.row[E.cy], E.cx);
+        int sub = E.wrap.enabled ? rx / E.wrap.cols : 0;
+        int last = FenwickGet(&E.wrap.lines, E.cy) - 1;
+        if (sub > last)
+        {
+            sub = last > 0 ? last : 0;
+        }
+        *col = rx - sub * E.wrap.cols;
+        line += sub;
+    }
+    return line;
+}
+
+/* Visual (or file, without wrapping or folds) line shown at the top of the
+ * screen. */
+long long EditorScreenTop()
+{
+    if (!EditorVisualLines())
+    {
+        return E.rowoff;
+    }
+    EditorWrapIndex();
+    int top = E.rowoff < E.numrows ? E.rowoff : E.numrows;
+    return FenwickPrefix(&E.wrap.lines, top) + (top == E.rowoff ? E.wrap.sub : 0);
+}
+
+/* Moves the cursor to visual line `line`, keeping its column. */
+void EditorWrapMoveTo(long long line, int col)
+{
+    EditorWrapIndex();
+    long long total = FenwickPrefix(&E.wrap.lines, E.numrows);
+    if (line < 0 || line > total)
+    {
+        return;
+    }
+
+    int sub;
+    EditorWrapLocate(line, &E.cy, &sub);
+    E.cx = (E.cy < E.numrows) ? EditorRowRxToCx(EditorRowAt(E.cy), sub * E.wrap.cols + col) : 0;
+}
+
+void EditorScroll()
+{
+    /* another window may have folded the rows under this one's cursor */
+    int f = (E.folds.count && E.cy < E.numrows) ? EditorFoldHiding(E.cy) : -1;
+    if (f != -1)
+    {
+        E.cy = E.folds.ranges[f].start;
+        E.cx = 0;
+    }
+
+    E.rx = 0;
+    if (E.cy < E.numrows)
+    {
+        E.rx = EditorRowCxToRx(EditorRowAt(E.cy), E.cx);
+    }
+
+    if (EditorVisualLines())
+    {
+        /* unloaded rows of an indexed file are counted without tab expansion,
+         * so once the rows on screen are rendered the view is placed again */
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            int col;
+            long long cursor = EditorWrapCursor(&col);
+            long long top = EditorScreenTop();
+            if (cursor < top)
+            {
+                top = cursor;
+            }
+            if (cursor >= top + E.screenrows)
+            {
+                top = cursor - E.screenrows + 1;
+            }
+            EditorWrapLocate(top, &E.rowoff, &E.wrap.sub);
+            if (!E.readonly)
+            {
+                break;
+            }
+
+            long long lines = -E.wrap.sub;
+            for (int r = E.rowoff; r < E.numrows && lines < E.screenrows; ++r)
+            {
+                EditorRowEnsure(&E.row[r]);
+                lines += FenwickGet(&E.wrap.lines, r);
+            }
+        }
+        if (E.wrap.enabled)
+        {
+            E.coloff = 0;
+            return;
+        }
+    }
+    else
+    {
+        if (E.cy < E.rowoff)
+        {
+            E.rowoff = E.cy;
+        }
+
+        if (E.cy >= E.rowoff + E.screenrows)
+        {
+            E.rowoff = E.cy - E.screenrows + 1;
+        }
+    }
+
+    if (E.rx < E.coloff)
+    {   
+        E.coloff = E.rx;
+    }
+
+    if (E.rx >= E.coloff + E.screencols)
+    {
+        E.coloff = E.rx - E.screencols + 1;
+    }
+}
+
+void EditorDrawStatusBar(struct ABuf* ab)
+{
+    AbAppend(ab, "\x1b[7m", 4);
+    
+    char status[80];
+    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.filename ? E.filename : "[No Name]",
+            E.numrows, E.dirty? "(modified)" : "");
+    if (len > E.screencols)
+    {       
+        len = E.screencols;
+    }
+
+    char rstatus[80];
+    long long offset = EditorRowOffset(E.cy) + (E.cy < E.numrows ? E.cx : 0);
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | @%lld | %d/%d", E.syntax ? E.syntax->filetype : "no ft",
+                        offset, E.cy + 1, E.numrows);
+    if (E.trace.enabled && rlen < (int)sizeof(rstatus))
+    {
+        long long us = E.lat.rolling / 1000;
+        rlen += snprintf(&rstatus[rlen], sizeof(rstatus) - rlen, us < 10000 ? " | %lldus" : " | %lldms",
+                         us < 10000 ? us : us / 1000);
+    }
+    AbAppend(ab, status, len);
+
+    while (len < E.screencols)
+    {
+        if (E.screencols - len == rlen)
+        {
+            AbAppend(ab, rstatus, rlen);
+            break;
+        }
+        else
+        {
+            AbAppend(ab, " ", 1);
+            len += 1;
+        }
+    }
+    AbAppend(ab, "\x1b[m", 3);
+    AbAppend(ab, "\r\n", 2);
+}
+
+void EditorDrawMessageBar(struct ABuf* ab)
+{
+    AbAppend(ab, "\x1b[K", 3);
+    int msglen = strlen(E.statusmsg);
+    if (msglen > E.screencols)
+    {
+        msglen = E.screencols;
+    }
+    if (msglen && time(NULL) - E.statusmsg_time < 5)
+    {
+        AbAppend(ab, E.statusmsg, msglen);
+    }
+}
+
+void BufferSave(struct Buffer* b)
+{
+    EditorHighlightFlush();
+    b->numrows = E.numrows;
+    b->rowcap = E.rowcap;
+    b->row = E.row;
+    b->filename = E.filename;
+    b->dirty = E.dirty;
+    b->syntax = E.syntax;
+    b->cache = E.cache;
+    b->index = E.index;
+    b->readonly = E.readonly;
+    b->offsets = E.offsets;
+    b->snapshot = E.snapshot;
+    b->wrapcols = E.wrap.cols;
+    b->wrapbuilt = E.wrap.built;
+    b->wraplines = E.wrap.lines;
+    b->folds = E.folds;
+    b->undo = E.undo;
+    b->disk = E.disk;
+    b->codec = E.codec;
+    b->words = E.words;
+    b->brackets = E.brackets;
+}
+
+void BufferLoad(const struct Buffer* b)
+{
+    E.numrows = b->numrows;
+    E.rowcap = b->rowcap;
+    E.row = b->row;
+    E.filename = b->filename;
+    E.dirty = b->dirty;
+    E.syntax = b->syntax;
+    E.cache = b->cache;
+    E.index = b->index;
+    E.readonly = b->readonly;
+    E.offsets = b->offsets;
+    E.snapshot = b->snapshot;
+    E.wrap.cols = b->wrapcols;
+    E.wrap.built = b->wrapbuilt;
+    E.wrap.lines = b->wraplines;
+    E.folds = b->folds;
+    E.undo = b->undo;
+    E.disk = b->disk;
+    E.codec = b->codec;
+    E.words = b->words;
+    E.brackets = b->brackets;
+}
+
+void ViewSave(struct View* v)
+{
+    v->height = E.screenrows;
+    v->cx = E.cx;
+    v->cy = E.cy;
+    v->rx = E.rx;
+    v->rowoff = E.rowoff;
+    v->coloff = E.coloff;
+    v->wrap = E.wrap.enabled;
+    v->sub = E.wrap.sub;
+    v->drawn_top = E.screen.top;
+    v->drawn_coloff = E.screen.coloff;
+}
+
+/* Loads a view over the buffer already in E; rows another view deleted
+ * pull the cursor back inside the buffer. */
+void ViewLoad(const struct View* v)
+{
+    E.screenrows = v->height;
+    E.cy = v->cy < E.numrows ? v->cy : E.numrows;
+    E.cx = (E.cy < E.numrows && v->cx > E.row[E.cy].size) ? E.row[E.cy].size : v->cx;
+    if (E.cy == E.numrows)
+    {
+        E.cx = 0;
+    }
+    E.rx = v->rx;
+    E.rowoff = v->rowoff;
+    E.coloff = v->coloff;
+    E.wrap.enabled = v->wrap;
+    E.wrap.sub = v->sub;
+    E.screen.top = v->drawn_top;
+    E.screen.coloff = v->drawn_coloff;
+}
+
+/* Turns the lone view in E into the first window. */
+void EditorWindowsInit()
+{
+    if (E.win.nviews)
+    {
+        return;
+    }
+    E.win.buffers = (struct Buffer*)calloc(1, sizeof(struct Buffer));
+    E.win.views = (struct View*)calloc(1, sizeof(struct View));
+    E.win.nbuffers = 1;
+    E.win.nviews = 1;
+    E.win.current = 0;
+    E.win.rows = E.screenrows + 1;
+    BufferSave(&E.win.buffers[0]);
+    ViewSave(&E.win.views[0]);
+}
+
+void EditorFocus(int v)
+{
+    struct View* cur = &E.win.views[E.win.current];
+    BufferSave(&E.win.buffers[cur->buffer]);
+    ViewSave(cur);
+
+    E.win.current = v;
+    BufferLoad(&E.win.buffers[E.win.views[v].buffer]);
+    ViewLoad(&E.win.views[v]);
+}
+
+int EditorAnyDirty()
+{
+    if (E.dirty)
+    {
+        return 1;
+    }
+    for (int b = 0; b < E.win.nbuffers; ++b)
+    {
+        if (b != E.win.views[E.win.current].buffer && E.win.buffers[b].dirty)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Splits the current window in two views of its buffer. */
+void EditorSplitWindow()
+{
+    EditorWindowsInit();
+    if (E.screenrows < 3)
+    {
+        EditorSetStatusMessage("Window too small to split");
+        return;
+    }
+
+    struct View* cur = &E.win.views[E.win.current];
+    ViewSave(cur);
+    int span = cur->height + 1;
+
+    E.win.views = (struct View*)realloc(E.win.views, sizeof(struct View) * (E.win.nviews + 1));
+    cur = &E.win.views[E.win.current];
+    memmove(cur + 2, cur + 1, sizeof(struct View) * (E.win.nviews - E.win.current - 1));
+    E.win.nviews += 1;
+
+    cur[1] = cur[0];
+    cur[0].height = span / 2 - 1;
+    cur[1].top = cur[0].top + span / 2;
+    cur[1].height = span - span / 2 - 1;
+    E.screenrows = cur[0].height;
+    E.screen.valid = 0;
+}
+
+/* Closes the current window, or with `others` every other one. */
+void EditorCloseWindow(int others)
+{
+    if (E.win.nviews <= 1)
+    {
+        return;
+    }
+
+    int at = E.win.current;
+    EditorFocus(at);
+    if (others)
+    {
+        E.win.views[0] = E.win.views[at];
+        E.win.views[0].top = 0;
+        E.win.views[0].height = E.win.rows - 1;
+        E.win.nviews = 1;
+        E.win.current = 0;
+    }
+    else
+    {
+        /* the window above takes the space, or below for the first one */
+        struct View closed = E.win.views[at];
+        memmove(&E.win.views[at], &E.win.views[at + 1], sizeof(struct View) * (E.win.nviews - at - 1));
+        E.win.nviews -= 1;
+        int heir = at > 0 ? at - 1 : 0;
+        E.win.views[heir].height += closed.height + 1;
+        if (at == 0)
+        {
+            E.win.views[0].top = 0;
+        }
+        E.win.current = heir;
+    }
+
+    BufferLoad(&E.win.buffers[E.win.views[E.win.current].buffer]);
+    ViewLoad(&E.win.views[E.win.current]);
+    E.screen.valid = 0;
+}
+
+/* Fits the windows to a terminal of rows x cols. The bottom window takes up
+ * the difference, or the windows collapse into one if it no longer fits. */
+void EditorResize(int rows, int cols)
+{
+    E.screencols = cols;
+    E.screen.valid = 0;
+    if (E.win.nviews == 0)
+    {
+        E.screenrows = rows - 2;
+        return;
+    }
+
+    ViewSave(&E.win.views[E.win.current]);
+    struct View* last = &E.win.views[E.win.nviews - 1];
+    int height = last->height + (rows - 1) - E.win.rows;
+    E.win.rows = rows - 1;
+    if (height < 1)
+    {
+        EditorCloseWindow(1);
+        return;
+    }
+    last->height = height;
+    ViewLoad(&E.win.views[E.win.current]);
+}
+
+/* Shows buffer b in the current window at the place it was last left. */
+void EditorShowBuffer(int b)
+{
+    struct View* v = &E.win.views[E.win.current];
+    struct Buffer* old = &E.win.buffers[v->buffer];
+    BufferSave(old);
+    old->cx = E.cx;
+    old->cy = E.cy;
+
+    v->buffer = b;
+    BufferLoad(&E.win.buffers[b]);
+    ViewSave(v);
+    v->cx = E.win.buffers[b].cx;
+    v->cy = E.win.buffers[b].cy;
+    v->rowoff = 0;
+    v->coloff = 0;
+    v->sub = 0;
+    ViewLoad(v);
+}
+
+/* Adds an empty buffer with the current one's cache and undo budgets. */
+int EditorNewBuffer()
+{
+    int b = E.win.nbuffers++;
+    E.win.buffers = (struct Buffer*)realloc(E.win.buffers, sizeof(struct Buffer) * E.win.nbuffers);
+    memset(&E.win.buffers[b], 0, sizeof(struct Buffer));
+    E.win.buffers[b].cache.budget = E.cache.budget;
+    E.win.buffers[b].undo.budget = E.undo.budget;
+    E.win.buffers[b].codec = -1;
+    return b;
+}
+
+/* Opens a file in the current window, reusing its buffer if it is open. */
+int EditorOpenFile(const char* name)
+{
+    EditorWindowsInit();
+    BufferSave(&E.win.buffers[E.win.views[E.win.current].buffer]);
+    for (int b = 0; b < E.win.nbuffers; ++b)
+    {
+        if (E.win.buffers[b].filename && !strcmp(E.win.buffers[b].filename, name))
+        {
+            EditorShowBuffer(b);
+            return 0;
+        }
+    }
+
+    struct stat st;
+    if (stat(name, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        EditorSetStatusMessage("Can't open %s", name);
+        return -1;
+    }
+
+    int prev = E.win.views[E.win.current].buffer;
+    EditorShowBuffer(EditorNewBuffer());
+    if (EditorOpen(name) == -1)
+    {
+        EditorSetStatusMessage("Can't open %s: %s", name, strerror(errno));
+        EditorShowBuffer(prev);
+        E.win.nbuffers -= 1;
+        return -1;
+    }
+    EditorWatch();
+    return 0;
+}
+
+void EditorOpenBuffer()
+{
+    char* name = EditorPrompt("Open file: %s", NULL);
+    if (name == NULL)
+    {
+        return;
+    }
+    EditorOpenFile(name);
+    free(name);
+}
+
+/* CTRL-X ( starts recording a macro and CTRL-X ) ends it, leaving out the
+ * CTRL-X ) itself. */
+void EditorMacroRecord(int start)
+{
+    struct Macro* m = &E.macro;
+    if (m->replaying)
+    {
+        return;
+    }
+    if (start)
+    {
+        m->recording = 1;
+        m->len = 0;
+        m->ntimeouts = 0;
+        EditorSetStatusMessage("Defining macro...");
+        return;
+    }
+    if (!m->recording)
+    {
+        EditorSetStatusMessage("Not defining a macro");
+        return;
+    }
+    m->recording = 0;
+    m->len = m->keystart;
+    while (m->ntimeouts > 0 && m->timeouts[m->ntimeouts - 1] > m->len)
+    {
+        m->ntimeouts -= 1;
+    }
+    EditorSetStatusMessage("Macro defined, %d bytes", m->len);
+}
+
+/* Whether ESC or CTRL-C is waiting on the terminal. It is taken out of the
+ * input, which keeps any other keys for after the replay. An ESC that starts
+ * an escape sequence does not count. */
+int MacroInterrupted()
+{
+    struct Input* in = &E.input;
+    if (E.headless || E.server.fd != -1)
+    {
+        return 0;
+    }
+    if (in->at == in->len)
+    {
+        in->at = 0;
+        in->len = 0;
+    }
+    struct pollfd fd = {E.ifd, POLLIN, 0};
+    if (in->len < (int)sizeof(in->buf) && poll(&fd, 1, 0) == 1 && (fd.revents & POLLIN))
+    {
+        ssize_t n = read(E.ifd, in->buf + in->len, sizeof(in->buf) - in->len);
+        in->len += n > 0 ? n : 0;
+    }
+    for (int i = in->at; i < in->len; ++i)
+    {
+        char c = in->buf[i];
+        int sequence = (c == '\x1b' && i + 1 < in->len && (in->buf[i + 1] == '[' || in->buf[i + 1] == 'O'));
+        if ((c == '\x1b' && !sequence) || c == CTRL_KEY('c'))
+        {
+            memmove(&in->buf[i], &in->buf[i + 1], in->len - i - 1);
+            in->len -= 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Replays the macro `times` times, or with times 0 until a key takes the
+ * cursor past the last row or a pass fails to bring it closer to the end of
+ * the file, whichever comes first. ESC or CTRL-C stops it, checked every
+ * KILO_MACRO_POLL passes. Nothing is drawn until the end, and rows edited on
+ * the way are highlighted once then, so a long replay costs the edits rather
+ * than a frame per key. */
+void EditorMacroReplay(int times)
+{
+    struct Macro* m = &E.macro;
+    if (m->replaying)
+    {
+        return;
+    }
+    if (m->recording)
+    {
+        EditorSetStatusMessage("Can't replay a macro while defining it");
+        return;
+    }
+    if (m->len == 0)
+    {
+        EditorSetStatusMessage("No macro defined");
+        return;
+    }
+
+    long long t = NowNs();
+    int n = 0;
+    m->replaying = 1;
+    int stopped = 0;
+    while (m->replaying && (times == 0 ? E.cy < E.numrows : n < times))
+    {
+        if (n > 0 && n % KILO_MACRO_POLL == 0 && MacroInterrupted())
+        {
+            stopped = 1;
+            break;
+        }
+        int left = E.numrows - E.cy;
+        m->at = 0;
+        m->timeout = 0;
+        while (m->replaying && m->at < m->len && (times != 0 || E.cy < E.numrows))
+        {
+            EditorProcessKey();
+        }
+        n += 1;
+        if (times == 0 && E.numrows - E.cy >= left)
+        {
+            break;
+        }
+    }
+    m->replaying = 0;
+    EditorHighlightFlush();
+    EditorSetStatusMessage("Macro replayed %d times in %.2fs%s", n, (NowNs() - t) / 1e9, stopped ? " (stopped)" : "");
+}
+
+/* CTRL-X E: asks how many times to replay the macro, 0 for down to the end
+ * of the file. */
+void EditorMacroRepeat()
+{
+    char* count = EditorPrompt("Replay macro how many times (0 to end of file): %s", NULL);
+    if (count == NULL)
+    {
+        return;
+    }
+    int times = atoi(count);
+    free(count);
+    EditorMacroReplay(times < 0 ? 0 : times);
+}
+
+/* CTRL-X prefix: 2 split, o other window, 0 close, 1 close others,
+ * b next buffer, f open file, g/G grep the project, ( ) record a macro,
+ * e/E replay it, s sort, u unique, k/v keep/drop matching lines,
+ * d detach from a server. */
+void EditorWindowCommand()
+{
+    EditorSetStatusMessage("C-x: 2 o 0 1 window  b f buffer  gG grep  ()eE macro  s u k v lines  d detach");
+    EditorRefreshScreen();
+    int c = EditorReadKey();
+    EditorSetStatusMessage("");
+    /* the line commands take the column block as their range */
+    if (c != 's' && c != 'u' && c != 'k' && c != 'v')
+    {
+        EditorCursorsClear();
+    }
+
+    switch (c)
+    {
+        case '2':
+            EditorSplitWindow();
+            break;
+        case 'o':
+            if (E.win.nviews > 1)
+            {
+                EditorFocus((E.win.current + 1) % E.win.nviews);
+            }
+            break;
+        case '0':
+            EditorCloseWindow(0);
+            break;
+        case '1':
+            EditorCloseWindow(1);
+            break;
+        case 'b':
+            if (E.win.nbuffers > 1)
+            {
+                EditorShowBuffer((E.win.views[E.win.current].buffer + 1) % E.win.nbuffers);
+            }
+            break;
+        case 'f':
+            EditorOpenBuffer();
+            break;
+        case 'g':
+        case 'G':
+            EditorGrep(c == 'G');
+            break;
+        case '(':
+        case ')':
+            EditorMacroRecord(c == '(');
+            break;
+        case 'e':
+            EditorMacroReplay(1);
+            break;
+        case 'E':
+            EditorMacroRepeat();
+            break;
+        case 's':
+            EditorSortLines();
+            break;
+        case 'u':
+            EditorUniqueLines();
+            break;
+        case 'k':
+        case 'v':
+            EditorFilterLines(c == 'v');
+            break;
+        case 'd':
+            ServerDetach();
+            break;
+    }
+}
+
+void EditorRefreshScreen()
+{
+    if (E.macro.replaying)
+    {
+        return;
+    }
+    long long t = TraceBegin();
+    EditorScroll();
+
+    struct ABuf aBuf = ABUF_INIT;
+
+    /* synchronized update: the terminal shows the frame only once complete */
+    AbAppend(&aBuf, "\x1b[?2026h", 8);
+    AbAppend(&aBuf, "\x1b[?25l", 6);
+
+    long long tdraw = TraceBegin();
+    int origin = 0;
+    if (E.win.nviews == 0)
+    {
+        EditorDrawChanged(&aBuf, 0);
+        EditorDrawStatusBar(&aBuf);
+    }
+    else
+    {
+        int focus = E.win.current;
+        for (int v = 0; v < E.win.nviews; ++v)
+        {
+            EditorFocus(v);
+            EditorScroll();
+            EditorDrawChanged(&aBuf, E.win.views[v].top);
+            EditorDrawStatusBar(&aBuf);
+        }
+        EditorFocus(focus);
+        origin = E.win.views[focus].top;
+    }
+    TraceEnd("EditorDrawRows", tdraw);
+    EditorDrawMessageBar(&aBuf);
+
+    char buf[48];
+    if (EditorVisualLines())
+    {
+        int col;
+        long long line = EditorWrapCursor(&col);
+        int x = E.wrap.enabled ? (col < E.screencols ? col : E.screencols - 1) : col - E.coloff;
+        snprintf(buf, sizeof(buf), "\x1b[%lld;%dH", origin + line - EditorScreenTop() + 1, x + 1);
+    }
+    else
+    {
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", origin + E.cy - E.rowoff + 1, E.rx - E.coloff + 1);
+    }
+    AbAppend(&aBuf, buf, strlen(buf));
+
+    AbAppend(&aBuf, "\x1b[?25h", 6);
+    AbAppend(&aBuf, "\x1b[?2026l", 8);
+    long long twrite = TraceBegin();
+    EditorWrite(aBuf.b, aBuf.len);
+    TraceEnd("write", twrite);
+    AbFree(&aBuf);
+    TraceEnd("EditorRefreshScreen", t);
+}
+
+int GetCursorPosition(int* rows, int* cols)
+{
+    char buf[32];
+    unsigned int i = 0;
+
+    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4)
+    {
+        return -1;
+    }
+
+    while (i < sizeof(buf) - 1)
+    {
+        if (read(E.ifd, &buf[i], 1) != 1)
+        {
+            break;
+        }
+
+        if (buf[i] == 'R')
+        {
+           break; 
+        }
+
+        ++i;
+    }
+    buf[i] = '\0';
+
+    if (buf[0] != '\x1b' || buf[1] != '[')
+    {
+        return -1;
+    }
+    
+    if (sscanf(&buf[2], "%d;%d", rows, cols) != 2)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+int GetWindowSize(int* rows, int* cols)
+{
+    struct winsize ws;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+    {
+        if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
+        {
+            return -1;
+        }
+        return GetCursorPosition(rows, cols);
+    }
+    else
+    {
+        *cols = ws.ws_col;
+        *rows = ws.ws_row;
+        return 0;
+    }
+}
+
+/* Returns the first '\n' in [p, end), or end. */
+const char* ScanNewline(const char* p, const char* end)
+{
+#ifdef __SSE2__
+    __m128i newline = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16)
+    {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), newline));
+        if (mask)
+        {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+    const char* nl = (const char*)memchr(p, '\n', end - p);
+    return nl ? nl : end;
+}
+
+long long CountNewlines(const char* p, const char* end)
+{
+    long long n = 0;
+#ifdef __SSE2__
+    __m128i newline = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16)
+    {
+        n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), newline)));
+    }
+#endif
+    for (; p < end; ++p)
+    {
+        n += (*p == '\n');
+    }
+    return n;
+}
+
+/* A slice of the mapped file, always ending just after a '\n' (or at EOF),
+ * and the rows it becomes. Each loader thread owns one. */
+struct LoadChunk
+{
+    const char* begin;
+    const char* end;
+    int first;
+    int rows;
+    int in_comment;
+    long long bytes;
+    unsigned char* hl;
+    char* render;
+    int cap;
+};
+
+/* Highlights a freshly loaded row. Under a cache budget only hl_open_comment
+ * is kept and the row is left for EditorRowEnsure to build when drawn. */
+void EditorLoadHighlight(ERow* row, struct LoadChunk* c, int in_comment)
+{
+    int need = row->size + CountTabs(row->chars, row->size) * (KILO_TAB_STOP - 1) + 1;
+    if (need > c->cap)
+    {
+        c->cap = need * 2;
+        c->hl = (unsigned char*)realloc(c->hl, c->cap);
+        c->render = (char*)realloc(c->render, c->cap);
+    }
+
+    char* render;
+    if (E.cache.budget)
+    {
+        row->rsize = RenderTabs(row->chars, row->size, c->render);
+        render = c->render;
+    }
+    else
+    {
+        c->bytes -= EditorRowCacheBytes(row);
+        EditorRowStoreRender(row);
+        render = EditorRowRender(row);
+    }
+
+    if (E.syntax)
+    {
+        row->hl_open_comment = EditorHighlightLine(render, row->rsize, in_comment, c->hl);
+    }
+    else
+    {
+        memset(c->hl, HL_NORMAL, row->rsize);
+    }
+
+    EditorRowBrackets(row, render, c->hl);
+
+    if (!E.cache.budget)
+    {
+        EditorRowStoreHighlight(row, c->hl);
+        c->bytes += EditorRowCacheBytes(row);
+    }
+}
+
+void* EditorLoadCount(void* arg)
+{
+    struct LoadChunk* c = (struct LoadChunk*)arg;
+    c->rows = CountNewlines(c->begin, c->end);
+    if (c->end > c->begin && c->end[-1] != '\n')
+    {
+        c->rows += 1;
+    }
+    return NULL;
+}
+
+/* Splits the chunk into rows, highlighting them on the guess that the chunk
+ * does not start inside a block comment. EditorLoadMapped fixes up chunks
+ * where the guess was wrong. */
+void* EditorLoadRows(void* arg)
+{
+    struct LoadChunk* c = (struct LoadChunk*)arg;
+    int in_comment = c->in_comment;
+    ERow* row = &E.row[c->first];
+
+    for (const char* p = c->begin; p < c->end; ++row)
+    {
+        const char* nl = ScanNewline(p, c->end);
+        int len = nl - p;
+        row->eol = LineEnding(p, &len);
+        row->size = len;
+        row->chars = (char*)malloc(len + 1);
+        memcpy(row->chars, p, len);
+        row->chars[len] = '\0';
+        row->render = NULL;
+        row->hl = NULL;
+        row->hlruns = 0;
+        row->hl_open_comment = 0;
+        row->cache = 0;
+
+        EditorLoadHighlight(row, c, in_comment);
+        in_comment = row->hl_open_comment;
+        p = nl + 1;
+    }
+    return NULL;
+}
+
+/* Runs work over n jobs of the given size, one per thread, with the first
+ * on the calling thread and any a thread could not be started for. */
+void EditorParallel(void* jobs, size_t size, int n, void* (*work)(void*))
+{
+    pthread_t threads[KILO_LOAD_THREADS];
+    char* job = (char*)jobs;
+    int started = 1;
+    for (; started < n; ++started)
+    {
+        if (pthread_create(&threads[started], NULL, work, job + started * size) != 0)
+        {
+            break;
+        }
+    }
+    for (int i = started; i < n; ++i)
+    {
+        work(job + i * size);
+    }
+    work(job);
+    for (int i = 1; i < started; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/* Loads a regular file through mmap. Chunks are counted and split into rows
+ * on separate threads, E.row is sized once between the two passes, and
+ * block-comment state is then carried across chunk boundaries in order. */
+void EditorLoadMapped(int fd, off_t size)
+{
+    if (size == 0)
+    {
+        return;
+    }
+
+    char* map = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        Die("mmap");
+    }
+    madvise(map, size, MADV_WILLNEED);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = size / KILO_LOAD_CHUNK + 1;
+    if (n > cpus)
+    {
+        n = cpus > 0 ? cpus : 1;
+    }
+    if (n > KILO_LOAD_THREADS)
+    {
+        n = KILO_LOAD_THREADS;
+    }
+
+    struct LoadChunk chunks[KILO_LOAD_THREADS];
+    memset(chunks, 0, sizeof(chunks));
+    const char* end = map + size;
+    const char* p = map;
+    for (int i = 0; i < n; ++i)
+    {
+        chunks[i].begin = p;
+        if (i + 1 < n && p < end)
+        {
+            const char* split = p + (end - p) / (n - i);
+            p = ScanNewline(split, end);
+            p = (p < end) ? p + 1 : end;
+        }
+        else
+        {
+            p = end;
+        }
+        chunks[i].end = p;
+    }
+
+    EditorParallel(chunks, sizeof(struct LoadChunk), n, EditorLoadCount);
+
+    long long rows = E.numrows;
+    for (int i = 0; i < n; ++i)
+    {
+        chunks[i].first = rows;
+        rows += chunks[i].rows;
+    }
+    if (rows > 0x7fffffff)
+    {
+        Die("too many lines");
+    }
+
+    E.row = (ERow*)realloc(E.row, sizeof(ERow) * rows);
+    if (E.row == NULL)
+    {
+        Die("realloc");
+    }
+    E.rowcap = rows;
+    chunks[0].in_comment = (E.numrows > 0 && E.row[E.numrows - 1].hl_open_comment);
+
+    EditorParallel(chunks, sizeof(struct LoadChunk), n, EditorLoadRows);
+    E.numrows = rows;
+
+    for (int i = 0; i < n; ++i)
+    {
+        if (i > 0 && chunks[i].rows > 0 && E.row[chunks[i].first - 1].hl_open_comment)
+        {
+            for (int j = chunks[i].first; j < chunks[i].first + chunks[i].rows; ++j)
+            {
+                int before = E.row[j].hl_open_comment;
+                EditorLoadHighlight(&E.row[j], &chunks[0], E.row[j - 1].hl_open_comment);
+                if (E.row[j].hl_open_comment == before)
+                {
+                    break;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < n; ++i)
+    {
+        E.cache.bytes += chunks[i].bytes;
+        free(chunks[i].hl);
+        free(chunks[i].render);
+    }
+    munmap(map, size);
+}
+
+int CursorCompare(const void* a, const void* b)
+{
+    const struct Cursor* x = (const struct Cursor*)a;
+    const struct Cursor* y = (const struct Cursor*)b;
+    return (x->row != y->row) ? (x->row > y->row) - (x->row < y->row) : (x->col > y->col) - (x->col < y->col);
+}
+
+int EditorCursorsActive()
+{
+    return E.cursors.count > 0 || E.cursors.block;
+}
+
+void EditorCursorsClear()
+{
+    E.cursors.count = 0;
+    E.cursors.block = 0;
+}
+
+/* Sorts the extra cursors, dropping any on the same spot as another or as
+ * the primary. */
+void EditorCursorsNormalize()
+{
+    struct Cursors* cs = &E.cursors;
+    if (cs->count == 0)
+    {
+        return;
+    }
+    qsort(cs->at, cs->count, sizeof(struct Cursor), CursorCompare);
+    int kept = 0;
+    for (int i = 0; i < cs->count; ++i)
+    {
+        struct Cursor c = cs->at[i];
+        if ((c.row == E.cy && c.col == E.cx) ||
+            (kept > 0 && cs->at[kept - 1].row == c.row && cs->at[kept - 1].col == c.col))
+        {
+            continue;
+        }
+        cs->at[kept++] = c;
+    }
+    cs->count = kept;
+}
+
+/* Leaves a cursor where the primary is and moves the primary a line down. */
+void EditorAddCursor()
+{
+    struct Cursors* cs = &E.cursors;
+    if (E.cy + 1 >= E.numrows)
+    {
+        EditorSetStatusMessage("No line below for another cursor");
+        return;
+    }
+    if (cs->block)
+    {
+        EditorCursorsClear();
+    }
+    if (cs->count == cs->cap)
+    {
+        cs->cap = cs->cap ? cs->cap * 2 : 16;
+        cs->at = (struct Cursor*)realloc(cs->at, sizeof(struct Cursor) * cs->cap);
+    }
+    cs->at[cs->count].row = E.cy;
+    cs->at[cs->count].col = E.cx;
+    cs->at[cs->count].len = 0;
+    cs->count += 1;
+
+    EditorMoveKey(ARROW_DOWN);
+    EditorCursorsNormalize();
+    EditorSetStatusMessage("%d cursors, ESC to leave", cs->count + 1);
+}
+
+/* Starts a column block at the cursor, or leaves block mode. */
+void EditorToggleBlock()
+{
+    struct Cursors* cs = &E.cursors;
+    if (cs->block || E.numrows == 0)
+    {
+        EditorCursorsClear();
+        EditorSetStatusMessage("Block off");
+        return;
+    }
+    cs->count = 0;
+    cs->block = 1;
+    cs->by = E.cy < E.numrows ? E.cy : E.numrows - 1;
+    cs->bx = (E.cy < E.numrows) ? EditorRowCxToRx(EditorRowAt(E.cy), E.cx) : 0;
+    EditorSetStatusMessage("Block: move to size it, type to edit every line, ESC to leave");
+}
+
+/* The block's rows and its render columns x0 to x1, x1 excluded. */
+void EditorBlockBounds(int* top, int* bottom, int* x0, int* x1)
+{
+    struct Cursors* cs = &E.cursors;
+    int cy = E.cy < E.numrows ? E.cy : E.numrows - 1;
+    int rx = (E.cy < E.numrows) ? EditorRowCxToRx(EditorRowAt(E.cy), E.cx) : 0;
+    *top = cs->by < cy ? cs->by : cy;
+    *bottom = cs->by < cy ? cy : cs->by;
+    *x0 = cs->bx < rx ? cs->bx : rx;
+    *x1 = cs->bx < rx ? rx : cs->bx;
+}
+
+/* Moves the extra cursors along with the primary for a cursor key. They
+ * stay on their rows for left and right. */
+void EditorCursorsMove(int key)
+{
+    struct Cursors* cs = &E.cursors;
+    for (int i = 0; i < cs->count; ++i)
+    {
+        struct Cursor* c = &cs->at[i];
+        if (key == ARROW_UP && c->row > 0)
+        {
+            c->row -= 1;
+        }
+        else if (key == ARROW_DOWN && c->row + 1 < E.numrows)
+        {
+            c->row += 1;
+        }
+
+        int size = EditorRowAt(c->row)->size;
+        if (key == ARROW_LEFT && c->col > 0)
+        {
+            c->col -= 1;
+        }
+        else if (key == ARROW_RIGHT)
+        {
+            c->col += 1;
+        }
+        else if (key == HOME_KEY)
+        {
+            c->col = 0;
+        }
+        else if (key == END_KEY)
+        {
+            c->col = size;
+        }
+        if (c->col > size)
+        {
+            c->col = size;
+        }
+    }
+    EditorCursorsNormalize();
+}
+
+/* Render columns of row `at` drawn reversed, as start, end pairs: the
+ * block's columns, or a cell for each extra cursor. Returns the pairs. */
+int EditorCursorMarks(int at, int* marks, int max)
+{
+    struct Cursors* cs = &E.cursors;
+    ERow* row = &E.row[at];
+    if (cs->block)
+    {
+        int top, bottom, x0, x1;
+        EditorBlockBounds(&top, &bottom, &x0, &x1);
+        if (at < top || at > bottom)
+        {
+            return 0;
+        }
+        marks[0] = x0;
+        marks[1] = x1 > x0 ? x1 : x0 + 1;
+        return 1;
+    }
+
+    int lo = 0;
+    int hi = cs->count;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (cs->at[mid].row < at)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    int n = 0;
+    for (; lo < cs->count && cs->at[lo].row == at && n < max; ++lo, ++n)
+    {
+        int col = cs->at[lo].col < row->size ? cs->at[lo].col : row->size;
+        marks[n * 2] = EditorRowCxToRx(row, col);
+        marks[n * 2 + 1] = marks[n * 2] + 1;
+    }
+    return n;
+}
+
+/* Changed rows of a batch edit for one thread to render and highlight. in
+ * holds the comment state each row starts in, as known before the batch. */
+struct BatchChunk
+{
+    struct LoadChunk load;
+    const int* rows;
+    unsigned char* in;
+    int n;
+};
+
+void* EditorBatchRows(void* arg)
+{
+    struct BatchChunk* b = (struct BatchChunk*)arg;
+    for (int i = 0; i < b->n; ++i)
+    {
+        int r = b->rows[i];
+        if (i > 0 && b->rows[i - 1] == r - 1)
+        {
+            b->in[i] = E.row[r - 1].hl_open_comment;
+        }
+        EditorLoadHighlight(&E.row[r], &b->load, b->in[i]);
+    }
+    return NULL;
+}
+
+/* Renders and highlights the n rows (ascending) a batch edit changed, once
+ * each and split across threads when there are many. Rows are highlighted
+ * from the comment state above them before the batch; the few whose state
+ * changed are redone afterwards in order, carrying the change down. */
+void EditorBatchUpdate(const int* rows, int n)
+{
+    unsigned char* in = (unsigned char*)malloc(n * 2);
+    unsigned char* old = in + n;
+    for (int i = 0; i < n; ++i)
+    {
+        ERow* row = &E.row[rows[i]];
+        in[i] = rows[i] > 0 ? E.row[rows[i] - 1].hl_open_comment : 0;
+        old[i] = row->hl_open_comment;
+        if (E.cache.budget)
+        {
+            EditorRowEvict(row);
+        }
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nchunks = n / KILO_BATCH_PARALLEL + 1;
+    if (nchunks > cpus)
+    {
+        nchunks = cpus > 0 ? cpus : 1;
+    }
+    if (nchunks > KILO_LOAD_THREADS)
+    {
+        nchunks = KILO_LOAD_THREADS;
+    }
+    struct BatchChunk chunks[KILO_LOAD_THREADS];
+    memset(chunks, 0, sizeof(chunks));
+    for (int c = 0, first = 0; c < nchunks; ++c)
+    {
+        int last = (long long)n * (c + 1) / nchunks;
+        chunks[c].rows = rows + first;
+        chunks[c].in = in + first;
+        chunks[c].n = last - first;
+        first = last;
+    }
+    EditorParallel(chunks, sizeof(struct BatchChunk), nchunks, EditorBatchRows);
+    for (int c = 0; c < nchunks; ++c)
+    {
+        E.cache.bytes += chunks[c].load.bytes;
+        free(chunks[c].load.hl);
+        free(chunks[c].load.render);
+    }
+    for (int i = 0; i < n; ++i)
+    {
+        EditorBracketsUpdate(rows[i]);
+    }
+
+    ERow* end = &E.row[E.numrows];
+    for (int i = 0; i < n; ++i)
+    {
+        ERow* row = &E.row[rows[i]];
+        if (rows[i] > 0 && E.row[rows[i] - 1].hl_open_comment != in[i])
+        {
+            if (!(row->cache & ROW_CACHED))
+            {
+                EditorRowBuildRender(row);
+            }
+            EditorUpdateSyntax(row);
+        }
+        EditorWrapUpdate(row);
+
+        if (row->hl_open_comment == old[i])
+        {
+            continue;
+        }
+        for (ERow* next = row + 1; next < end && !(i + 1 < n && next == &E.row[rows[i + 1]]); ++next)
+        {
+            if (!(next->cache & ROW_CACHED))
+            {
+                EditorRowBuildRender(next);
+            }
+            if (!EditorUpdateSyntax(next))
+            {
+                break;
+            }
+        }
+    }
+    free(in);
+    EditorCacheTrim();
+}
+
+/* Where a batch edit applies: one site per extra cursor and the primary, or
+ * per row of the block long enough to reach it. Sorted by row and column. */
+struct Cursor* EditorBatchSites(int* count, int* primary)
+{
+    struct Cursors* cs = &E.cursors;
+    struct Cursor* sites;
+    int n = 0;
+    *primary = -1;
+    if (cs->block)
+    {
+        int top, bottom, x0, x1;
+        EditorBlockBounds(&top, &bottom, &x0, &x1);
+        sites = (struct Cursor*)malloc(sizeof(struct Cursor) * (bottom - top + 1));
+        for (int r = top; r <= bottom; ++r)
+        {
+            ERow* row = EditorRowAt(r);
+            if (EditorRowCxToRx(row, row->size) < x0)
+            {
+                continue;
+            }
+            int col = EditorRowRxToCx(row, x0);
+            sites[n].row = r;
+            sites[n].col = col;
+            sites[n].len = EditorRowRxToCx(row, x1) - col;
+            if (r == E.cy)
+            {
+                *primary = n;
+            }
+            n += 1;
+        }
+    }
+    else
+    {
+        sites = (struct Cursor*)malloc(sizeof(struct Cursor) * (cs->count + 1));
+        memcpy(sites, cs->at, sizeof(struct Cursor) * cs->count);
+        n = cs->count;
+        if (E.cy < E.numrows)
+        {
+            sites[n].row = E.cy;
+            sites[n].col = E.cx;
+            sites[n].len = 0;
+            n += 1;
+        }
+        qsort(sites, n, sizeof(struct Cursor), CursorCompare);
+        for (int i = 0; i < n; ++i)
+        {
+            if (sites[i].row == E.cy && sites[i].col == E.cx)
+            {
+                *primary = i;
+            }
+        }
+    }
+    *count = n;
+    return sites;
+}
+
+/* Applies a typed char, BACKSPACE or DEL_KEY at every cursor, or on every
+ * row of the block, as one batch. Each row's chars change in one go, with
+ * its undo records, and the changed rows are then rendered and highlighted
+ * once each by EditorBatchUpdate. Deletions stay within rows. */
+void EditorBatchEdit(int key)
+{
+    struct Cursors* cs = &E.cursors;
+    int n;
+    int primary;
+    struct Cursor* sites = EditorBatchSites(&n, &primary);
+    int ins = (key != BACKSPACE && key != DEL_KEY);
+    char ch = key;
+
+    int* rows = (int*)malloc(sizeof(int) * (n + 1));
+    int nrows = 0;
+    for (int i = 0; i < n;)
+    {
+        int r = sites[i].row;
+        ERow* row = &E.row[r];
+        int j = i;
+        while (j < n && sites[j].row == r)
+        {
+            ++j;
+        }
+        EditorWordsRow(row, -1);
+        EditorRowOwn(row);
+        row->chars = (char*)realloc(row->chars, row->size + (j - i) + 1);
+
+        int shift = 0;
+        int changed = 0;
+        for (int k = i; k < j; ++k)
+        {
+            int start = sites[k].col + shift;
+            int del = sites[k].len;
+            if (del == 0 && key == BACKSPACE && start > 0)
+            {
+                start -= 1;
+                del = 1;
+            }
+            else if (del == 0 && key == DEL_KEY && start < row->size)
+            {
+                del = 1;
+            }
+            if (del > 0)
+            {
+                EditorUndoChars(UNDO_DELETE, r, start, &row->chars[start], del);
+                memmove(&row->chars[start], &row->chars[start + del], row->size - start - del + 1);
+                row->size -= del;
+            }
+            if (ins)
+            {
+                EditorUndoChars(UNDO_INSERT, r, start, &ch, 1);
+                memmove(&row->chars[start + 1], &row->chars[start], row->size - start + 1);
+                row->chars[start] = ch;
+                row->size += 1;
+            }
+            sites[k].col = start + ins;
+            shift += ins - del;
+            changed |= (ins || del);
+        }
+        EditorWordsRow(row, 1);
+        if (changed)
+        {
+            FenwickAdd(&E.offsets, r, shift);
+            rows[nrows++] = r;
+        }
+        i = j;
+    }
+
+    if (nrows > 0)
+    {
+        EditorBatchUpdate(rows, nrows);
+        E.dirty = 1;
+    }
+
+    if (primary != -1)
+    {
+        E.cx = sites[primary].col;
+    }
+    if (cs->block)
+    {
+        /* the block narrows to a column at the edit, ready for more typing */
+        int top, bottom, x0, x1;
+        EditorBlockBounds(&top, &bottom, &x0, &x1);
+        int x = (key == BACKSPACE && x1 == x0 && x0 > 0) ? x0 - 1 : x0 + ins;
+        cs->bx = x;
+        if (E.cy < E.numrows)
+        {
+            E.cx = EditorRowRxToCx(EditorRowAt(E.cy), x);
+        }
+    }
+    else
+    {
+        cs->count = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            if (i != primary)
+            {
+                sites[i].len = 0;
+                cs->at[cs->count++] = sites[i];
+            }
+        }
+        EditorCursorsNormalize();
+    }
+    free(sites);
+    free(rows);
+}
+
+/* is_separator as a table, filled by the first EditorWordsBuild. */
+unsigned char word_separator[256];
+
+int WordsNode(struct Words* w, int parent, unsigned char c)
+{
+    if (w->n == w->cap)
+    {
+        w->cap = w->cap ? w->cap * 2 : 1024;
+        w->nodes = (struct WordNode*)realloc(w->nodes, sizeof(struct WordNode) * w->cap);
+    }
+    struct WordNode* node = &w->nodes[w->n];
+    node->parent = parent;
+    node->child = -1;
+    node->next = -1;
+    node->count = 0;
+    node->best = 0;
+    node->c = c;
+    return w->n++;
+}
+
+/* The child of node for byte c, added in byte order if create is set, or -1. */
+int WordsChild(struct Words* w, int node, unsigned char c, int create)
+{
+    int prev = -1;
+    int at = w->nodes[node].child;
+    while (at != -1 && w->nodes[at].c < c)
+    {
+        prev = at;
+        at = w->nodes[at].next;
+    }
+    if (at != -1 && w->nodes[at].c == c)
+    {
+        return at;
+    }
+    if (!create)
+    {
+        return -1;
+    }
+    int child = WordsNode(w, node, c);
+    w->nodes[child].next = at;
+    if (prev == -1)
+    {
+        w->nodes[node].child = child;
+    }
+    else
+    {
+        w->nodes[prev].next = child;
+    }
+    return child;
+}
+
+/* Recomputes best from node up while it changes. */
+void WordsBest(struct Words* w, int node)
+{
+    for (; node != -1; node = w->nodes[node].parent)
+    {
+        int best = w->nodes[node].count;
+        for (int c = w->nodes[node].child; c != -1; c = w->nodes[c].next)
+        {
+            if (w->nodes[c].best > best)
+            {
+                best = w->nodes[c].best;
+            }
+        }
+        if (best == w->nodes[node].best)
+        {
+            return;
+        }
+        w->nodes[node].best = best;
+    }
+}
+
+void WordsAdd(struct Words* w, const char* s, int len, int delta)
+{
+    int node = 0;
+    for (int i = 0; i < len && node != -1; ++i)
+    {
+        node = WordsChild(w, node, s[i], delta > 0);
+    }
+    if (node == -1 || w->nodes[node].count + delta < 0)
+    {
+        return;
+    }
+    w->nodes[node].count += delta;
+    if (delta < 0)
+    {
+        WordsBest(w, node);
+        return;
+    }
+    for (int count = w->nodes[node].count; node != -1 && w->nodes[node].best < count; node = w->nodes[node].parent)
+    {
+        w->nodes[node].best = count;
+    }
+}
+
+/* Adds (delta 1) or takes out (delta -1) the words of s. */
+void WordsScan(struct Words* w, const char* s, int len, int delta)
+{
+    const unsigned char* sep = word_separator;
+    for (int i = 0; i < len;)
+    {
+        while (i < len && sep[(unsigned char)s[i]])
+        {
+            ++i;
+        }
+        int start = i;
+        while (i < len && !sep[(unsigned char)s[i]])
+        {
+            ++i;
+        }
+        if (i > start && i - start <= KILO_WORD_MAX)
+        {
+            WordsAdd(w, &s[start], i - start, delta);
+        }
+    }
+}
+
+/* Adds the subtree of src at s into dst at d. Both are at most KILO_WORD_MAX
+ * deep, so the recursion is bounded. */
+void WordsMerge(struct Words* dst, int d, const struct Words* src, int s)
+{
+    dst->nodes[d].count += src->nodes[s].count;
+    for (int c = src->nodes[s].child; c != -1; c = src->nodes[c].next)
+    {
+        if (src->nodes[c].best > 0)
+        {
+            WordsMerge(dst, WordsChild(dst, d, src->nodes[c].c, 1), src, c);
+        }
+    }
+    int best = dst->nodes[d].count;
+    for (int c = dst->nodes[d].child; c != -1; c = dst->nodes[c].next)
+    {
+        if (dst->nodes[c].best > best)
+        {
+            best = dst->nodes[c].best;
+        }
+    }
+    dst->nodes[d].best = best;
+}
+
+struct WordsChunk
+{
+    struct Words words;
+    int first;
+    int last;
+};
+
+void* EditorWordsRows(void* arg)
+{
+    struct WordsChunk* c = (struct WordsChunk*)arg;
+    WordsNode(&c->words, -1, 0);
+    for (int i = c->first; i < c->last; ++i)
+    {
+        WordsScan(&c->words, E.row[i].chars, E.row[i].size, 1);
+    }
+    return NULL;
+}
+
+/* Indexes every row, in a trie per thread over a range of rows, and merges
+ * the tries into the first. */
+void WordsSeparators()
+{
+    for (int c = 0; c < 256; ++c)
+    {
+        word_separator[c] = is_separator(c);
+    }
+}
+
+void EditorWordsBuild()
+{
+    WordsSeparators();
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nchunks = E.numrows / KILO_WORD_PARALLEL + 1;
+    if (nchunks > cpus)
+    {
+        nchunks = cpus > 0 ? cpus : 1;
+    }
+    if (nchunks > KILO_LOAD_THREADS)
+    {
+        nchunks = KILO_LOAD_THREADS;
+    }
+    struct WordsChunk chunks[KILO_LOAD_THREADS];
+    memset(chunks, 0, sizeof(chunks));
+    for (int c = 0, first = 0; c < nchunks; ++c)
+    {
+        chunks[c].first = first;
+        chunks[c].last = (long long)E.numrows * (c + 1) / nchunks;
+        first = chunks[c].last;
+    }
+    EditorParallel(chunks, sizeof(struct WordsChunk), nchunks, EditorWordsRows);
+    for (int c = 1; c < nchunks; ++c)
+    {
+        WordsMerge(&chunks[0].words, 0, &chunks[c].words, 0);
+        free(chunks[c].words.nodes);
+    }
+
+    free(E.words.nodes);
+    E.words = chunks[0].words;
+    E.words.valid = 1;
+}
+
+struct WordsEdit
+{
+    int len;
+    int delta;
+};
+
+struct WordsRange
+{
+    struct Words words;
+    struct WordsJob* job;
+    off_t begin;
+    off_t end;
+};
+
+int WordsCancelled(struct WordsJob* job)
+{
+    pthread_mutex_lock(&job->lock);
+    int cancel = job->cancel;
+    pthread_mutex_unlock(&job->lock);
+    return cancel;
+}
+
+/* Moves off forward to the start of a word, so that none straddles two
+ * ranges. */
+off_t WordsAlign(int fd, off_t off, off_t size)
+{
+    char buf[256];
+    while (off > 0 && off < size)
+    {
+        ssize_t n = pread(fd, buf, sizeof(buf), off - 1);
+        if (n <= 0)
+        {
+            return size;
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            if (word_separator[(unsigned char)buf[i]])
+            {
+                return off + i;
+            }
+        }
+        off += n;
+    }
+    return off < size ? off : size;
+}
+
+/* Scans a range of the file in KILO_WORD_WINDOW reads. A window ends before
+ * the word it cuts, which the next one starts with; a window that is all one
+ * word is too long to index and is skipped with the rest of that word. */
+void* EditorWordsRange(void* arg)
+{
+    struct WordsRange* r = (struct WordsRange*)arg;
+    const unsigned char* sep = word_separator;
+    WordsNode(&r->words, -1, 0);
+    char* buf = (char*)malloc(KILO_WORD_WINDOW);
+    int skip = 0;
+    for (off_t at = r->begin; at < r->end && !WordsCancelled(r->job);)
+    {
+        off_t want = r->end - at < KILO_WORD_WINDOW ? r->end - at : KILO_WORD_WINDOW;
+        ssize_t n = pread(r->job->fd, buf, want, at);
+        if (n <= 0)
+        {
+            /* the file shrank, which the stat afterwards notices */
+            break;
+        }
+        int start = 0;
+        while (skip && start < n && !sep[(unsigned char)buf[start]])
+        {
+            ++start;
+        }
+        int len = n;
+        while (at + n < r->end && len > start && !sep[(unsigned char)buf[len - 1]])
+        {
+            --len;
+        }
+        if (len == start)
+        {
+            skip = 1;
+            at += n;
+            continue;
+        }
+        WordsScan(&r->words, buf + start, len - start, 1);
+        skip = 0;
+        at += len;
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Indexes the file in ranges, one per thread as EditorWordsBuild does over
+ * rows, and fails if the file is not the one that was loaded. */
+void* EditorWordsJobRun(void* arg)
+{
+    struct WordsJob* job = (struct WordsJob*)arg;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = job->size / KILO_WORD_WINDOW + 1;
+    if (n > cpus)
+    {
+        n = cpus > 0 ? cpus : 1;
+    }
+    if (n > KILO_LOAD_THREADS)
+    {
+        n = KILO_LOAD_THREADS;
+    }
+    struct WordsRange ranges[KILO_LOAD_THREADS];
+    memset(ranges, 0, sizeof(ranges));
+    for (int i = 0; i < n; ++i)
+    {
+        ranges[i].job = job;
+        ranges[i].begin = i > 0 ? ranges[i - 1].end : 0;
+        off_t split = job->size * (i + 1) / n;
+        ranges[i].end = i + 1 < n ? WordsAlign(job->fd, split > ranges[i].begin ? split : ranges[i].begin, job->size) : job->size;
+    }
+    EditorParallel(ranges, sizeof(struct WordsRange), n, EditorWordsRange);
+    for (int i = 1; i < n; ++i)
+    {
+        WordsMerge(&ranges[0].words, 0, &ranges[i].words, 0);
+        free(ranges[i].words.nodes);
+    }
+
+    struct stat st;
+    int same = fstat(job->fd, &st) == 0 && st.st_size == job->st.st_size &&
+               st.st_mtim.tv_sec == job->st.st_mtim.tv_sec && st.st_mtim.tv_nsec == job->st.st_mtim.tv_nsec;
+    pthread_mutex_lock(&job->lock);
+    job->words = ranges[0].words;
+    job->failed = !same || job->cancel;
+    job->done = 1;
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+/* Starts indexing the words of a file just loaded from fd, if it is big
+ * enough for the build to be noticed on the first completion. */
+void EditorWordsStart(int fd, const struct stat* st)
+{
+    if (st->st_size < KILO_WORD_BACKGROUND || E.words.valid || E.words.job)
+    {
+        return;
+    }
+    WordsSeparators();
+    struct WordsJob* job = (struct WordsJob*)calloc(1, sizeof(struct WordsJob));
+    job->fd = dup(fd);
+    job->size = st->st_size;
+    job->st = *st;
+    pthread_mutex_init(&job->lock, NULL);
+    if (job->fd == -1 || pthread_create(&job->thread, NULL, EditorWordsJobRun, job) != 0)
+    {
+        if (job->fd != -1)
+        {
+            close(job->fd);
+        }
+        pthread_mutex_destroy(&job->lock);
+        free(job);
+        return;
+    }
+    E.words.job = job;
+}
+
+/* Waits for the background build and takes its index, replaying the row
+ * edits logged meanwhile. A failed or cancelled build is dropped. */
+void EditorWordsTake()
+{
+    struct WordsJob* job = E.words.job;
+    pthread_join(job->thread, NULL);
+    E.words.job = NULL;
+    if (!job->failed && !job->cancel)
+    {
+        free(E.words.nodes);
+        E.words = job->words;
+        E.words.valid = 1;
+        for (long long off = 0; off < job->loglen;)
+        {
+            struct WordsEdit e;
+            memcpy(&e, job->log + off, sizeof(e));
+            off += sizeof(e);
+            WordsScan(&E.words, job->log + off, e.len, e.delta);
+            off += e.len;
+        }
+    }
+    else
+    {
+        free(job->words.nodes);
+    }
+    free(job->log);
+    close(job->fd);
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+}
+
+void EditorWordsCancel()
+{
+    if (E.words.job)
+    {
+        pthread_mutex_lock(&E.words.job->lock);
+        E.words.job->cancel = 1;
+        pthread_mutex_unlock(&E.words.job->lock);
+        EditorWordsTake();
+    }
+}
+
+/* Logs a row's words going out or in while the background build runs.
+ * Returns 0 when the build should be taken now instead: it is done, or the
+ * log is full and it has been cancelled. */
+int EditorWordsLog(const char* s, int len, int delta)
+{
+    struct WordsJob* job = E.words.job;
+    struct WordsEdit e = {len, delta};
+    pthread_mutex_lock(&job->lock);
+    int take = job->done;
+    if (!take && job->loglen + (long long)sizeof(e) + len > KILO_WORD_LOG)
+    {
+        job->cancel = 1;
+        take = 1;
+    }
+    pthread_mutex_unlock(&job->lock);
+    if (take)
+    {
+        return 0;
+    }
+
+    if (job->loglen + (long long)sizeof(e) + len > job->logcap)
+    {
+        job->logcap = job->logcap * 2 + sizeof(e) + len;
+        job->log = (char*)realloc(job->log, job->logcap);
+    }
+    memcpy(job->log + job->loglen, &e, sizeof(e));
+    memcpy(job->log + job->loglen + sizeof(e), s, len);
+    job->loglen += sizeof(e) + len;
+    return 1;
+}
+
+void EditorWordsRow(ERow* row, int delta)
+{
+    if (E.words.job && !EditorWordsLog(row->chars, row->size, delta))
+    {
+        EditorWordsTake();
+    }
+    if (E.words.valid)
+    {
+        WordsScan(&E.words, row->chars, row->size, delta);
+    }
+}
+
+struct WordsPending
+{
+    int node;
+    int key;
+    int word;
+};
+
+/* Pushes onto the max-heap on key. */
+void WordsPush(struct WordsPending** heap, int* n, int* cap, int node, int key, int word)
+{
+    if (*n == *cap)
+    {
+        *cap = *cap ? *cap * 2 : 64;
+        *heap = (struct WordsPending*)realloc(*heap, sizeof(struct WordsPending) * *cap);
+    }
+    struct WordsPending* h = *heap;
+    int i = (*n)++;
+    for (; i > 0 && h[(i - 1) / 2].key < key; i = (i - 1) / 2)
+    {
+        h[i] = h[(i - 1) / 2];
+    }
+    h[i].node = node;
+    h[i].key = key;
+    h[i].word = word;
+}
+
+struct WordsPending WordsPop(struct WordsPending* h, int* n)
+{
+    struct WordsPending top = h[0];
+    struct WordsPending last = h[--*n];
+    int i = 0;
+    while (2 * i + 1 < *n)
+    {
+        int c = 2 * i + 1;
+        if (c + 1 < *n && h[c + 1].key > h[c].key)
+        {
+            c += 1;
+        }
+        if (h[c].key <= last.key)
+        {
+            break;
+        }
+        h[i] = h[c];
+        i = c;
+    }
+    h[i] = last;
+    return top;
+}
+
+/* Fills words with up to max of the most frequent words that extend prefix,
+ * most frequent first, and returns how many. Subtrees are taken in order of
+ * their best count, so the cost is the prefix plus the paths to the words
+ * returned. */
+int EditorWordsComplete(const char* prefix, int len, char** words, int max)
+{
+    if (E.words.job)
+    {
+        EditorWordsTake();
+    }
+    if (!E.words.valid)
+    {
+        EditorWordsBuild();
+    }
+    struct Words* w = &E.words;
+    int node = 0;
+    for (int i = 0; i < len && node != -1; ++i)
+    {
+        node = WordsChild(w, node, prefix[i], 0);
+    }
+    if (node == -1)
+    {
+        return 0;
+    }
+
+    struct WordsPending* heap = NULL;
+    int n = 0;
+    int cap = 0;
+    int found = 0;
+    for (int c = w->nodes[node].child; c != -1; c = w->nodes[c].next)
+    {
+        if (w->nodes[c].best > 0)
+        {
+            WordsPush(&heap, &n, &cap, c, w->nodes[c].best, 0);
+        }
+    }
+    while (n > 0 && found < max)
+    {
+        struct WordsPending p = WordsPop(heap, &n);
+        if (p.word)
+        {
+            char text[KILO_WORD_MAX + 1];
+            int at = KILO_WORD_MAX;
+            text[at] = '\0';
+            for (int x = p.node; x != 0; x = w->nodes[x].parent)
+            {
+                text[--at] = w->nodes[x].c;
+            }
+            words[found++] = strdup(&text[at]);
+            continue;
+        }
+        if (w->nodes[p.node].count > 0)
+        {
+            WordsPush(&heap, &n, &cap, p.node, w->nodes[p.node].count, 1);
+        }
+        for (int c = w->nodes[p.node].child; c != -1; c = w->nodes[c].next)
+        {
+            if (w->nodes[c].best > 0)
+            {
+                WordsPush(&heap, &n, &cap, c, w->nodes[c].best, 0);
+            }
+        }
+    }
+    free(heap);
+    return found;
+}
+
+void EditorCompleteClear()
+{
+    for (int i = 0; i < E.complete.n; ++i)
+    {
+        free(E.complete.words[i]);
+    }
+    E.complete.n = 0;
+    E.complete.active = 0;
+}
+
+/* CTRL-N: completes the word before the cursor with the most frequent word
+ * in the buffer that extends it. Pressed again, it puts the next candidate
+ * in place of the last one, coming back round to the prefix as typed. */
+void EditorComplete()
+{
+    struct Complete* cp = &E.complete;
+    if (E.cy >= E.numrows)
+    {
+        return;
+    }
+    ERow* row = &E.row[E.cy];
+
+    if (!cp->active || cp->row != E.cy || E.cx != cp->col + cp->len)
+    {
+        EditorCompleteClear();
+        int start = E.cx;
+        while (start > 0 && !is_separator((unsigned char)row->chars[start - 1]))
+        {
+            start -= 1;
+        }
+        if (start == E.cx || E.cx - start > KILO_WORD_MAX)
+        {
+            EditorSetStatusMessage("No word to complete");
+            return;
+        }
+        cp->n = EditorWordsComplete(&row->chars[start], E.cx - start, cp->words, KILO_COMPLETE_MAX);
+        if (cp->n == 0)
+        {
+            EditorSetStatusMessage("No completions");
+            return;
+        }
+        cp->active = 1;
+        cp->row = E.cy;
+        cp->col = E.cx;
+        cp->prefix = E.cx - start;
+        cp->len = 0;
+        cp->pick = -1;
+    }
+
+    EditorRowDelChars(row, cp->col, cp->len);
+    cp->pick = (cp->pick + 1 < cp->n) ? cp->pick + 1 : -1;
+    cp->len = 0;
+    if (cp->pick != -1)
+    {
+        cp->len = strlen(cp->words[cp->pick]) - cp->prefix;
+        EditorRowInsertChars(row, cp->col, cp->words[cp->pick] + cp->prefix, cp->len);
+    }
+    E.cx = cp->col + cp->len;
+
+    char msg[80];
+    int len = 0;
+    for (int i = 0; i < cp->n && len < (int)sizeof(msg) - 1; ++i)
+    {
+        len += snprintf(&msg[len], sizeof(msg) - len, i == cp->pick ? "[%s] " : "%s ", cp->words[i]);
+    }
+    EditorSetStatusMessage("%s", msg);
+}
+
+int CodecFromMagic(const unsigned char* m, int n)
+{
+    if (n >= 2 && m[0] == 0x1f && m[1] == 0x8b)
+    {
+        return CODEC_GZIP;
+    }
+    if (n >= 4 && m[0] == 0x28 && m[1] == 0xb5 && m[2] == 0x2f && m[3] == 0xfd)
+    {
+        return CODEC_ZSTD;
+    }
+    return CODEC_NONE;
+}
+
+/* Returns the codec for a file name's .gz or .zst suffix, with the
+ * suffix's length in *suffix. */
+int CodecFromName(const char* filename, int* suffix)
+{
+    const char* dot = strrchr(filename, '.');
+    *suffix = 0;
+    if (dot && !strcmp(dot, ".gz"))
+    {
+        *suffix = 3;
+        return CODEC_GZIP;
+    }
+    if (dot && !strcmp(dot, ".zst"))
+    {
+        *suffix = 4;
+        return CODEC_ZSTD;
+    }
+    return CODEC_NONE;
+}
+
+int CodecProbe(int fd)
+{
+    unsigned char magic[4];
+    return CodecFromMagic(magic, pread(fd, magic, sizeof(magic), 0));
+}
+
+int CodecBuilt(int codec)
+{
+#ifdef KILO_ZLIB
+    if (codec == CODEC_GZIP)
+    {
+        return 1;
+    }
+#endif
+#ifdef KILO_ZSTD
+    if (codec == CODEC_ZSTD)
+    {
+        return 1;
+    }
+#endif
+    return codec == CODEC_NONE;
+}
+
+const char* CodecName(int codec)
+{
+    return codec == CODEC_GZIP ? "gzip" : codec == CODEC_ZSTD ? "zstd" : "plain";
+}
+
+/* Decompresses a file on its own thread into a ring of KILO_CODEC_SLOTS
+ * fixed-size slots, which the loader splits into rows as they fill. */
+struct Decoder
+{
+    int fd;
+    int codec;
+    char* in;
+    int eof;
+    int ended;
+    int error;
+#ifdef KILO_ZLIB
+    z_stream z;
+#endif
+#ifdef KILO_ZSTD
+    ZSTD_DStream* zs;
+    ZSTD_inBuffer zin;
+#endif
+    char* slots[KILO_CODEC_SLOTS];
+    int lens[KILO_CODEC_SLOTS];
+    int head;
+    int count;
+    int done;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* Reads more of the file once the codec has used up what it had. */
+int DecoderInput(struct Decoder* d, const char** next, size_t* avail)
+{
+    if (*avail > 0 || d->eof)
+    {
+        return 0;
+    }
+    ssize_t n = read(d->fd, d->in, KILO_CODEC_BUF);
+    if (n == -1)
+    {
+        return -1;
+    }
+    d->eof = (n == 0);
+    *next = d->in;
+    *avail = n;
+    return 0;
+}
+
+/* Fills out with up to cap decompressed bytes. Returns how many, fewer than
+ * cap only at the end of the file or on an error, which sets d->error. */
+int DecoderFill(struct Decoder* d, char* out, int cap)
+{
+    int n = 0;
+    (void)out;
+    while (n < cap)
+    {
+#ifdef KILO_ZLIB
+        if (d->codec == CODEC_GZIP)
+        {
+            const char* next = (const char*)d->z.next_in;
+            size_t avail = d->z.avail_in;
+            if (DecoderInput(d, &next, &avail) == -1)
+            {
+                d->error = 1;
+                return n;
+            }
+            d->z.next_in = (Bytef*)next;
+            d->z.avail_in = avail;
+            if (avail == 0)
+            {
+                break;
+            }
+            d->z.next_out = (Bytef*)out + n;
+            d->z.avail_out = cap - n;
+            int rc = inflate(&d->z, Z_NO_FLUSH);
+            n = cap - d->z.avail_out;
+            d->ended = (rc == Z_STREAM_END);
+            if (rc == Z_STREAM_END)
+            {
+                /* concatenated members, as rotated logs often are */
+                inflateReset(&d->z);
+            }
+            else if (rc != Z_OK && rc != Z_BUF_ERROR)
+            {
+                d->error = 1;
+                return n;
+            }
+        }
+#endif
+#ifdef KILO_ZSTD
+        if (d->codec == CODEC_ZSTD)
+        {
+            const char* next = (const char*)d->zin.src + d->zin.pos;
+            size_t avail = d->zin.size - d->zin.pos;
+            if (DecoderInput(d, &next, &avail) == -1)
+            {
+                d->error = 1;
+                return n;
+            }
+            d->zin = (ZSTD_inBuffer){next, avail, 0};
+            if (avail == 0)
+            {
+                break;
+            }
+            ZSTD_outBuffer zout = {out + n, cap - n, 0};
+            size_t rc = ZSTD_decompressStream(d->zs, &zout, &d->zin);
+            n += zout.pos;
+            if (ZSTD_isError(rc))
+            {
+                d->error = 1;
+                return n;
+            }
+            d->ended = (rc == 0);
+        }
+#endif
+    }
+    d->error |= (n < cap && !d->ended);
+    return n;
+}
+
+void* DecoderRun(void* arg)
+{
+    struct Decoder* d = (struct Decoder*)arg;
+    while (1)
+    {
+        pthread_mutex_lock(&d->lock);
+        while (d->count == KILO_CODEC_SLOTS)
+        {
+            pthread_cond_wait(&d->cond, &d->lock);
+        }
+        int slot = (d->head + d->count) % KILO_CODEC_SLOTS;
+        pthread_mutex_unlock(&d->lock);
+
+        int n = DecoderFill(d, d->slots[slot], KILO_CODEC_BUF);
+
+        pthread_mutex_lock(&d->lock);
+        if (n > 0)
+        {
+            d->lens[slot] = n;
+            d->count += 1;
+        }
+        int done = d->done = (n < KILO_CODEC_BUF || d->error);
+        pthread_cond_signal(&d->cond);
+        pthread_mutex_unlock(&d->lock);
+        if (done)
+        {
+            return NULL;
+        }
+    }
+}
+
+int DecoderOpen(struct Decoder* d, int fd, int codec)
+{
+    memset(d, 0, sizeof(*d));
+    if (!CodecBuilt(codec) || codec == CODEC_NONE)
+    {
+        return -1;
+    }
+    d->fd = fd;
+    d->codec = codec;
+#ifdef KILO_ZLIB
+    /* 16 + MAX_WBITS: a gzip header, not a zlib one */
+    if (codec == CODEC_GZIP && inflateInit2(&d->z, 16 + MAX_WBITS) != Z_OK)
+    {
+        return -1;
+    }
+#endif
+#ifdef KILO_ZSTD
+    if (codec == CODEC_ZSTD && (d->zs = ZSTD_createDStream()) == NULL)
+    {
+        return -1;
+    }
+#endif
+    d->in = (char*)malloc(KILO_CODEC_BUF);
+#ifdef KILO_ZSTD
+    d->zin = (ZSTD_inBuffer){d->in, 0, 0};
+#endif
+    for (int i = 0; i < KILO_CODEC_SLOTS; ++i)
+    {
+        d->slots[i] = (char*)malloc(KILO_CODEC_BUF);
+    }
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->cond, NULL);
+    if (pthread_create(&d->thread, NULL, DecoderRun, d) != 0)
+    {
+        Die("pthread_create");
+    }
+    return 0;
+}
+
+/* Waits for the next filled slot. Returns its length, 0 once the file is
+ * done. */
+int DecoderNext(struct Decoder* d, const char** buf)
+{
+    pthread_mutex_lock(&d->lock);
+    while (d->count == 0 && !d->done)
+    {
+        pthread_cond_wait(&d->cond, &d->lock);
+    }
+    int n = d->count ? d->lens[d->head] : 0;
+    *buf = d->slots[d->head];
+    pthread_mutex_unlock(&d->lock);
+    return n;
+}
+
+void DecoderRelease(struct Decoder* d)
+{
+    pthread_mutex_lock(&d->lock);
+    d->head = (d->head + 1) % KILO_CODEC_SLOTS;
+    d->count -= 1;
+    pthread_cond_signal(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+}
+
+/* Joins the thread once DecoderNext has returned 0. Returns -1 if the file
+ * was damaged or cut short. */
+int DecoderClose(struct Decoder* d)
+{
+    pthread_join(d->thread, NULL);
+#ifdef KILO_ZLIB
+    if (d->codec == CODEC_GZIP)
+    {
+        inflateEnd(&d->z);
+    }
+#endif
+#ifdef KILO_ZSTD
+    if (d->codec == CODEC_ZSTD)
+    {
+        ZSTD_freeDStream(d->zs);
+    }
+#endif
+    free(d->in);
+    for (int i = 0; i < KILO_CODEC_SLOTS; ++i)
+    {
+        free(d->slots[i]);
+    }
+    pthread_mutex_destroy(&d->lock);
+    pthread_cond_destroy(&d->cond);
+    return d->error ? -1 : 0;
+}
+
+/* Loads a compressed file through EditorStreamAppend as it decompresses,
+ * so splitting and highlighting overlap the decoder. Returns the number of
+ * bytes it held. */
+off_t EditorLoadDecoded(int fd, int codec)
+{
+    struct Decoder d;
+    if (DecoderOpen(&d, fd, codec) == -1)
+    {
+        Die("decoder");
+    }
+
+    /* the line joining is borrowed from a stream another buffer may follow */
+    int cx = E.cx;
+    int cy = E.cy;
+    int open_line = E.stream.open_line;
+    E.stream.open_line = 0;
+    off_t total = 0;
+    const char* buf;
+    int n;
+    while ((n = DecoderNext(&d, &buf)) > 0)
+    {
+        EditorStreamAppend(buf, n);
+        DecoderRelease(&d);
+        total += n;
+    }
+    E.stream.open_line = open_line;
+    E.cx = cx;
+    E.cy = cy;
+
+    if (DecoderClose(&d) == -1)
+    {
+        EditorSetStatusMessage("%s is damaged or cut short (%s)", E.filename, CodecName(codec));
+    }
+    return total;
+}
+
+/* Reads a whole compressed file into one buffer, for EditorReload. */
+char* EditorReadDecoded(int fd, int codec, off_t* size)
+{
+    struct Decoder d;
+    if (DecoderOpen(&d, fd, codec) == -1)
+    {
+        return NULL;
+    }
+
+    size_t cap = KILO_CODEC_BUF;
+    char* out = (char*)malloc(cap);
+    off_t len = 0;
+    const char* buf;
+    int n;
+    while ((n = DecoderNext(&d, &buf)) > 0)
+    {
+        if (len + n > (off_t)cap)
+        {
+            cap *= 2;
+            out = (char*)realloc(out, cap);
+        }
+        memcpy(out + len, buf, n);
+        len += n;
+        DecoderRelease(&d);
+    }
+    if (DecoderClose(&d) == -1)
+    {
+        free(out);
+        return NULL;
+    }
+    *size = len;
+    return out;
+}
+
+/* Compresses the rows into fd through fixed-size buffers: rows are copied
+ * into in, and each full in goes through the codec into out and to disk. */
+struct Encoder
+{
+    int fd;
+    int codec;
+    char* in;
+    int inlen;
+    char* out;
+    long long written;
+#ifdef KILO_ZLIB
+    z_stream z;
+#endif
+#ifdef KILO_ZSTD
+    ZSTD_CStream* zs;
+#endif
+};
+
+int EncoderOut(struct Encoder* c, int len)
+{
+    if (len > 0 && WriteAll(c->fd, c->out, len) == -1)
+    {
+        return -1;
+    }
+    c->written += len;
+    return 0;
+}
+
+/* Runs what is in in through the codec, finishing the stream on `last`. */
+int EncoderFlush(struct Encoder* c, int last)
+{
+    (void)last;
+#ifdef KILO_ZLIB
+    if (c->codec == CODEC_GZIP)
+    {
+        c->z.next_in = (Bytef*)c->in;
+        c->z.avail_in = c->inlen;
+        int rc;
+        do
+        {
+            c->z.next_out = (Bytef*)c->out;
+            c->z.avail_out = KILO_CODEC_BUF;
+            rc = deflate(&c->z, last ? Z_FINISH : Z_NO_FLUSH);
+            if (rc == Z_STREAM_ERROR || EncoderOut(c, KILO_CODEC_BUF - c->z.avail_out) == -1)
+            {
+                return -1;
+            }
+        } while (c->z.avail_out == 0 || (last && rc != Z_STREAM_END));
+    }
+#endif
+#ifdef KILO_ZSTD
+    if (c->codec == CODEC_ZSTD)
+    {
+        ZSTD_inBuffer zin = {c->in, (size_t)c->inlen, 0};
+        size_t rc;
+        do
+        {
+            ZSTD_outBuffer zout = {c->out, KILO_CODEC_BUF, 0};
+            rc = ZSTD_compressStream2(c->zs, &zout, &zin, last ? ZSTD_e_end : ZSTD_e_continue);
+            if (ZSTD_isError(rc) || EncoderOut(c, zout.pos) == -1)
+            {
+                return -1;
+            }
+        } while (zin.pos < zin.size || (last && rc != 0));
+    }
+#endif
+    c->inlen = 0;
+    return 0;
+}
+
+int EncoderWrite(struct Encoder* c, const char* s, int len)
+{
+    while (len > 0)
+    {
+        int n = KILO_CODEC_BUF - c->inlen;
+        n = len < n ? len : n;
+        memcpy(c->in + c->inlen, s, n);
+        c->inlen += n;
+        s += n;
+        len -= n;
+        if (c->inlen == KILO_CODEC_BUF && EncoderFlush(c, 0) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Writes the rows to fd compressed. Returns the bytes written, or -1. */
+long long EditorWriteEncoded(int fd, int codec)
+{
+    struct Encoder c;
+    memset(&c, 0, sizeof(c));
+    c.fd = fd;
+    c.codec = codec;
+#ifdef KILO_ZLIB
+    if (codec == CODEC_GZIP && deflateInit2(&c.z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                                            Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return -1;
+    }
+#endif
+#ifdef KILO_ZSTD
+    if (codec == CODEC_ZSTD && (c.zs = ZSTD_createCStream()) == NULL)
+    {
+        return -1;
+    }
+#endif
+    c.in = (char*)malloc(KILO_CODEC_BUF);
+    c.out = (char*)malloc(KILO_CODEC_BUF);
+
+    int ok = ftruncate(fd, 0) != -1;
+    for (int i = 0; ok && i < E.numrows; ++i)
+    {
+        ERow* row = EditorRowAt(i);
+        ok = EncoderWrite(&c, row->chars, row->size) != -1;
+        for (int k = 1; ok && k < row->eol; ++k)
+        {
+            ok = EncoderWrite(&c, "\r", 1) != -1;
+        }
+        ok = ok && EncoderWrite(&c, "\n", 1) != -1;
+    }
+    ok = ok && EncoderFlush(&c, 1) != -1;
+
+#ifdef KILO_ZLIB
+    if (codec == CODEC_GZIP)
+    {
+        deflateEnd(&c.z);
+    }
+#endif
+#ifdef KILO_ZSTD
+    if (codec == CODEC_ZSTD)
+    {
+        ZSTD_freeCStream(c.zs);
+    }
+#endif
+    free(c.in);
+    free(c.out);
+    return ok ? c.written : -1;
+}
+
+off_t EditorLoadStream(FILE* fp)
+{
+    char* line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    off_t total = 0;
+    E.undo.paused = 1;
+
+    while((linelen = getline(&line, &linecap, fp)) != -1)
+    {
+        total += linelen;
+        int len = linelen;
+        if (len > 0 && line[len - 1] == '\n')
+        {
+            len -= 1;
+        }
+        int eol = LineEnding(line, &len);
+        EditorInsertRow(E.numrows, line, len);
+        EditorRowSetEnding(E.numrows - 1, eol);
+    }
+    E.undo.paused = 0;
+    free(line);
+    return total;
+}
+
+/* Returns the number of bytes loaded, or -1 with errno set if the file
+ * cannot be opened, leaving the buffer as it was. */
+off_t EditorOpen(const char* filename)
+{
+    FILE* fp = fopen(filename, "r");
+    if (!fp)
+    {
+        return -1;
+    }
+
+    free(E.filename);
+    E.filename = strdup(filename);
+    EditorSelectSyntaxHighlight();
+
+    off_t loaded;
+    struct stat st;
+    int regular = fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode);
+    int codec = regular ? CodecProbe(fileno(fp)) : CODEC_NONE;
+    E.codec = CodecBuilt(codec) ? codec : CODEC_NONE;
+    if (codec && CodecBuilt(codec))
+    {
+        loaded = EditorLoadDecoded(fileno(fp), codec);
+    }
+    else if (regular && st.st_size > 0)
+    {
+        if (codec)
+        {
+            EditorSetStatusMessage("Built without %s, showing %s as it is", CodecName(codec), filename);
+        }
+        EditorLoadMapped(fileno(fp), st.st_size);
+        EditorWordsStart(fileno(fp), &st);
+        loaded = st.st_size;
+    }
+    else
+    {
+        /* pipes, and files such as those in /proc that report no size */
+        loaded = EditorLoadStream(fp);
+    }
+    fclose(fp);
+    E.dirty = 0;
+    return loaded;
+}
+
+/* Appends streamed bytes at the tail: complete lines become rows through
+ * EditorInsertRow and an unterminated line grows the last row. Only the new
+ * rows are highlighted. If the cursor was on the last row it follows the tail. */
+void EditorStreamAppend(const char* buf, int len)
+{
+    int follow = (E.cy >= E.numrows - 1);
+    char dirty = E.dirty;
+    /* streamed text is not an edit to take back */
+    E.undo.paused = 1;
+
+    const char* end = buf + len;
+    for (const char* p = buf; p < end;)
+    {
+        const char* nl = ScanNewline(p, end);
+        int linelen = nl - p;
+        int eol = nl < end ? LineEnding(p, &linelen) : 1;
+
+        if (E.stream.open_line && E.numrows > 0)
+        {
+            /* carriage returns held over from the last read may be the
+             * start of this line's ending, so it is found on the whole row */
+            ERow* row = &E.row[E.numrows - 1];
+            if (nl > p)
+            {
+                EditorRowAppendString(row, (char*)p, nl - p);
+            }
+            if (nl < end)
+            {
+                int size = row->size;
+                eol = LineEnding(row->chars, &size);
+                EditorRowDelChars(row, size, row->size - size);
+            }
+        }
+        else
+        {
+            EditorInsertRow(E.numrows, (char*)p, linelen);
+        }
+        EditorRowSetEnding(E.numrows - 1, eol);
+
+        E.stream.open_line = (nl == end);
+        p = nl + 1;
+    }
+
+    E.dirty = dirty;
+    E.undo.paused = 0;
+    if (follow && E.numrows > 0)
+    {
+        E.cy = E.numrows - 1;
+        E.cx = 0;
+    }
+}
+
+/* The followed file was truncated or replaced: drops the rows read from it
+ * so that reading it again from the start does not repeat them. The undo
+ * history goes with them, as it names rows that no longer exist. */
+void EditorStreamClear()
+{
+    char dirty = E.dirty;
+    E.undo.paused = 1;
+    EditorCursorsClear();
+    EditorDelRows(0, E.numrows);
+    E.undo.paused = 0;
+    E.undo.len = 0;
+    E.undo.pos = 0;
+    E.undo.saved = dirty ? -1 : 0;
+    E.dirty = dirty;
+    E.cx = 0;
+    E.cy = 0;
+    E.stream.offset = 0;
+    E.stream.open_line = 0;
+}
+
+void EditorStreamClose()
+{
+    if (E.stream.wd != -1)
+    {
+        inotify_rm_watch(E.stream.fd, E.stream.wd);
+    }
+    if (E.stream.file != -1 && E.stream.file != E.stream.fd)
+    {
+        close(E.stream.file);
+    }
+    if (E.stream.fd != -1 && E.stream.fd != STDIN_FILENO)
+    {
+        close(E.stream.fd);
+    }
+    E.stream.fd = -1;
+    E.stream.file = -1;
+    E.stream.wd = -1;
+}
+
+void EditorStreamStdin()
+{
+    fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+    E.stream.fd = STDIN_FILENO;
+    E.stream.file = STDIN_FILENO;
+}
+
+/* Watches the file EditorOpen loaded `loaded` bytes of, appending whatever is
+ * written to it afterwards. A moved or deleted file is reopened by name, as
+ * with tail -F. */
+void EditorFollow(const char* path, off_t loaded)
+{
+    E.stream.path = strdup(path);
+    E.stream.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (E.stream.fd == -1)
+    {
+        Die("inotify");
+    }
+
+    E.stream.file = open(path, O_RDONLY);
+    E.stream.wd = inotify_add_watch(E.stream.fd, path, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+    if (E.stream.file == -1 || E.stream.wd == -1)
+    {
+        Die("follow");
+    }
+    E.stream.offset = loaded;
+
+    char last;
+    E.stream.open_line = (loaded > 0 && pread(E.stream.file, &last, 1, loaded - 1) == 1 && last != '\n');
+}
+
+void EditorFollowReopen()
+{
+    inotify_rm_watch(E.stream.fd, E.stream.wd);
+    close(E.stream.file);
+
+    E.stream.file = open(E.stream.path, O_RDONLY);
+    E.stream.wd = -1;
+    if (E.stream.file != -1)
+    {
+        E.stream.wd = inotify_add_watch(E.stream.fd, E.stream.path, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+    }
+    if (E.stream.file == -1 || E.stream.wd == -1)
+    {
+        EditorSetStatusMessage("%s is gone, stopped following", E.stream.path);
+        EditorStreamClose();
+        return;
+    }
+    EditorStreamClear();
+    EditorSetStatusMessage("%s was replaced, following the new file", E.stream.path);
+}
+
+/* Reads whatever the stream has ready, at most KILO_STREAM_BATCH bytes so
+ * keys are not starved. Returns the number of bytes appended. */
+int EditorStreamRead()
+{
+    static char buf[65536];
+    int total = 0;
+
+    if (E.stream.wd != -1)
+    {
+        int reopen = 0;
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t n;
+        while ((n = read(E.stream.fd, events, sizeof(events))) > 0)
+        {
+            for (char* p = events; p < events + n;)
+            {
+                struct inotify_event* ev = (struct inotify_event*)p;
+                if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF))
+                {
+                    reopen = 1;
+                }
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+
+        struct stat st;
+        if (fstat(E.stream.file, &st) == 0 && st.st_size < E.stream.offset)
+        {
+            EditorSetStatusMessage("%s was truncated", E.stream.path);
+            EditorStreamClear();
+        }
+
+        while (total < KILO_STREAM_BATCH)
+        {
+            n = pread(E.stream.file, buf, sizeof(buf), E.stream.offset);
+            if (n <= 0)
+            {
+                break;
+            }
+            E.stream.offset += n;
+            EditorStreamAppend(buf, n);
+            total += n;
+        }
+
+        if (reopen && total < KILO_STREAM_BATCH)
+        {
+            EditorFollowReopen();
+        }
+        return total;
+    }
+
+    while (total < KILO_STREAM_BATCH)
+    {
+        ssize_t n = read(E.stream.fd, buf, sizeof(buf));
+        if (n == 0)
+        {
+            EditorStreamClose();
+            break;
+        }
+        if (n == -1)
+        {
+            if (errno != EAGAIN && errno != EINTR)
+            {
+                EditorStreamClose();
+            }
+            break;
+        }
+        EditorStreamAppend(buf, n);
+        total += n;
+    }
+    return total;
+}
+
+/* The stream feeds the first buffer, which may not be the current one. A
+ * window showing it is focused for the read so that it follows the tail. */
+void EditorStreamReadBuffer()
+{
+    if (E.win.nviews == 0)
+    {
+        EditorStreamRead();
+        return;
+    }
+
+    int focus = E.win.current;
+    for (int v = 0; v < E.win.nviews; ++v)
+    {
+        if (E.win.views[v].buffer == 0)
+        {
+            EditorFocus(v);
+            EditorStreamRead();
+            EditorFocus(focus);
+            return;
+        }
+    }
+
+    struct View* cur = &E.win.views[focus];
+    BufferSave(&E.win.buffers[cur->buffer]);
+    ViewSave(cur);
+    BufferLoad(&E.win.buffers[0]);
+    E.cy = 0;
+    EditorStreamRead();
+    BufferSave(&E.win.buffers[0]);
+    BufferLoad(&E.win.buffers[cur->buffer]);
+    ViewLoad(cur);
+}
+
+/* Notes the file as it is now, so our own save is not taken for a change. */
+void EditorDiskNote(const struct stat* st)
+{
+    E.disk.dev = st->st_dev;
+    E.disk.ino = st->st_ino;
+    E.disk.size = st->st_size;
+    E.disk.mtime = st->st_mtim;
+}
+
+int EditorDiskSame(const struct stat* st)
+{
+    return E.disk.dev == st->st_dev && E.disk.ino == st->st_ino && E.disk.size == st->st_size &&
+           E.disk.mtime.tv_sec == st->st_mtim.tv_sec && E.disk.mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* Watches the buffer's file, or notes it again after a save, so that a
+ * change another process makes is reloaded. The directory is watched
+ * rather than the file, as tools often rename a new file over the old one.
+ * Followed and indexed files are left alone. */
+void EditorWatch()
+{
+    struct stat st;
+    int streamed = E.stream.fd != -1 && (E.win.nviews == 0 || E.win.views[E.win.current].buffer == 0);
+    if (!E.watch.enabled || E.filename == NULL || E.readonly || streamed || stat(E.filename, &st) == -1)
+    {
+        return;
+    }
+    EditorDiskNote(&st);
+
+    if (E.watch.fd == -1 && (E.watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+    {
+        return;
+    }
+    char* dir = strdup(E.filename);
+    char* slash = strrchr(dir, '/');
+    if (slash)
+    {
+        slash[slash == dir] = '\0';
+    }
+    E.disk.wd = inotify_add_watch(E.watch.fd, slash ? dir : ".", IN_CLOSE_WRITE | IN_MOVED_TO);
+    free(dir);
+}
+
+unsigned long long LineHash(const char* s, int len)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    for (int i = 0; i < len; ++i)
+    {
+        h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Rows old to old + del - 1 became the file's lines at to at + add - 1. */
+struct ReloadHunk
+{
+    int old;
+    int del;
+    int at;
+    int add;
+};
+
+/* The rows (side 0) against the file's lines (side 1): each side's line
+ * hashes, chained by hash bucket in ascending order for finding the next
+ * line on one side equal to a line of the other, and the hunks found. */
+struct Reload
+{
+    const char** lines;
+    int* lens;
+    unsigned char* eols;
+    int n;
+    unsigned long long* hash[2];
+    int* heads[2];
+    int* next[2];
+    unsigned int mask;
+    struct ReloadHunk* hunks;
+    int nhunks;
+};
+
+int ReloadSame(const struct Reload* r, int row, int line)
+{
+    return r->hash[0][row] == r->hash[1][line] && E.row[row].size == r->lens[line] &&
+           E.row[row].eol == r->eols[line] && memcmp(E.row[row].chars, r->lines[line], r->lens[line]) == 0;
+}
+
+/* The first line from `from` on on `side` equal to line `other` of the
+ * other side, or -1. from only grows, so the lines before it are unlinked
+ * from the bucket as they are passed. */
+int ReloadFind(struct Reload* r, int side, int from, int other)
+{
+    unsigned long long h = r->hash[!side][other];
+    int* head = &r->heads[side][h & r->mask];
+    while (*head != -1 && *head < from)
+    {
+        *head = r->next[side][*head];
+    }
+    for (int k = *head; k != -1; k = r->next[side][k])
+    {
+        if (r->hash[side][k] == h && (side ? ReloadSame(r, other, k) : ReloadSame(r, k, other)))
+        {
+            return k;
+        }
+    }
+    return -1;
+}
+
+void ReloadChange(struct Reload* r, int old, int del, int at, int add)
+{
+    struct ReloadHunk* last = r->nhunks ? &r->hunks[r->nhunks - 1] : NULL;
+    if (last && last->old + last->del == old && last->at + last->add == at)
+    {
+        last->del += del;
+        last->add += add;
+        return;
+    }
+    r->hunks[r->nhunks++] = (struct ReloadHunk){old, del, at, add};
+}
+
+/* Matches the rows against the lines: the common head and tail first, then
+ * in between a greedy walk that keeps equal lines, drops a row or takes a
+ * line that has no match ahead, and otherwise skips to the nearer match. */
+void ReloadDiff(struct Reload* r)
+{
+    int n[2] = {E.numrows, r->n};
+    int head = 0;
+    while (head < n[0] && head < n[1] && ReloadSame(r, head, head))
+    {
+        ++head;
+    }
+    int tail = 0;
+    while (tail < n[0] - head && tail < n[1] - head && ReloadSame(r, n[0] - 1 - tail, n[1] - 1 - tail))
+    {
+        ++tail;
+    }
+
+    int buckets = 16;
+    while (buckets < 2 * (n[0] > n[1] ? n[0] : n[1]))
+    {
+        buckets *= 2;
+    }
+    r->mask = buckets - 1;
+    r->hunks = (struct ReloadHunk*)malloc(sizeof(struct ReloadHunk) * (n[0] + n[1] - 2 * head - 2 * tail + 1));
+    for (int side = 0; side < 2; ++side)
+    {
+        r->heads[side] = (int*)malloc(sizeof(int) * buckets);
+        memset(r->heads[side], -1, sizeof(int) * buckets);
+        r->next[side] = (int*)malloc(sizeof(int) * (n[side] + 1));
+        for (int k = n[side] - tail - 1; k >= head; --k)
+        {
+            int* bucket = &r->heads[side][r->hash[side][k] & r->mask];
+            r->next[side][k] = *bucket;
+            *bucket = k;
+        }
+    }
+
+    int j = head;
+    int i = head;
+    int oldend = n[0] - tail;
+    int newend = n[1] - tail;
+    while (j < oldend || i < newend)
+    {
+        if (j < oldend && i < newend && ReloadSame(r, j, i))
+        {
+            ++j;
+            ++i;
+            continue;
+        }
+        int k = i < newend ? ReloadFind(r, 0, j, i) : -1;
+        int l = j < oldend ? ReloadFind(r, 1, i, j) : -1;
+        if (j < oldend && l == -1)
+        {
+            ReloadChange(r, j, 1, i, 0);
+            ++j;
+        }
+        else if (i < newend && k == -1)
+        {
+            ReloadChange(r, j, 0, i, 1);
+            ++i;
+        }
+        else if (k - j <= l - i)
+        {
+            ReloadChange(r, j, k - j, i, 0);
+            j = k;
+        }
+        else
+        {
+            ReloadChange(r, j, 0, i, l - i);
+            i = l;
+        }
+    }
+}
+
+/* Where row y is after the reload. A row that was replaced maps to the line
+ * in its place, if any, and sets *gone. */
+int ReloadMap(const struct Reload* r, int y, int* gone)
+{
+    int lo = 0;
+    int hi = r->nhunks;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (r->hunks[mid].old + r->hunks[mid].del <= y)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    *gone = 0;
+    if (lo < r->nhunks)
+    {
+        const struct ReloadHunk* h = &r->hunks[lo];
+        if (y < h->old)
+        {
+            return y + h->at - h->old;
+        }
+        *gone = 1;
+        int into = y - h->old;
+        return h->at + (into < h->add ? into : (h->add > 0 ? h->add - 1 : 0));
+    }
+    if (r->nhunks == 0)
+    {
+        return y;
+    }
+    const struct ReloadHunk* h = &r->hunks[r->nhunks - 1];
+    return y + (h->at + h->add) - (h->old + h->del);
+}
+
+/* Moves a view's cursor and scroll position along with the lines. */
+void ReloadMapView(const struct Reload* r, int* cy, int* rowoff)
+{
+    int gone;
+    *cy = ReloadMap(r, *cy, &gone);
+    *rowoff = ReloadMap(r, *rowoff, &gone);
+    if (*rowoff > *cy)
+    {
+        *rowoff = *cy;
+    }
+}
+
+/* Swaps the changed hunks into the rows in one pass and records them as one
+ * undo step. Kept rows move over with their render and highlighting; new
+ * ones, and the row after each hunk, whose comment state may have changed,
+ * go to EditorBatchUpdate. */
+void ReloadApply(struct Reload* r)
+{
+    EditorUndoSeal();
+    for (int h = 0; h < r->nhunks; ++h)
+    {
+        struct ReloadHunk* k = &r->hunks[h];
+        if (k->del > 0 && !E.undo.paused)
+        {
+            const char** lines = (const char**)malloc(sizeof(char*) * k->del);
+            int* lens = (int*)malloc(sizeof(int) * k->del);
+            unsigned char* eols = (unsigned char*)malloc(k->del);
+            for (int i = 0; i < k->del; ++i)
+            {
+                lines[i] = E.row[k->old + i].chars;
+                lens[i] = E.row[k->old + i].size;
+                eols[i] = E.row[k->old + i].eol;
+            }
+            EditorUndoRows(UNDO_DELETE_ROWS, k->at, k->del, lines, lens, eols);
+            free(lines);
+            free(lens);
+            free(eols);
+        }
+        if (k->add > 0)
+        {
+            EditorUndoRows(UNDO_INSERT_ROWS, k->at, k->add, &r->lines[k->at], &r->lens[k->at], &r->eols[k->at]);
+        }
+    }
+
+    int gone;
+    int kept = 0;
+    for (int f = 0; f < E.folds.count; ++f)
+    {
+        struct Fold fold = E.folds.ranges[f];
+        int end_gone;
+        fold.start = ReloadMap(r, fold.start, &gone);
+        fold.end = ReloadMap(r, fold.end, &end_gone);
+        if (!gone && !end_gone && fold.end > fold.start)
+        {
+            E.folds.ranges[kept++] = fold;
+        }
+    }
+    E.folds.count = kept;
+    ReloadMapView(r, &E.cy, &E.rowoff);
+    for (int v = 0; v < E.win.nviews; ++v)
+    {
+        struct View* view = &E.win.views[v];
+        if (v != E.win.current && view->buffer == E.win.views[E.win.current].buffer)
+        {
+            ReloadMapView(r, &view->cy, &view->rowoff);
+        }
+    }
+
+    int cap = r->n > 16 ? r->n : 16;
+    ERow* rows = (ERow*)malloc(sizeof(ERow) * cap);
+    int* changed = (int*)malloc(sizeof(int) * (r->n + r->nhunks));
+    int nchanged = 0;
+    int y = 0;
+    int x = 0;
+    for (int h = 0; h <= r->nhunks; ++h)
+    {
+        int old = h < r->nhunks ? r->hunks[h].old : E.numrows;
+        memcpy(&rows[x], &E.row[y], sizeof(ERow) * (old - y));
+        x += old - y;
+        y = old;
+        if (h == r->nhunks)
+        {
+            break;
+        }
+
+        struct ReloadHunk* k = &r->hunks[h];
+        for (int i = 0; i < k->del; ++i)
+        {
+            EditorWordsRow(&E.row[y + i], -1);
+            EditorFreeRow(&E.row[y + i]);
+        }
+        y += k->del;
+        for (int i = 0; i < k->add; ++i)
+        {
+            ERow* row = &rows[x + i];
+            int len = r->lens[k->at + i];
+            row->size = len;
+            row->chars = (char*)malloc(len + 1);
+            memcpy(row->chars, r->lines[k->at + i], len);
+            row->chars[len] = '\0';
+            row->rsize = 0;
+            row->render = NULL;
+            row->hl = NULL;
+            row->hlruns = 0;
+            row->hl_open_comment = 0;
+            row->cache = 0;
+            row->eol = r->eols[k->at + i];
+            EditorWordsRow(row, 1);
+            changed[nchanged++] = x + i;
+        }
+        x += k->add;
+        if (y < E.numrows)
+        {
+            changed[nchanged++] = x;
+        }
+    }
+    free(E.row);
+    E.row = rows;
+    E.rowcap = cap;
+    E.numrows = r->n;
+    E.offsets.valid = 0;
+    E.wrap.lines.valid = 0;
+    E.brackets.valid = 0;
+    EditorBatchUpdate(changed, nchanged);
+    free(changed);
+
+    if (E.cy >= E.numrows)
+    {
+        E.cy = E.numrows;
+        E.cx = 0;
+    }
+    else if (E.cx > E.row[E.cy].size)
+    {
+        E.cx = E.row[E.cy].size;
+    }
+    E.wrap.sub = 0;
+    EditorUndoSeal();
+}
+
+/* Brings the buffer in line with its file. Lines are matched to rows by
+ * hash, so rows that did not change keep their render and highlighting and
+ * the cursor stays on its line. Undo takes the reload back. */
+void EditorReload()
+{
+    if (E.filename == NULL)
+    {
+        return;
+    }
+    int fd = open(E.filename, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        EditorSetStatusMessage("Can't reload %s: %s", E.filename, strerror(errno));
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return;
+    }
+    int codec = CodecProbe(fd);
+    char* map = NULL;
+    off_t size = st.st_size;
+    if (codec && CodecBuilt(codec))
+    {
+        map = EditorReadDecoded(fd, codec, &size);
+    }
+    else if (size > 0)
+    {
+        map = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        codec = CODEC_NONE;
+    }
+    if ((size > 0 || codec) && (map == NULL || map == MAP_FAILED))
+    {
+        EditorSetStatusMessage("Can't reload %s: %s", E.filename, codec ? "damaged or cut short" : strerror(errno));
+        close(fd);
+        return;
+    }
+    E.codec = CodecBuilt(codec) ? codec : CODEC_NONE;
+    long long t = TraceBegin();
+
+    struct Reload r;
+    memset(&r, 0, sizeof(r));
+    const char* end = map + size;
+    long long lines = size ? CountNewlines(map, end) + (end[-1] != '\n') : 0;
+    if (lines > 0x7fffffff)
+    {
+        Die("too many lines");
+    }
+    r.n = lines;
+    r.lines = (const char**)malloc(sizeof(char*) * (r.n + 1));
+    r.lens = (int*)malloc(sizeof(int) * (r.n + 1));
+    r.eols = (unsigned char*)malloc(r.n + 1);
+    r.hash[0] = (unsigned long long*)malloc(sizeof(unsigned long long) * (E.numrows + 1));
+    r.hash[1] = (unsigned long long*)malloc(sizeof(unsigned long long) * (r.n + 1));
+    const char* p = map;
+    for (int i = 0; i < r.n; ++i)
+    {
+        const char* nl = ScanNewline(p, end);
+        int len = nl - p;
+        r.eols[i] = LineEnding(p, &len);
+        r.lines[i] = p;
+        r.lens[i] = len;
+        r.hash[1][i] = LineHash(p, len);
+        p = nl + 1;
+    }
+    for (int i = 0; i < E.numrows; ++i)
+    {
+        r.hash[0][i] = LineHash(E.row[i].chars, E.row[i].size);
+    }
+
+    ReloadDiff(&r);
+    int added = 0;
+    int removed = 0;
+    for (int h = 0; h < r.nhunks; ++h)
+    {
+        added += r.hunks[h].add;
+        removed += r.hunks[h].del;
+    }
+    if (r.nhunks > 0)
+    {
+        EditorCursorsClear();
+        ReloadApply(&r);
+    }
+    E.dirty = 0;
+    E.undo.saved = E.undo.pos;
+    EditorDiskNote(&st);
+    if (E.stream.wd != -1 && (E.win.nviews == 0 || E.win.views[E.win.current].buffer == 0))
+    {
+        /* the follower goes on from the end of what was just read */
+        E.stream.offset = size;
+        E.stream.open_line = size > 0 && map[size - 1] != '\n';
+    }
+    EditorSetStatusMessage("Reloaded %s: %d lines in, %d out", E.filename, added, removed);
+
+    for (int side = 0; side < 2; ++side)
+    {
+        free(r.hash[side]);
+        free(r.heads[side]);
+        free(r.next[side]);
+    }
+    free(r.hunks);
+    free(r.lines);
+    free(r.lens);
+    free(r.eols);
+    if (codec)
+    {
+        free(map);
+    }
+    else if (map)
+    {
+        munmap(map, size);
+    }
+    close(fd);
+    TraceEnd("EditorReload", t);
+}
+
+/* A watched file changed: reloads it unless that was our own save, or the
+ * buffer has edits of its own, which are not thrown away unasked. */
+void EditorReloadChanged()
+{
+    struct stat st;
+    if (E.filename == NULL || stat(E.filename, &st) == -1 || EditorDiskSame(&st))
+    {
+        return;
+    }
+    if (E.dirty)
+    {
+        EditorSetStatusMessage("%s changed on disk, CTRL-R to reload it", E.filename);
+        return;
+    }
+    EditorReload();
+}
+
+/* Runs fn with buffer b in E: through a window showing it, or in place of
+ * the current buffer with the cursor it was left at. */
+void EditorWithBuffer(int b, void (*fn)())
+{
+    if (E.win.nviews == 0 || E.win.views[E.win.current].buffer == b)
+    {
+        fn();
+        return;
+    }
+
+    int focus = E.win.current;
+    for (int v = 0; v < E.win.nviews; ++v)
+    {
+        if (E.win.views[v].buffer == b)
+        {
+            EditorFocus(v);
+            fn();
+            EditorFocus(focus);
+            return;
+        }
+    }
+
+    struct View* cur = &E.win.views[focus];
+    struct Buffer* buf = &E.win.buffers[b];
+    BufferSave(&E.win.buffers[cur->buffer]);
+    ViewSave(cur);
+    BufferLoad(buf);
+    E.cx = buf->cx;
+    E.cy = buf->cy;
+    E.rowoff = 0;
+    fn();
+    buf->cx = E.cx;
+    buf->cy = E.cy;
+    BufferSave(buf);
+    BufferLoad(&E.win.buffers[cur->buffer]);
+    ViewLoad(cur);
+}
+
+/* Drains the watch and marks the buffers whose files were written or
+ * renamed into place; EditorWatchApply reloads them. */
+void EditorWatchRead()
+{
+    int nbuffers = E.win.nviews ? E.win.nbuffers : 1;
+    int current = E.win.nviews ? E.win.views[E.win.current].buffer : 0;
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(E.watch.fd, events, sizeof(events))) > 0)
+    {
+        for (char* p = events; p < events + n;)
+        {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            for (int b = 0; b < nbuffers && ev->len; ++b)
+            {
+                struct Disk* disk = (b == current) ? &E.disk : &E.win.buffers[b].disk;
+                const char* name = (b == current) ? E.filename : E.win.buffers[b].filename;
+                const char* base = name ? strrchr(name, '/') : NULL;
+                base = base ? base + 1 : name;
+                if (name && disk->wd == ev->wd && !strcmp(base, ev->name))
+                {
+                    disk->changed = 1;
+                    E.watch.changed = 1;
+                }
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+
+}
+
+/* Reloads the buffers EditorWatchRead marked. Called between commands. */
+void EditorWatchApply()
+{
+    if (!E.watch.changed)
+    {
+        return;
+    }
+    E.watch.changed = 0;
+    int nbuffers = E.win.nviews ? E.win.nbuffers : 1;
+    int current = E.win.nviews ? E.win.views[E.win.current].buffer : 0;
+    for (int b = 0; b < nbuffers; ++b)
+    {
+        struct Disk* disk = (b == current) ? &E.disk : &E.win.buffers[b].disk;
+        if (disk->changed)
+        {
+            disk->changed = 0;
+            EditorWithBuffer(b, EditorReloadChanged);
+        }
+    }
+}
+
+/* Appends the paths to the back of q. */
+void GrepPush(struct GrepQueue* q, struct GrepPath* paths, int n)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->head + q->count + n > q->cap)
+    {
+        if (q->count > 0)
+        {
+            memmove(q->paths, &q->paths[q->head], sizeof(struct GrepPath) * q->count);
+        }
+        q->head = 0;
+        while (q->count + n > q->cap)
+        {
+            q->cap = q->cap ? q->cap * 2 : 64;
+        }
+        q->paths = (struct GrepPath*)realloc(q->paths, sizeof(struct GrepPath) * q->cap);
+    }
+    memcpy(&q->paths[q->head + q->count], paths, sizeof(struct GrepPath) * n);
+    q->count += n;
+    pthread_mutex_unlock(&q->lock);
+
+    struct Grep* g = &E.grep;
+    pthread_mutex_lock(&g->lock);
+    g->pending += n;
+    g->work += 1;
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->lock);
+}
+
+/* Takes a path from the back of q (its owner, depth first) or the front (a
+ * thief, taking the oldest and so usually the largest piece of work). */
+int GrepTake(struct GrepQueue* q, int back, struct GrepPath* path)
+{
+    pthread_mutex_lock(&q->lock);
+    int found = q->count > 0;
+    if (found)
+    {
+        *path = back ? q->paths[q->head + q->count - 1] : q->paths[q->head++];
+        q->count -= 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+/* The first occurrence of the literal pat in p..end. With SSE2, 16 places
+ * at a time are checked for its first and last byte before comparing. */
+const char* GrepLiteral(const char* p, const char* end, const char* pat, int len)
+{
+#ifdef __SSE2__
+    if (len > 1)
+    {
+        __m128i first = _mm_set1_epi8(pat[0]);
+        __m128i last = _mm_set1_epi8(pat[len - 1]);
+        for (; end - p >= len - 1 + 16; p += 16)
+        {
+            __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), first);
+            __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + len - 1)), last);
+            int mask = _mm_movemask_epi8(_mm_and_si128(a, b));
+            for (; mask; mask &= mask - 1)
+            {
+                int i = __builtin_ctz(mask);
+                if (!memcmp(p + i + 1, pat + 1, len - 2))
+                {
+                    return p + i;
+                }
+            }
+        }
+    }
+#endif
+    return (const char*)memmem(p, end - p, pat, len);
+}
+
+/* re is the caller's copy of the compiled pattern: regexec locks the
+ * regex_t it is given, so workers sharing one would take turns. */
+const char* GrepMatch(const regex_t* re, const char* map, const char* p, const char* end)
+{
+    struct Grep* g = &E.grep;
+    if (!g->regex)
+    {
+        return GrepLiteral(p, end, g->pattern, g->len);
+    }
+    regmatch_t m;
+    m.rm_so = p - map;
+    m.rm_eo = end - map;
+    return regexec(re, map, 1, &m, REG_STARTEND) == 0 ? map + m.rm_so : NULL;
+}
+
+int GrepCancelled()
+{
+    struct Grep* g = &E.grep;
+    pthread_mutex_lock(&g->lock);
+    int cancel = g->cancel;
+    pthread_mutex_unlock(&g->lock);
+    return cancel;
+}
+
+/* Scans one file through mmap, appending a path:line:text line per line with
+ * a hit to out. Files with a NUL near the start are taken as binary. Big
+ * files are searched KILO_GREP_WINDOW at a time, ending on a line, so that a
+ * cancelled search does not run on to the end of one. */
+int GrepFile(const char* path, struct ABuf* out, const regex_t* re)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+    const char* map = (const char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return 0;
+    }
+    madvise((void*)map, st.st_size, MADV_SEQUENTIAL);
+
+    const char* end = map + st.st_size;
+    int hits = 0;
+    if (memchr(map, '\0', st.st_size < 4096 ? st.st_size : 4096) == NULL)
+    {
+        long long line = 1;
+        const char* counted = map;
+        const char* window = map;
+        for (const char* p = map; p < end;)
+        {
+            if (p >= window)
+            {
+                if (p > map && GrepCancelled())
+                {
+                    break;
+                }
+                window = ScanNewline(end - p > KILO_GREP_WINDOW ? p + KILO_GREP_WINDOW : end, end);
+                window = window < end ? window + 1 : end;
+            }
+            const char* hit = GrepMatch(re, map, p, window);
+            if (hit == NULL)
+            {
+                p = window;
+                continue;
+            }
+            const char* start = (const char*)memrchr(p, '\n', hit - p);
+            start = start ? start + 1 : p;
+            const char* nl = ScanNewline(hit, end);
+            line += CountNewlines(counted, start);
+            counted = start;
+
+            char head[32];
+            int textlen = nl - start;
+            while (textlen > 0 && start[textlen - 1] == '\r')
+            {
+                textlen -= 1;
+            }
+            AbAppend(out, path, strlen(path));
+            AbAppend(out, head, snprintf(head, sizeof(head), ":%lld:", line));
+            AbAppend(out, start, textlen < KILO_GREP_TEXT ? textlen : KILO_GREP_TEXT);
+            AbAppend(out, "\n", 1);
+            hits += 1;
+            p = nl + 1;
+        }
+    }
+    munmap((void*)map, st.st_size);
+    return hits;
+}
+
+/* Reads a directory, queueing its entries. Hidden entries and symlinks are
+ * left out. */
+void GrepDir(const char* path, struct GrepQueue* q)
+{
+    DIR* d = opendir(path);
+    if (d == NULL)
+    {
+        return;
+    }
+    struct GrepPath* found = NULL;
+    int n = 0;
+    int cap = 0;
+    struct dirent* ent;
+    while ((ent = readdir(d)) != NULL)
+    {
+        if (ent->d_name[0] == '.')
+        {
+            continue;
+        }
+        char* child;
+        if (!strcmp(path, "."))
+        {
+            child = strdup(ent->d_name);
+        }
+        else if (asprintf(&child, "%s/%s", path, ent->d_name) == -1)
+        {
+            continue;
+        }
+
+        int type = ent->d_type;
+        struct stat st;
+        if (type == DT_UNKNOWN && lstat(child, &st) == 0)
+        {
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type != DT_DIR && type != DT_REG)
+        {
+            free(child);
+            continue;
+        }
+        if (n == cap)
+        {
+            cap = cap ? cap * 2 : 32;
+            found = (struct GrepPath*)realloc(found, sizeof(struct GrepPath) * cap);
+        }
+        found[n].path = child;
+        found[n].dir = (type == DT_DIR);
+        n += 1;
+    }
+    closedir(d);
+    if (n > 0)
+    {
+        GrepPush(q, found, n);
+    }
+    free(found);
+}
+
+void* GrepWorker(void* arg)
+{
+    struct Grep* g = &E.grep;
+    int self = (int)(long)arg;
+    struct ABuf out = ABUF_INIT;
+    /* a pattern that compiled once compiles again */
+    regex_t re;
+    if (g->regex)
+    {
+        regcomp(&re, g->pattern, REG_EXTENDED | REG_NEWLINE);
+    }
+    while (1)
+    {
+        pthread_mutex_lock(&g->lock);
+        long long work = g->work;
+        int stop = g->cancel || g->pending == 0;
+        pthread_mutex_unlock(&g->lock);
+        if (stop)
+        {
+            break;
+        }
+
+        struct GrepPath path;
+        int found = GrepTake(&g->queues[self], 1, &path);
+        for (int i = 1; !found && i < g->nthreads; ++i)
+        {
+            found = GrepTake(&g->queues[(self + i) % g->nthreads], 0, &path);
+        }
+        if (!found)
+        {
+            /* others are still reading directories that may yield more */
+            pthread_mutex_lock(&g->lock);
+            while (g->work == work && g->pending > 0 && !g->cancel)
+            {
+                pthread_cond_wait(&g->cond, &g->lock);
+            }
+            pthread_mutex_unlock(&g->lock);
+            continue;
+        }
+
+        int hits = 0;
+        if (path.dir)
+        {
+            GrepDir(path.path, &g->queues[self]);
+        }
+        else
+        {
+            out.len = 0;
+            hits = GrepFile(path.path, &out, &re);
+        }
+        free(path.path);
+
+        pthread_mutex_lock(&g->lock);
+        if (hits > 0)
+        {
+            if (g->outlen + out.len > g->outcap)
+            {
+                g->outcap = (g->outlen + out.len) * 2;
+                g->out = (char*)realloc(g->out, g->outcap);
+            }
+            memcpy(&g->out[g->outlen], out.b, out.len);
+            g->outlen += out.len;
+            g->hits += hits;
+            if (g->hits >= KILO_GREP_HITS)
+            {
+                g->cancel = 1;
+                pthread_cond_broadcast(&g->cond);
+            }
+        }
+        g->files += !path.dir;
+        g->pending -= 1;
+        if (g->pending == 0)
+        {
+            pthread_cond_broadcast(&g->cond);
+        }
+        int wake = (hits > 0 || g->pending == 0) && !g->woken;
+        g->woken |= wake;
+        pthread_mutex_unlock(&g->lock);
+        if (wake)
+        {
+            write(g->wake[1], "g", 1);
+        }
+    }
+    AbFree(&out);
+    if (g->regex)
+    {
+        regfree(&re);
+    }
+
+    pthread_mutex_lock(&g->lock);
+    g->exited += 1;
+    int last = (g->exited == g->nthreads);
+    pthread_mutex_unlock(&g->lock);
+    if (last)
+    {
+        write(g->wake[1], "g", 1);
+    }
+    return NULL;
+}
+
+/* Stops a search still running and drops what it queued. */
+void EditorGrepStop()
+{
+    struct Grep* g = &E.grep;
+    if (!g->running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&g->lock);
+    g->cancel = 1;
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->lock);
+    for (int i = 0; i < g->nthreads; ++i)
+    {
+        pthread_join(g->threads[i], NULL);
+        struct GrepQueue* q = &g->queues[i];
+        for (int k = 0; k < q->count; ++k)
+        {
+            free(q->paths[q->head + k].path);
+        }
+        q->head = 0;
+        q->count = 0;
+    }
+    g->running = 0;
+}
+
+/* Starts searching the files under root for pattern, a POSIX extended
+ * regex if regex is set, else a literal. Returns -1 if it can't start. */
+int EditorGrepStart(const char* root, const char* pattern, int regex)
+{
+    struct Grep* g = &E.grep;
+    EditorGrepStop();
+    if (g->wake[0] == -1)
+    {
+        if (pipe2(g->wake, O_CLOEXEC | O_NONBLOCK) == -1)
+        {
+            return -1;
+        }
+        pthread_mutex_init(&g->lock, NULL);
+        pthread_cond_init(&g->cond, NULL);
+        for (int i = 0; i < KILO_LOAD_THREADS; ++i)
+        {
+            pthread_mutex_init(&g->queues[i].lock, NULL);
+        }
+    }
+
+    /* the last pattern stays compiled for opening its hits */
+    if (g->regex)
+    {
+        regfree(&g->re);
+        g->regex = 0;
+    }
+    if (regex)
+    {
+        int err = regcomp(&g->re, pattern, REG_EXTENDED | REG_NEWLINE);
+        if (err != 0)
+        {
+            char msg[64];
+            regerror(err, &g->re, msg, sizeof(msg));
+            EditorSetStatusMessage("Bad regex: %s", msg);
+            return -1;
+        }
+    }
+    free(g->pattern);
+    g->pattern = strdup(pattern);
+    g->len = strlen(pattern);
+    g->regex = regex;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    g->nthreads = cpus < 1 ? 1 : cpus > KILO_LOAD_THREADS ? KILO_LOAD_THREADS : cpus;
+    g->pending = 0;
+    g->work = 0;
+    g->cancel = 0;
+    g->exited = 0;
+    g->woken = 0;
+    g->outlen = 0;
+    g->hits = 0;
+    g->files = 0;
+    g->start = NowNs();
+    struct GrepPath first = {strdup(root), 1};
+    GrepPush(&g->queues[0], &first, 1);
+
+    int started = 0;
+    for (; started < g->nthreads; ++started)
+    {
+        if (pthread_create(&g->threads[started], NULL, GrepWorker, (void*)(long)started) != 0)
+        {
+            break;
+        }
+    }
+    if (started == 0)
+    {
+        free(first.path);
+        g->queues[0].count = 0;
+        return -1;
+    }
+    g->nthreads = started;
+    g->running = 1;
+    return 0;
+}
+
+/* The text GrepAppend adds to the results buffer. */
+const char* grep_chunk;
+int grep_chunklen;
+
+void GrepAppend()
+{
+    int n = CountNewlines(grep_chunk, grep_chunk + grep_chunklen);
+    const char** lines = (const char**)malloc(sizeof(char*) * n);
+    int* lens = (int*)malloc(sizeof(int) * n);
+    const char* p = grep_chunk;
+    for (int i = 0; i < n; ++i)
+    {
+        const char* nl = ScanNewline(p, grep_chunk + grep_chunklen);
+        lines[i] = p;
+        lens[i] = nl - p;
+        p = nl + 1;
+    }
+    char dirty = E.dirty;
+    E.undo.paused = 1;
+    EditorInsertRows(E.numrows, n, lines, lens, NULL);
+    E.undo.paused = 0;
+    E.dirty = dirty;
+    free(lines);
+    free(lens);
+}
+
+/* Empties the results buffer for a new search. */
+void GrepClear()
+{
+    E.undo.paused = 1;
+    EditorDelRows(0, E.numrows);
+    E.undo.paused = 0;
+    E.dirty = 0;
+    E.cx = 0;
+    E.cy = 0;
+}
+
+/* Moves the hits found so far into the results buffer, between keys. */
+void EditorGrepRead()
+{
+    struct Grep* g = &E.grep;
+    char drain[64];
+    while (read(g->wake[0], drain, sizeof(drain)) > 0)
+    {
+    }
+
+    pthread_mutex_lock(&g->lock);
+    char* out = g->out;
+    int outlen = g->outlen;
+    g->out = NULL;
+    g->outlen = 0;
+    g->outcap = 0;
+    g->woken = 0;
+    long long hits = g->hits;
+    long long files = g->files;
+    int done = (g->exited == g->nthreads);
+    pthread_mutex_unlock(&g->lock);
+
+    if (outlen > 0)
+    {
+        grep_chunk = out;
+        grep_chunklen = outlen;
+        EditorWithBuffer(g->buffer, GrepAppend);
+    }
+    free(out);
+
+    if (done && g->running)
+    {
+        int capped = g->cancel;
+        EditorGrepStop();
+        EditorSetStatusMessage("%s: %lld hits in %lld files, %.2fs%s", g->pattern, hits, files,
+                               (NowNs() - g->start) / 1e9, capped ? " (stopped)" : "");
+    }
+    else if (g->running)
+    {
+        EditorSetStatusMessage("%s: %lld hits in %lld files...", g->pattern, hits, files);
+    }
+}
+
+/* Waits for the search to finish, for the tools that run the editor
+ * headless. */
+void EditorGrepWait()
+{
+    while (E.grep.running)
+    {
+        struct pollfd fd = {E.grep.wake[0], POLLIN, 0};
+        poll(&fd, 1, -1);
+        EditorGrepRead();
+    }
+}
+
+int EditorGrepResults()
+{
+    return E.win.nviews && E.grep.buffer != -1 && E.win.views[E.win.current].buffer == E.grep.buffer;
+}
+
+/* CTRL-X g (literal) or G (regex): searches the files under the current
+ * directory, showing the hits in the results buffer as they come in. */
+void EditorGrep(int regex)
+{
+    char* pattern = EditorPrompt(regex ? "Grep regex: %s" : "Grep: %s", NULL);
+    if (pattern == NULL)
+    {
+        return;
+    }
+    if (pattern[0] == '\0')
+    {
+        free(pattern);
+        return;
+    }
+
+    EditorWindowsInit();
+    if (E.grep.buffer == -1)
+    {
+        BufferSave(&E.win.buffers[E.win.views[E.win.current].buffer]);
+        E.grep.buffer = EditorNewBuffer();
+    }
+    if (!EditorGrepResults())
+    {
+        EditorShowBuffer(E.grep.buffer);
+    }
+    EditorGrepStop();
+    GrepClear();
+
+    if (EditorGrepStart(".", pattern, regex) == 0)
+    {
+        EditorSetStatusMessage("%s: searching...", pattern);
+    }
+    free(pattern);
+}
+
+/* ENTER in the results buffer: opens the file of the hit on the cursor's
+ * line at the hit. */
+void EditorGrepOpen()
+{
+    if (E.cy >= E.numrows)
+    {
+        return;
+    }
+    ERow* row = &E.row[E.cy];
+    char* s = row->chars;
+    int line = 0;
+    int at = 0;
+    for (; at < row->size; ++at)
+    {
+        if (s[at] != ':')
+        {
+            continue;
+        }
+        int i = at + 1;
+        line = 0;
+        while (i < row->size && isdigit((unsigned char)s[i]))
+        {
+            line = line * 10 + (s[i++] - '0');
+        }
+        if (i > at + 1 && i < row->size && s[i] == ':')
+        {
+            break;
+        }
+    }
+    if (at == row->size || line == 0)
+    {
+        return;
+    }
+
+    char* path = strndup(s, at);
+    int opened = EditorOpenFile(path);
+    free(path);
+    if (opened == -1)
+    {
+        return;
+    }
+    E.cy = line - 1 < E.numrows ? line - 1 : E.numrows;
+    E.cx = 0;
+    if (E.cy < E.numrows)
+    {
+        ERow* hit = EditorRowAt(E.cy);
+        const char* p = GrepMatch(&E.grep.re, hit->chars, hit->chars, hit->chars + hit->size);
+        E.cx = p ? p - hit->chars : 0;
+    }
+    EditorFoldReveal(E.cy);
+}
+
+/* Line commands (CTRL-X s, u, k, v) work on the rows of the column block, or
+ * on the whole buffer without one. They reorder and drop the ERow structs
+ * themselves, so a row keeps its chars, render and highlighting wherever it
+ * lands and no text is copied. */
+void LinesRange(int* lo, int* n)
+{
+    *lo = 0;
+    *n = E.numrows;
+    if (E.cursors.block && E.numrows > 0)
+    {
+        int top, bottom, x0, x1;
+        EditorBlockBounds(&top, &bottom, &x0, &x1);
+        *lo = top;
+        *n = bottom - top + 1;
+    }
+    EditorCursorsClear();
+}
+
+/* Byte order, shorter first on a tie, then row order so equal lines keep
+ * theirs. */
+int LinesCompare(const void* a, const void* b)
+{
+    int x = *(const int*)a;
+    int y = *(const int*)b;
+    const ERow* r = &E.row[x];
+    const ERow* s = &E.row[y];
+    int c = memcmp(r->chars, s->chars, r->size < s->size ? r->size : s->size);
+    if (c == 0)
+    {
+        c = (r->size > s->size) - (r->size < s->size);
+    }
+    return c ? c : (x > y) - (x < y);
+}
+
+/* Rows src[lo, hi) of a merge sort pass: sorted in place on the first, and
+ * after that the sorted halves [lo, mid) and [mid, hi) merged into dst. */
+struct SortJob
+{
+    int* src;
+    int* dst;
+    int lo;
+    int mid;
+    int hi;
+};
+
+void* SortRun(void* arg)
+{
+    struct SortJob* j = (struct SortJob*)arg;
+    qsort(&j->src[j->lo], j->hi - j->lo, sizeof(int), LinesCompare);
+    return NULL;
+}
+
+void* SortMerge(void* arg)
+{
+    struct SortJob* j = (struct SortJob*)arg;
+    int a = j->lo;
+    int b = j->mid;
+    int out = j->lo;
+    while (a < j->mid && b < j->hi)
+    {
+        j->dst[out++] = (LinesCompare(&j->src[b], &j->src[a]) < 0) ? j->src[b++] : j->src[a++];
+    }
+    memcpy(&j->dst[out], &j->src[a], sizeof(int) * (j->mid - a));
+    out += j->mid - a;
+    memcpy(&j->dst[out], &j->src[b], sizeof(int) * (j->hi - b));
+    return NULL;
+}
+
+/* Sorts the n row numbers in idx: a run per thread sorted with qsort, then
+ * pairs of runs merged on as many threads as there are pairs until one is
+ * left. Returns whichever of idx and tmp holds the result. */
+int* SortRows(int* idx, int* tmp, int n)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int runs = n / KILO_SORT_PARALLEL + 1;
+    if (runs > cpus)
+    {
+        runs = cpus > 0 ? cpus : 1;
+    }
+    if (runs > KILO_LOAD_THREADS)
+    {
+        runs = KILO_LOAD_THREADS;
+    }
+
+    struct SortJob jobs[KILO_LOAD_THREADS];
+    for (int r = 0; r < runs; ++r)
+    {
+        jobs[r] = (struct SortJob){idx, tmp, (int)((long long)n * r / runs), 0, (int)((long long)n * (r + 1) / runs)};
+    }
+    EditorParallel(jobs, sizeof(struct SortJob), runs, SortRun);
+
+    int* src = idx;
+    int* dst = tmp;
+    for (int width = 1; width < runs; width *= 2)
+    {
+        int m = 0;
+        for (int r = 0; r < runs; r += 2 * width)
+        {
+            int mid = r + width < runs ? r + width : runs;
+            int hi = r + 2 * width < runs ? r + 2 * width : runs;
+            jobs[m++] = (struct SortJob){src, dst, (int)((long long)n * r / runs), (int)((long long)n * mid / runs),
+                                         (int)((long long)n * hi / runs)};
+        }
+        EditorParallel(jobs, sizeof(struct SortJob), m, SortMerge);
+        int* t = src;
+        src = dst;
+        dst = t;
+    }
+    return src;
+}
+
+/* Rows first to first + n - 1 for a thread: hashed for EditorUniqueLines, or
+ * matched against the pattern, compiled per thread, for EditorFilterLines. */
+struct LinesChunk
+{
+    int first;
+    int n;
+    unsigned long long* hash;
+    char* keep;
+    const char* pattern;
+    int invert;
+};
+
+void* LinesHash(void* arg)
+{
+    struct LinesChunk* c = (struct LinesChunk*)arg;
+    for (int i = 0; i < c->n; ++i)
+    {
+        const ERow* row = &E.row[c->first + i];
+        c->hash[i] = LineHash(row->chars, row->size);
+    }
+    return NULL;
+}
+
+void* LinesMatch(void* arg)
+{
+    struct LinesChunk* c = (struct LinesChunk*)arg;
+    regex_t re;
+    if (regcomp(&re, c->pattern, REG_EXTENDED | REG_NOSUB) != 0)
+    {
+        memset(c->keep, 1, c->n);
+        return NULL;
+    }
+    for (int i = 0; i < c->n; ++i)
+    {
+        c->keep[i] = (regexec(&re, E.row[c->first + i].chars, 0, NULL, 0) == 0) != c->invert;
+    }
+    regfree(&re);
+    return NULL;
+}
+
+/* Splits rows lo to lo + n - 1 into a chunk per thread and runs work on them. */
+void LinesParallel(struct LinesChunk* proto, int lo, int n, void* (*work)(void*))
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nchunks = n / KILO_SORT_PARALLEL + 1;
+    if (nchunks > cpus)
+    {
+        nchunks = cpus > 0 ? cpus : 1;
+    }
+    if (nchunks > KILO_LOAD_THREADS)
+    {
+        nchunks = KILO_LOAD_THREADS;
+    }
+    struct LinesChunk chunks[KILO_LOAD_THREADS];
+    for (int c = 0, first = 0; c < nchunks; ++c)
+    {
+        int last = (long long)n * (c + 1) / nchunks;
+        chunks[c] = *proto;
+        chunks[c].first = lo + first;
+        chunks[c].n = last - first;
+        chunks[c].hash = proto->hash ? proto->hash + first : NULL;
+        chunks[c].keep = proto->keep ? proto->keep + first : NULL;
+        first = last;
+    }
+    EditorParallel(chunks, sizeof(struct LinesChunk), nchunks, work);
+}
+
+/* Replaces rows lo to lo + n - 1 with the kept rows listed in order, as one
+ * undo step. Rows left out of order are freed. A row is highlighted again
+ * only if the row now above it ends in a different comment state than the
+ * one that was, carrying any change on down as EditorUpdateRow would. */
+void LinesApply(int lo, int n, const int* order, int kept)
+{
+    if (n == 0)
+    {
+        return;
+    }
+    EditorUndoSeal();
+    if (!E.undo.paused)
+    {
+        const char** lines = (const char**)malloc(sizeof(char*) * (n + 1));
+        int* lens = (int*)malloc(sizeof(int) * (n + 1));
+        unsigned char* eols = (unsigned char*)malloc(n + 1);
+        for (int i = 0; i < n; ++i)
+        {
+            lines[i] = E.row[lo + i].chars;
+            lens[i] = E.row[lo + i].size;
+            eols[i] = E.row[lo + i].eol;
+        }
+        EditorUndoRows(UNDO_DELETE_ROWS, lo, n, lines, lens, eols);
+        for (int i = 0; i < kept; ++i)
+        {
+            lines[i] = E.row[order[i]].chars;
+            lens[i] = E.row[order[i]].size;
+            eols[i] = E.row[order[i]].eol;
+        }
+        EditorUndoRows(UNDO_INSERT_ROWS, lo, kept, lines, lens, eols);
+        free(lines);
+        free(lens);
+        free(eols);
+    }
+
+    ERow* rows = (ERow*)malloc(sizeof(ERow) * (kept + 1));
+    unsigned char* in = (unsigned char*)malloc(kept + 1);
+    char* gone = (char*)malloc(n);
+    memset(gone, 1, n);
+    for (int i = 0; i < kept; ++i)
+    {
+        rows[i] = E.row[order[i]];
+        in[i] = order[i] > 0 ? E.row[order[i] - 1].hl_open_comment : 0;
+        gone[order[i] - lo] = 0;
+    }
+    int after = (lo + n < E.numrows) ? E.row[lo + n - 1].hl_open_comment : 0;
+    for (int i = 0; i < n; ++i)
+    {
+        if (gone[i])
+        {
+            EditorWordsRow(&E.row[lo + i], -1);
+            EditorFreeRow(&E.row[lo + i]);
+        }
+    }
+    memcpy(&E.row[lo], rows, sizeof(ERow) * kept);
+    memmove(&E.row[lo + kept], &E.row[lo + n], sizeof(ERow) * (E.numrows - lo - n));
+    E.numrows -= n - kept;
+
+    for (int i = 0; i < kept; ++i)
+    {
+        ERow* row = &E.row[lo + i];
+        if ((lo + i > 0 ? E.row[lo + i - 1].hl_open_comment : 0) != in[i])
+        {
+            if (!(row->cache & ROW_CACHED))
+            {
+                EditorRowBuildRender(row);
+            }
+            EditorUpdateSyntax(row);
+        }
+    }
+    if (lo + kept < E.numrows && (lo + kept > 0 ? E.row[lo + kept - 1].hl_open_comment : 0) != after)
+    {
+        EditorUpdateRow(&E.row[lo + kept]);
+    }
+    EditorCacheTrim();
+    free(rows);
+    free(in);
+    free(gone);
+
+    int folds = 0;
+    for (int f = 0; f < E.folds.count; ++f)
+    {
+        struct Fold fold = E.folds.ranges[f];
+        if (fold.end < lo || fold.start >= lo + n)
+        {
+            if (fold.start >= lo + n)
+            {
+                fold.start -= n - kept;
+                fold.end -= n - kept;
+            }
+            E.folds.ranges[folds++] = fold;
+        }
+    }
+    E.folds.count = folds;
+    E.offsets.valid = 0;
+    E.wrap.lines.valid = 0;
+    E.brackets.valid = 0;
+    E.dirty = 1;
+
+    E.cy = lo < E.numrows ? lo : E.numrows;
+    E.cx = 0;
+    E.wrap.sub = 0;
+    for (int v = 0; v < E.win.nviews; ++v)
+    {
+        struct View* view = &E.win.views[v];
+        if (v != E.win.current && view->buffer == E.win.views[E.win.current].buffer && view->cy > E.numrows)
+        {
+            view->cy = E.numrows;
+            view->cx = 0;
+        }
+    }
+    EditorUndoSeal();
+}
+
+/* CTRL-X s: sorts the lines by their bytes. */
+void EditorSortLines()
+{
+    if (EditorReadOnly())
+    {
+        return;
+    }
+    int lo, n;
+    LinesRange(&lo, &n);
+    EditorHighlightFlush();
+
+    long long t = NowNs();
+    int* idx = (int*)malloc(sizeof(int) * (n + 1));
+    int* tmp = (int*)malloc(sizeof(int) * (n + 1));
+    for (int i = 0; i < n; ++i)
+    {
+        idx[i] = lo + i;
+    }
+    int* order = SortRows(idx, tmp, n);
+    LinesApply(lo, n, order, n);
+    free(idx);
+    free(tmp);
+    EditorSetStatusMessage("Sorted %d lines in %.2fs", n, (NowNs() - t) / 1e9);
+}
+
+/* CTRL-X u: drops every line equal to one above it, keeping the first. */
+void EditorUniqueLines()
+{
+    if (EditorReadOnly())
+    {
+        return;
+    }
+    int lo, n;
+    LinesRange(&lo, &n);
+    EditorHighlightFlush();
+
+    long long t = NowNs();
+    struct LinesChunk proto = {0};
+    proto.hash = (unsigned long long*)malloc(sizeof(unsigned long long) * (n + 1));
+    LinesParallel(&proto, lo, n, LinesHash);
+
+    unsigned int mask = 15;
+    while (mask < 2u * n)
+    {
+        mask = mask * 2 + 1;
+    }
+    int* slots = (int*)malloc(sizeof(int) * (mask + 1));
+    memset(slots, -1, sizeof(int) * (mask + 1));
+    int* order = (int*)malloc(sizeof(int) * (n + 1));
+    int kept = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        const ERow* row = &E.row[lo + i];
+        unsigned int s = proto.hash[i] & mask;
+        for (; slots[s] != -1; s = (s + 1) & mask)
+        {
+            const ERow* seen = &E.row[lo + slots[s]];
+            if (proto.hash[slots[s]] == proto.hash[i] && seen->size == row->size &&
+                !memcmp(seen->chars, row->chars, row->size))
+            {
+                break;
+            }
+        }
+        if (slots[s] == -1)
+        {
+            slots[s] = i;
+            order[kept++] = lo + i;
+        }
+    }
+    LinesApply(lo, n, order, kept);
+    free(proto.hash);
+    free(slots);
+    free(order);
+    EditorSetStatusMessage("Removed %d duplicate lines in %.2fs", n - kept, (NowNs() - t) / 1e9);
+}
+
+/* Keeps the lines in range matching pattern, a valid POSIX extended regex,
+ * or with invert set the ones not matching it. */
+void LinesFilter(const char* pattern, int invert)
+{
+    int lo, n;
+    LinesRange(&lo, &n);
+    EditorHighlightFlush();
+
+    long long t = NowNs();
+    struct LinesChunk proto = {0};
+    proto.keep = (char*)malloc(n + 1);
+    proto.pattern = pattern;
+    proto.invert = invert;
+    LinesParallel(&proto, lo, n, LinesMatch);
+
+    int* order = (int*)malloc(sizeof(int) * (n + 1));
+    int kept = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        if (proto.keep[i])
+        {
+            order[kept++] = lo + i;
+        }
+    }
+    LinesApply(lo, n, order, kept);
+    free(proto.keep);
+    free(order);
+    EditorSetStatusMessage("Removed %d lines in %.2fs", n - kept, (NowNs() - t) / 1e9);
+}
+
+/* CTRL-X k keeps only the lines matching a POSIX extended regex, CTRL-X v
+ * drops them. */
+void EditorFilterLines(int invert)
+{
+    if (EditorReadOnly())
+    {
+        return;
+    }
+    char* pattern = EditorPrompt(invert ? "Drop lines matching: %s" : "Keep lines matching: %s", NULL);
+    if (pattern == NULL)
+    {
+        return;
+    }
+    regex_t re;
+    int err = regcomp(&re, pattern, REG_EXTENDED | REG_NOSUB);
+    if (err != 0)
+    {
+        char msg[64];
+        regerror(err, &re, msg, sizeof(msg));
+        EditorSetStatusMessage("Bad regex: %s", msg);
+    }
+    else
+    {
+        regfree(&re);
+        LinesFilter(pattern, invert);
+    }
+    free(pattern);
+}
+
+/* Blocks until a key is ready, appending streamed input and reloading
+ * changed files, and redrawing, as they arrive in the meantime. */
+void EditorStreamWait()
+{
+    /* a server polls the stream along with its clients */
+    while ((E.stream.fd != -1 || E.watch.fd != -1 || E.grep.wake[0] != -1) && E.server.fd == -1 &&
+           E.input.at == E.input.len)
+    {
+        struct pollfd fds[4] = {{E.ifd, POLLIN, 0}, {E.stream.fd, POLLIN, 0}, {E.watch.fd, POLLIN, 0},
+                                {E.grep.wake[0], POLLIN, 0}};
+        if (poll(fds, 4, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            Die("poll");
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            return;
+        }
+        if (fds[1].revents)
+        {
+            EditorStreamReadBuffer();
+            EditorRefreshScreen();
+        }
+        if (fds[2].revents)
+        {
+            EditorWatchRead();
+            EditorWatchApply();
+            EditorRefreshScreen();
+        }
+        if (fds[3].revents)
+        {
+            EditorGrepRead();
+            EditorRefreshScreen();
+        }
+    }
+}
+
+int WriteAll(int fd, const char* s, int len)
+{
+    while (len > 0)
+    {
+        int n = send(fd, s, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == ENOTSOCK)
+        {
+            n = write(fd, s, len);
+        }
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        s += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int MessageSend(int fd, char type, const char* payload, int len)
+{
+    char msg[2 + 255];
+    msg[0] = type;
+    msg[1] = len;
+    memcpy(&msg[2], payload, len);
+    return WriteAll(fd, msg, len + 2);
+}
+
+/* KILO_SOCKET, or kilo.sock in $XDG_RUNTIME_DIR or else in a /tmp/kilo-<uid>
+ * directory made for it. The directory has to belong to this user and be
+ * closed to everyone else, or another user could stand in for the server;
+ * NULL with a message on stderr if it is not. */
+const char* ServerPath()
+{
+    static char path[108];
+    char* env = getenv("KILO_SOCKET");
+    if (env)
+    {
+        snprintf(path, sizeof(path), "%s", env);
+        return path;
+    }
+
+    char dir[64];
+    char* runtime = getenv("XDG_RUNTIME_DIR");
+    if (runtime && runtime[0] && strlen(runtime) + sizeof("/kilo.sock") <= sizeof(path))
+    {
+        snprintf(path, sizeof(path), "%s/kilo.sock", runtime);
+        dir[0] = '\0';
+    }
+    else
+    {
+        snprintf(dir, sizeof(dir), "/tmp/kilo-%d", (int)getuid());
+        snprintf(path, sizeof(path), "%s/kilo.sock", dir);
+        mkdir(dir, 0700);
+    }
+
+    struct stat st;
+    const char* check = dir[0] ? dir : runtime;
+    if (lstat(check, &st) == -1 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077))
+    {
+        fprintf(stderr, "kilo: %s is not a private directory of this user\n", check);
+        return NULL;
+    }
+    return path;
+}
+
+/* Whether the other end of a Unix socket runs as this user. */
+int ServerPeerIsUser(int fd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+void ServerAddress(struct sockaddr_un* addr, const char* path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", path);
+}
+
+/* Sizes the session to the smallest attached client. */
+void ServerResize()
+{
+    int rows = 0;
+    int cols = 0;
+    for (int i = 0; i < E.server.nclients; ++i)
+    {
+        struct ServerClient* c = &E.server.clients[i];
+        if (c->rows >= 3 && c->cols >= 1)
+        {
+            rows = (rows == 0 || c->rows < rows) ? c->rows : rows;
+            cols = (cols == 0 || c->cols < cols) ? c->cols : cols;
+        }
+    }
+
+    int current = E.win.nviews ? E.win.rows + 1 : E.screenrows + 2;
+    if (rows && (rows != current || cols != E.screencols))
+    {
+        EditorResize(rows, cols);
+        EditorWrite("\x1b[2J", 4);
+    }
+}
+
+void ServerDrop(int i)
+{
+    close(E.server.clients[i].fd);
+    free(E.server.clients[i].out);
+    E.server.clients[i] = E.server.clients[--E.server.nclients];
+    if (E.server.from == i)
+    {
+        E.server.from = -1;
+        E.server.npending = E.server.at = 0;
+    }
+    else if (E.server.from == E.server.nclients)
+    {
+        E.server.from = i;
+    }
+    ServerResize();
+}
+
+/* CTRL-X d: detaches the client that sent it, leaving the session running. */
+void ServerDetach()
+{
+    if (E.server.fd == -1 || E.server.from == -1)
+    {
+        EditorSetStatusMessage("Not attached to a kilo server");
+        return;
+    }
+    struct ServerClient* c = &E.server.clients[E.server.from];
+    if (c->outlen == 0)
+    {
+        send(c->fd, "\x1b[2J\x1b[H", 7, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+    ServerDrop(E.server.from);
+}
+
+/* Writes what client i's socket takes of its backlog. Returns -1 if the
+ * client is gone. */
+int ServerFlush(int i)
+{
+    struct ServerClient* c = &E.server.clients[i];
+    int done = 0;
+    while (done < c->outlen)
+    {
+        int n = send(c->fd, c->out + done, c->outlen - done, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        done += n;
+    }
+    memmove(c->out, c->out + done, c->outlen - done);
+    c->outlen -= done;
+    return 0;
+}
+
+/* Queues output for client i and sends what the socket takes now. A client
+ * that lets more than KILO_SERVER_BACKLOG pile up, stopped or on a dead
+ * link, is dropped rather than holding up the others. */
+void ServerSend(int i, const char* s, int len)
+{
+    struct ServerClient* c = &E.server.clients[i];
+    if (c->outlen + len > KILO_SERVER_BACKLOG)
+    {
+        ServerDrop(i);
+        return;
+    }
+    if (c->outlen + len > c->outcap)
+    {
+        c->outcap = (c->outlen + len) * 2;
+        c->out = (char*)realloc(c->out, c->outcap);
+    }
+    memcpy(c->out + c->outlen, s, len);
+    c->outlen += len;
+    if (ServerFlush(i) == -1)
+    {
+        ServerDrop(i);
+    }
+}
+
+void ServerBroadcast(const char* s, int len)
+{
+    for (int i = E.server.nclients - 1; i >= 0; --i)
+    {
+        /* dropping a client resizes, which may have dropped others */
+        if (i < E.server.nclients)
+        {
+            ServerSend(i, s, len);
+        }
+    }
+}
+
+/* Reads what has arrived of client i's next message, without waiting for
+ * the rest. Once it is whole, keys are queued for ServerReadByte and a new
+ * size redraws every client, which is how an attaching one gets its first
+ * frame. */
+void ServerReceive(int i)
+{
+    struct ServerClient* c = &E.server.clients[i];
+    while (1)
+    {
+        int need = c->inlen < 2 ? 2 : 2 + c->in[1];
+        if (c->inlen == need)
+        {
+            break;
+        }
+        int n = read(c->fd, c->in + c->inlen, need - c->inlen);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return;
+        }
+        if (n <= 0)
+        {
+            ServerDrop(i);
+            EditorRefreshScreen();
+            return;
+        }
+        c->inlen += n;
+    }
+    c->inlen = 0;
+    unsigned char* head = c->in;
+    char* payload = (char*)c->in + 2;
+
+    if (head[0] == KILO_MSG_KEYS && head[1] > 0)
+    {
+        memcpy(E.server.pending, payload, head[1]);
+        E.server.npending = head[1];
+        E.server.at = 0;
+        E.server.from = i;
+    }
+    else if (head[0] == KILO_MSG_SIZE && head[1] == 4)
+    {
+        unsigned char* p = (unsigned char*)payload;
+        E.server.clients[i].rows = p[0] << 8 | p[1];
+        E.server.clients[i].cols = p[2] << 8 | p[3];
+        ServerSend(i, "\x1b[2J", 4);
+        ServerResize();
+        E.screen.valid = 0;
+        EditorRefreshScreen();
+    }
+}
+
+/* The server's EditorReadByte: waits on the clients, new connections, a
+ * followed stream and watched files, and like a terminal in raw mode gives up after
+ * KILO_KEY_TIMEOUT_MS so a lone escape is not held back. */
+int ServerReadByte(char* c)
+{
+    struct Server* sv = &E.server;
+    long long deadline = NowNs() + KILO_KEY_TIMEOUT_MS * 1000000LL;
+    while (sv->at == sv->npending)
+    {
+        int timeout = (deadline - NowNs()) / 1000000;
+        if (timeout <= 0)
+        {
+            return 0;
+        }
+
+        int n = sv->nclients;
+        struct pollfd fds[n + 4];
+        for (int i = 0; i < n; ++i)
+        {
+            fds[i].fd = sv->clients[i].fd;
+            fds[i].events = POLLIN | (sv->clients[i].outlen ? POLLOUT : 0);
+        }
+        fds[n].fd = sv->fd;
+        fds[n].events = POLLIN;
+        fds[n + 1].fd = E.stream.fd;
+        fds[n + 1].events = POLLIN;
+        fds[n + 2].fd = E.watch.fd;
+        fds[n + 2].events = POLLIN;
+        fds[n + 3].fd = E.grep.wake[0];
+        fds[n + 3].events = POLLIN;
+        if (poll(fds, n + 4, timeout) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            Die("poll");
+        }
+
+        if (fds[n].revents & POLLIN)
+        {
+            int fd = accept4(sv->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (fd != -1 && !ServerPeerIsUser(fd))
+            {
+                close(fd);
+                fd = -1;
+            }
+            if (fd != -1)
+            {
+                sv->clients = (struct ServerClient*)realloc(sv->clients, sizeof(struct ServerClient) * (sv->nclients + 1));
+                memset(&sv->clients[sv->nclients], 0, sizeof(struct ServerClient));
+                sv->clients[sv->nclients++].fd = fd;
+            }
+        }
+        if (fds[n + 1].revents)
+        {
+            EditorStreamReadBuffer();
+            EditorRefreshScreen();
+        }
+        if (fds[n + 2].revents)
+        {
+            EditorWatchRead();
+            if (E.watch.idle)
+            {
+                EditorWatchApply();
+            }
+            EditorRefreshScreen();
+        }
+        if (fds[n + 3].revents)
+        {
+            EditorGrepRead();
+            EditorRefreshScreen();
+        }
+        for (int i = n - 1; i >= 0; --i)
+        {
+            /* a failed write while redrawing may have dropped clients */
+            if (i < sv->nclients && sv->clients[i].fd == fds[i].fd && (fds[i].revents & POLLOUT) &&
+                ServerFlush(i) == -1)
+            {
+                ServerDrop(i);
+            }
+        }
+        for (int i = n - 1; i >= 0 && sv->at == sv->npending; --i)
+        {
+            if (i < sv->nclients && sv->clients[i].fd == fds[i].fd && (fds[i].revents & ~POLLOUT))
+            {
+                ServerReceive(i);
+            }
+        }
+    }
+
+    *c = sv->pending[sv->at++];
+    return 1;
+}
+
+void ServerCleanup()
+{
+    unlink(E.server.path);
+}
+
+/* kilo -S: binds the socket while still on the terminal so errors show
+ * there, then carries on as a daemon. Files are loaded after that, and
+ * clients that attach meanwhile are served once they are. */
+void EditorServe()
+{
+    E.server.path = ServerPath();
+    if (E.server.path == NULL)
+    {
+        exit(1);
+    }
+    struct sockaddr_un addr;
+    ServerAddress(&addr, E.server.path);
+
+    /* a socket left behind by a server that is gone is replaced */
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe != -1 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0)
+    {
+        fprintf(stderr, "kilo: a server is already running on %s\n", E.server.path);
+        exit(1);
+    }
+    close(probe);
+    unlink(E.server.path);
+
+    E.server.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t mask = umask(077);
+    if (E.server.fd == -1 || bind(E.server.fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+        listen(E.server.fd, 16) == -1)
+    {
+        Die("server");
+    }
+    umask(mask);
+
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        Die("fork");
+    }
+    if (pid > 0)
+    {
+        printf("kilo: serving on %s (attach with kilo -a)\n", E.server.path);
+        fflush(stdout);
+        _exit(0);
+    }
+
+    setsid();
+    int null = open("/dev/null", O_RDWR);
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    close(null);
+    E.ofd = -1;
+    E.server.from = -1;
+    E.screenrows = KILO_SERVER_ROWS - 2;
+    E.screencols = KILO_SERVER_COLS;
+    atexit(ServerCleanup);
+}
+
+volatile sig_atomic_t attach_resized = 0;
+
+void AttachOnResize(int sig)
+{
+    (void)sig;
+    attach_resized = 1;
+}
+
+void AttachSendSize(int fd)
+{
+    int rows;
+    int cols;
+    if (GetWindowSize(&rows, &cols) == -1)
+    {
+        Die("get windows size");
+    }
+    char size[4] = {rows >> 8, rows, cols >> 8, cols};
+    MessageSend(fd, KILO_MSG_SIZE, size, 4);
+}
+
+/* kilo -a: a thin client that sends keys and window sizes to the server and
+ * writes whatever it sends back, until the server hangs up. */
+void EditorAttach()
+{
+    const char* path = ServerPath();
+    if (path == NULL)
+    {
+        exit(1);
+    }
+    struct sockaddr_un addr;
+    ServerAddress(&addr, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        fprintf(stderr, "kilo: no server on %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    if (!ServerPeerIsUser(fd))
+    {
+        fprintf(stderr, "kilo: the server on %s is not running as this user\n", path);
+        exit(1);
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = AttachOnResize;
+    sigaction(SIGWINCH, &sa, NULL);
+
+    EnableRawModel();
+    AttachSendSize(fd);
+
+    char buf[65536];
+    while (1)
+    {
+        if (attach_resized)
+        {
+            attach_resized = 0;
+            AttachSendSize(fd);
+        }
+
+        struct pollfd fds[2] = {{E.ifd, POLLIN, 0}, {fd, POLLIN, 0}};
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            Die("poll");
+        }
+
+        if (fds[1].revents)
+        {
+            int n = read(fd, buf, sizeof(buf));
+            if (n <= 0)
+            {
+                exit(0);
+            }
+            WriteAll(STDOUT_FILENO, buf, n);
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            int n = read(E.ifd, buf, 255);
+            if (n > 0)
+            {
+                MessageSend(fd, KILO_MSG_KEYS, buf, n);
+            }
+        }
+    }
+}
+
+unsigned long long IndexHash(const char* map, off_t size)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    off_t head = size < KILO_INDEX_HASHED ? size : KILO_INDEX_HASHED;
+    off_t tail = size - KILO_INDEX_HASHED > head ? size - KILO_INDEX_HASHED : head;
+
+    for (off_t i = 0; i < head; ++i)
+    {
+        h = (h ^ (unsigned char)map[i]) * 1099511628211ULL;
+    }
+    for (off_t i = tail; i < size; ++i)
+    {
+        h = (h ^ (unsigned char)map[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Appends entries for the rows starting at `from`, the first of which starts
+ * with block-comment state `in_comment`. Returns the number of rows added. */
+unsigned long long EditorIndexScan(FILE* fp, const char* map, off_t from, off_t size, int in_comment)
+{
+    int lex = E.syntax && E.syntax->multiline_comment_start;
+    char* render = NULL;
+    unsigned char* hl = NULL;
+    int cap = 0;
+    unsigned long long rows = 0;
+
+    for (const char* p = map + from; p < map + size; ++rows)
+    {
+        unsigned long long entry = (p - map) | (in_comment ? KILO_INDEX_COMMENT : 0);
+        fwrite(&entry, sizeof(entry), 1, fp);
+
+        const char* nl = ScanNewline(p, map + size);
+        if (lex)
+        {
+            int len = nl - p;
+            int need = len + CountTabs(p, len) * (KILO_TAB_STOP - 1) + 1;
+            if (need > cap)
+            {
+                cap = need * 2;
+                render = (char*)realloc(render, cap);
+                hl = (unsigned char*)realloc(hl, cap);
+            }
+            while (len > 0 && p[len - 1] == '\r')
+            {
+                len -= 1;
+            }
+            int rsize = RenderTabs(p, len, render);
+            in_comment = EditorHighlightLine(render, rsize, in_comment, hl);
+        }
+        p = nl + 1;
+    }
+
+    free(render);
+    free(hl);
+    return rows;
+}
+
+/* Validates <filename>.kidx against the file, extending it when the file has
+ * only grown and rebuilding it otherwise. Returns the index fd, or -1. */
+int EditorIndexSync(const char* filename, struct stat* st, const char* map)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.kidx", filename);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    const char* filetype = E.syntax ? E.syntax->filetype : "";
+    struct IndexHeader h;
+    off_t from = 0;
+    int in_comment = 0;
+    unsigned long long rows = 0;
+
+    /* an index cut short or padded would be mapped past its end */
+    struct stat ist;
+    if (pread(fd, &h, sizeof(h), 0) == sizeof(h) && !memcmp(h.magic, KILO_INDEX_MAGIC, 8) &&
+        h.version == KILO_INDEX_VERSION && !strncmp(h.filetype, filetype, sizeof(h.filetype)) &&
+        fstat(fd, &ist) == 0 && (unsigned long long)ist.st_size == sizeof(h) + h.rows * sizeof(unsigned long long) &&
+        h.size <= (unsigned long long)st->st_size && h.hash == IndexHash(map, h.size))
+    {
+        if (h.size == (unsigned long long)st->st_size && h.mtime_sec == st->st_mtim.tv_sec &&
+            h.mtime_nsec == st->st_mtim.tv_nsec)
+        {
+            return fd;
+        }
+
+        /* grown: rescan from the start of the last row, which may have been
+         * incomplete and whose lexer state carries into the appended rows */
+        unsigned long long last;
+        rows = h.rows;
+        if (rows > 0 && pread(fd, &last, sizeof(last), sizeof(h) + (rows - 1) * sizeof(last)) == sizeof(last))
+        {
+            rows -= 1;
+            from = last & ~KILO_INDEX_COMMENT;
+            in_comment = (last & KILO_INDEX_COMMENT) != 0;
+        }
+        else
+        {
+            rows = 0;
+        }
+    }
+
+    if (rows == 0)
+    {
+        from = 0;
+        in_comment = 0;
+    }
+    if (ftruncate(fd, sizeof(h) + rows * sizeof(unsigned long long)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    FILE* fp = fdopen(dup(fd), "r+");
+    if (!fp)
+    {
+        close(fd);
+        return -1;
+    }
+    fseeko(fp, sizeof(h) + rows * sizeof(unsigned long long), SEEK_SET);
+    rows += EditorIndexScan(fp, map, from, st->st_size, in_comment);
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, KILO_INDEX_MAGIC, 8);
+    h.version = KILO_INDEX_VERSION;
+    h.size = st->st_size;
+    h.mtime_sec = st->st_mtim.tv_sec;
+    h.mtime_nsec = st->st_mtim.tv_nsec;
+    h.hash = IndexHash(map, st->st_size);
+    h.rows = rows;
+    strncpy(h.filetype, filetype, sizeof(h.filetype) - 1);
+    fseeko(fp, 0, SEEK_SET);
+    fwrite(&h, sizeof(h), 1, fp);
+    if (fclose(fp) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Opens a large file read-only through its line index. Only the index header
+ * is read up front; rows are copied out of the file mapping as they are
+ * drawn or visited, so first paint and jumps do not depend on file size. */
+void EditorOpenIndexed(const char* filename)
+{
+    free(E.filename);
+    E.filename = strdup(filename);
+    EditorSelectSyntaxHighlight();
+
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        Die("Open");
+    }
+
+    E.index.size = st.st_size;
+    if (st.st_size > 0)
+    {
+        E.index.map = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (E.index.map == MAP_FAILED)
+        {
+            Die("mmap");
+        }
+    }
+    close(fd);
+
+    /* the index is only a sidecar: without one the file is read as usual */
+    int idx = EditorIndexSync(filename, &st, E.index.map);
+    struct IndexHeader h;
+    if (idx == -1 || pread(idx, &h, sizeof(h), 0) != sizeof(h) || h.rows > 0x7fffffff)
+    {
+        int err = idx == -1 ? errno : EINVAL;
+        if (idx != -1)
+        {
+            close(idx);
+        }
+        if (E.index.map)
+        {
+            munmap(E.index.map, E.index.size);
+        }
+        E.index.map = NULL;
+        E.index.size = 0;
+        if (EditorOpen(filename) == -1)
+        {
+            Die("Open");
+        }
+        EditorSetStatusMessage("Can't index %s: %s, opened it whole", filename, strerror(err));
+        return;
+    }
+    E.index.idxlen = sizeof(h) + h.rows * sizeof(unsigned long long);
+    E.index.idxmap = (char*)mmap(NULL, E.index.idxlen, PROT_READ, MAP_SHARED, idx, 0);
+    if (E.index.idxmap == MAP_FAILED)
+    {
+        Die("mmap");
+    }
+    close(idx);
+    E.index.entries = (unsigned long long*)(E.index.idxmap + sizeof(h));
+
+    /* calloc of a large array is lazily zeroed, so unvisited rows cost nothing */
+    E.numrows = h.rows;
+    E.rowcap = h.rows;
+    E.row = (ERow*)calloc(h.rows ? h.rows : 1, sizeof(ERow));
+    if (E.row == NULL)
+    {
+        Die("calloc");
+    }
+    E.readonly = 1;
+    E.dirty = 0;
+}
+
+void EditorIndexRow(int at, const char** start, int* len)
+{
+    off_t begin = E.index.entries[at] & ~KILO_INDEX_COMMENT;
+    off_t end = (at + 1 < E.numrows) ? (off_t)(E.index.entries[at + 1] & ~KILO_INDEX_COMMENT) : E.index.size;
+    if (end > begin && E.index.map[end - 1] == '\n')
+    {
+        end -= 1;
+    }
+    while (end > begin && E.index.map[end - 1] == '\r')
+    {
+        end -= 1;
+    }
+    *start = &E.index.map[begin];
+    *len = end - begin;
+}
+
+/* Copies an unloaded row out of the mapped file. Its block-comment state is
+ * the next row's entry, so no neighbours need loading. */
+void EditorRowLoad(ERow* row)
+{
+    if (row->chars)
+    {
+        return;
+    }
+
+    int at = row - E.row;
+    const char* start;
+    int len;
+    EditorIndexRow(at, &start, &len);
+
+    row->chars = (char*)malloc(len + 1);
+    memcpy(row->chars, start, len);
+    row->chars[len] = '\0';
+    row->size = len;
+    row->rsize = len;
+    row->hl_open_comment = (at + 1 < E.numrows) && (E.index.entries[at + 1] & KILO_INDEX_COMMENT);
+}
+
+ERow* EditorRowAt(int at)
+{
+    EditorRowLoad(&E.row[at]);
+    return &E.row[at];
+}
+
+/* Moves a row restored from a snapshot onto the heap before it changes. */
+void EditorRowOwn(ERow* row)
+{
+    if (!(row->cache & ROW_MAPPED))
+    {
+        return;
+    }
+    row->cache &= ~ROW_MAPPED;
+
+    char* chars = (char*)malloc(row->size + 1);
+    memcpy(chars, row->chars, row->size + 1);
+    row->chars = chars;
+    if (row->render)
+    {
+        char* render = (char*)malloc(row->rsize + 1);
+        memcpy(render, row->render, row->rsize + 1);
+        row->render = render;
+    }
+    if (row->hl)
+    {
+        unsigned char* hl = (unsigned char*)malloc(row->hlruns * 2);
+        memcpy(hl, row->hl, row->hlruns * 2);
+        row->hl = hl;
+    }
+    E.cache.bytes += EditorRowCacheBytes(row);
+}
+
+/* Stats a file and hashes its head and tail as the line index does. codec,
+ * if given, is set to what its magic says it is compressed with. */
+int EditorFileIdentity(const char* filename, struct stat* st, unsigned long long* hash, int* codec)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    if (fstat(fd, st) == -1 || !S_ISREG(st->st_mode))
+    {
+        close(fd);
+        return -1;
+    }
+
+    char* map = NULL;
+    if (st->st_size > 0 && (map = (char*)mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+    *hash = IndexHash(map, st->st_size);
+    if (codec)
+    {
+        *codec = CodecFromMagic((const unsigned char*)map, st->st_size < 4 ? st->st_size : 4);
+    }
+    if (map)
+    {
+        munmap(map, st->st_size);
+    }
+    close(fd);
+    return 0;
+}
+
+/* Restores a buffer from <filename>.ksnap when it still matches the file,
+ * instead of loading and highlighting the file. Returns the file size, or -1
+ * if the file has to be opened normally. */
+off_t EditorOpenSnapshot(const char* filename)
+{
+    free(E.filename);
+    E.filename = strdup(filename);
+    EditorSelectSyntaxHighlight();
+
+    struct stat st;
+    unsigned long long hash;
+    int codec;
+    if (EditorFileIdentity(filename, &st, &hash, &codec) == -1)
+    {
+        return -1;
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.ksnap", filename);
+    int fd = open(path, O_RDONLY);
+    struct stat sst;
+    if (fd == -1)
+    {
+        return -1;
+    }
+    if (fstat(fd, &sst) == -1 || sst.st_size < (off_t)sizeof(struct SnapshotHeader))
+    {
+        close(fd);
+        return -1;
+    }
+    char* map = (char*)mmap(NULL, sst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    struct SnapshotHeader* h = (struct SnapshotHeader*)map;
+    const char* filetype = E.syntax ? E.syntax->filetype : "";
+    unsigned long long end = sst.st_size;
+    if (memcmp(h->magic, KILO_SNAPSHOT_MAGIC, 8) || h->version != KILO_SNAPSHOT_VERSION ||
+        h->size != (unsigned long long)st.st_size || h->mtime_sec != st.st_mtim.tv_sec ||
+        h->mtime_nsec != st.st_mtim.tv_nsec || h->hash != hash ||
+        strncmp(h->filetype, filetype, sizeof(h->filetype)) || h->rows > 0x7fffffff ||
+        sizeof(*h) + h->rows * sizeof(struct SnapshotRow) > end)
+    {
+        munmap(map, sst.st_size);
+        return -1;
+    }
+
+    struct SnapshotRow* sr = (struct SnapshotRow*)(map + sizeof(*h));
+    ERow* rows = (ERow*)malloc(sizeof(ERow) * (h->rows ? h->rows : 1));
+    for (unsigned long long i = 0; i < h->rows; ++i)
+    {
+        struct SnapshotRow* r = &sr[i];
+        unsigned long long render = r->chars + r->size + 1;
+        unsigned long long hl = render + ((r->flags & KILO_SNAPSHOT_RENDER) ? r->rsize + 1 : 0);
+        if (r->size < 0 || r->rsize < 0 || r->hlruns < 0 || hl + r->hlruns * 2ULL > end)
+        {
+            free(rows);
+            munmap(map, sst.st_size);
+            return -1;
+        }
+
+        ERow* row = &rows[i];
+        row->chars = map + r->chars;
+        row->size = r->size;
+        row->render = (r->flags & KILO_SNAPSHOT_RENDER) ? map + render : NULL;
+        row->rsize = r->rsize;
+        row->hl = r->hlruns ? (unsigned char*)map + hl : NULL;
+        row->hlruns = r->hlruns;
+        row->hl_open_comment = r->hl_open_comment;
+        row->eol = r->eol ? r->eol : 1;
+        row->cache = ROW_MAPPED | ((r->flags & KILO_SNAPSHOT_CACHED) ? ROW_CACHED | ROW_REFERENCED : 0);
+    }
+
+    E.row = rows;
+    E.numrows = h->rows;
+    E.rowcap = h->rows;
+    E.snapshot.map = map;
+    E.snapshot.size = sst.st_size;
+    E.dirty = 0;
+    E.codec = CodecBuilt(codec) ? codec : CODEC_NONE;
+
+    E.cy = (h->cy >= 0 && h->cy < E.numrows) ? h->cy : 0;
+    E.cx = (E.cy < E.numrows && h->cx >= 0 && h->cx <= E.row[E.cy].size) ? h->cx : 0;
+    E.rowoff = (h->rowoff >= 0 && h->rowoff <= E.cy) ? h->rowoff : E.cy;
+    E.coloff = h->coloff >= 0 ? h->coloff : 0;
+    return st.st_size;
+}
+
+/* Writes <filename>.ksnap for a buffer opened with -s whose rows match the
+ * file on disk. The old snapshot may still be mapped, so the new one is
+ * written under a temporary name and renamed over it. */
+void EditorSnapshotWrite()
+{
+    if (!E.snapshot.enabled || E.dirty || E.readonly || E.filename == NULL || E.stream.fd != -1)
+    {
+        return;
+    }
+
+    EditorHighlightFlush();
+    long long t = TraceBegin();
+    struct stat st;
+    unsigned long long hash;
+    if (EditorFileIdentity(E.filename, &st, &hash, NULL) == -1)
+    {
+        return;
+    }
+
+    char path[4096];
+    char tmp[4096];
+    snprintf(path, sizeof(path), "%s.ksnap", E.filename);
+    snprintf(tmp, sizeof(tmp), "%s.ksnap.tmp", E.filename);
+    FILE* fp = fopen(tmp, "w");
+    if (!fp)
+    {
+        return;
+    }
+
+    struct SnapshotHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, KILO_SNAPSHOT_MAGIC, 8);
+    h.version = KILO_SNAPSHOT_VERSION;
+    h.size = st.st_size;
+    h.mtime_sec = st.st_mtim.tv_sec;
+    h.mtime_nsec = st.st_mtim.tv_nsec;
+    h.hash = hash;
+    h.rows = E.numrows;
+    strncpy(h.filetype, E.syntax ? E.syntax->filetype : "", sizeof(h.filetype) - 1);
+    h.cx = E.cx;
+    h.cy = E.cy;
+    h.rowoff = E.rowoff;
+    h.coloff = E.coloff;
+    fwrite(&h, sizeof(h), 1, fp);
+
+    unsigned long long off = sizeof(h) + (unsigned long long)E.numrows * sizeof(struct SnapshotRow);
+    for (int i = 0; i < E.numrows; ++i)
+    {
+        ERow* row = &E.row[i];
+        struct SnapshotRow r;
+        memset(&r, 0, sizeof(r));
+        r.chars = off;
+        r.size = row->size;
+        r.rsize = row->size;
+        r.hl_open_comment = row->hl_open_comment;
+        r.eol = row->eol;
+        off += row->size + 1;
+        if (row->cache & ROW_CACHED)
+        {
+            r.flags = KILO_SNAPSHOT_CACHED | (row->render ? KILO_SNAPSHOT_RENDER : 0);
+            r.rsize = row->rsize;
+            r.hlruns = row->hl ? row->hlruns : 0;
+            off += (row->render ? row->rsize + 1 : 0) + r.hlruns * 2;
+        }
+        fwrite(&r, sizeof(r), 1, fp);
+    }
+
+    for (int i = 0; i < E.numrows; ++i)
+    {
+        ERow* row = &E.row[i];
+        fwrite(row->chars, 1, row->size + 1, fp);
+        if (row->cache & ROW_CACHED)
+        {
+            if (row->render)
+            {
+                fwrite(row->render, 1, row->rsize + 1, fp);
+            }
+            if (row->hl)
+            {
+                fwrite(row->hl, 1, row->hlruns * 2, fp);
+            }
+        }
+    }
+
+    int failed = ferror(fp);
+    if (fclose(fp) != 0 || failed || rename(tmp, path) == -1)
+    {
+        unlink(tmp);
+    }
+    TraceEnd("EditorSnapshotWrite", t);
+}
+
+/* At quit, snapshots every buffer that was opened with -s. */
+void EditorSnapshotAll()
+{
+    if (E.win.nviews == 0)
+    {
+        EditorSnapshotWrite();
+        return;
+    }
+
+    struct View* v = &E.win.views[E.win.current];
+    BufferSave(&E.win.buffers[v->buffer]);
+    ViewSave(v);
+    for (int b = 0; b < E.win.nbuffers; ++b)
+    {
+        BufferLoad(&E.win.buffers[b]);
+        if (b != v->buffer)
+        {
+            E.cx = E.win.buffers[b].cx;
+            E.cy = E.win.buffers[b].cy;
+            E.rowoff = E.cy;
+            E.coloff = 0;
+        }
+        EditorSnapshotWrite();
+    }
+    BufferLoad(&E.win.buffers[v->buffer]);
+    ViewLoad(v);
+}
+
+/* Lets search skip unloaded rows without copying them. Rows with tabs are
+ * reported as candidates since the match is made against render. */
+int EditorIndexRowContains(int at, const char* query)
+{
+    const char* start;
+    int len;
+    EditorIndexRow(at, &start, &len);
+    return memchr(start, '\t', len) != NULL || memmem(start, len, query, strlen(query)) != NULL;
+}
+
+void InitEditor()
+{
+    E.cx = 0;
+    E.cy = 0;
+    E.rx = 0;
+    E.rowoff = 0;
+    E.coloff = 0;
+    E.numrows = 0;
+    E.rowcap = 0;
+    E.row = NULL;
+    E.filename = NULL;
+    E.statusmsg[0] = '\0';
+    E.statusmsg_time = 0;
+    E.dirty = 0;
+    E.syntax = NULL;
+    E.ifd = STDIN_FILENO;
+    E.ofd = STDOUT_FILENO;
+    E.recordfd = -1;
+    E.input.len = 0;
+    E.input.at = 0;
+    E.headless = 0;
+    E.outbytes = 0;
+    memset(&E.lat, 0, sizeof(E.lat));
+    memset(&E.trace, 0, sizeof(E.trace));
+    memset(&E.cache, 0, sizeof(E.cache));
+    memset(&E.stream, 0, sizeof(E.stream));
+    E.stream.fd = -1;
+    E.stream.file = -1;
+    E.stream.wd = -1;
+    memset(&E.index, 0, sizeof(E.index));
+    E.readonly = 0;
+    memset(&E.offsets, 0, sizeof(E.offsets));
+    memset(&E.snapshot, 0, sizeof(E.snapshot));
+    memset(&E.wrap, 0, sizeof(E.wrap));
+    memset(&E.folds, 0, sizeof(E.folds));
+    memset(&E.undo, 0, sizeof(E.undo));
+    memset(&E.cursors, 0, sizeof(E.cursors));
+    memset(&E.words, 0, sizeof(E.words));
+    memset(&E.complete, 0, sizeof(E.complete));
+    memset(&E.brackets, 0, sizeof(E.brackets));
+    memset(&E.disk, 0, sizeof(E.disk));
+    E.codec = -1;
+    E.disk.wd = -1;
+    memset(&E.watch, 0, sizeof(E.watch));
+    E.watch.fd = -1;
+    memset(&E.grep, 0, sizeof(E.grep));
+    E.grep.wake[0] = -1;
+    E.grep.wake[1] = -1;
+    E.grep.buffer = -1;
+    E.undo.budget = (long long)KILO_UNDO_MB << 20;
+    memset(&E.screen, 0, sizeof(E.screen));
+    memset(&E.win, 0, sizeof(E.win));
+    memset(&E.server, 0, sizeof(E.server));
+    E.server.fd = -1;
+    memset(&E.macro, 0, sizeof(E.macro));
+
+    char* budget = getenv("KILO_CACHE_MB");
+    if (budget)
+    {
+        E.cache.budget = atoll(budget) << 20;
+    }
+    char* history = getenv("KILO_UNDO_MB");
+    if (history)
+    {
+        E.undo.budget = atoll(history) << 20;
+    }
+}
+
+/* Appends word to a NULL-terminated list. */
+char** SyntaxListAppend(char** list, const char* word)
+{
+    int n = 0;
+    while (list && list[n])
+    {
+        ++n;
+    }
+    list = (char**)realloc(list, sizeof(char*) * (n + 2));
+    list[n] = strdup(word);
+    list[n + 1] = NULL;
+    return list;
+}
+
+/* Parses one syntax file. Each line is a directive followed by its words:
+ *
+ *   filetype c
+ *   match .c .h
+ *   comment //
+ *   multiline / * * /       (without the spaces)
+ *   strings "'
+ *   numbers
+ *   separators ,.()+-/ *=~%<>[];
+ *   keywords if while for
+ *   keywords2 int char
+ *
+ * Returns 0 when the file has no filetype or match line. */
+int EditorParseSyntax(FILE* fp, struct EditorSyntax* syn)
+{
+    char* line = NULL;
+    size_t cap = 0;
+
+    memset(syn, 0, sizeof(*syn));
+    syn->filematch = (char**)calloc(1, sizeof(char*));
+    syn->keywords = (char**)calloc(1, sizeof(char*));
+    syn->separators = strdup(KILO_SEPARATORS);
+
+    while (getline(&line, &cap, fp) != -1)
+    {
+        char* save;
+        char* key = strtok_r(line, " \t\r\n", &save);
+        if (key == NULL || key[0] == '#')
+        {
+            continue;
+        }
+
+        char* word;
+        if (!strcmp(key, "numbers"))
+        {
+            syn->flags |= HL_HIGHLIGHT_NUMBERS;
+        }
+        else if ((word = strtok_r(NULL, " \t\r\n", &save)) == NULL)
         {
-            cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
+            continue;
         }
-        cur_rx += 1;
-
-        if (cur_rx > rx)
+        else if (!strcmp(key, "filetype"))
         {
-            return cx;
+            free(syn->filetype);
+            syn->filetype = strdup(word);
+        }
+        else if (!strcmp(key, "comment"))
+        {
+            free(syn->singleline_comment_start);
+            syn->singleline_comment_start = strdup(word);
+        }
+        else if (!strcmp(key, "multiline"))
+        {
+            char* end = strtok_r(NULL, " \t\r\n", &save);
+            if (end)
+            {
+                free(syn->multiline_comment_start);
+                free(syn->multiline_comment_end);
+                syn->multiline_comment_start = strdup(word);
+                syn->multiline_comment_end = strdup(end);
+            }
+        }
+        else if (!strcmp(key, "strings"))
+        {
+            free(syn->quotes);
+            syn->quotes = strdup(word);
+            syn->flags |= HL_HIGHLIGHT_STRINGS;
+        }
+        else if (!strcmp(key, "separators"))
+        {
+            free(syn->separators);
+            syn->separators = strdup(word);
+        }
+        else
+        {
+            int kw2 = !strcmp(key, "keywords2");
+            if (!kw2 && strcmp(key, "keywords") && strcmp(key, "match"))
+            {
+                continue;
+            }
+            for (; word; word = strtok_r(NULL, " \t\r\n", &save))
+            {
+                if (key[0] == 'm')
+                {
+                    syn->filematch = SyntaxListAppend(syn->filematch, word);
+                    continue;
+                }
+                char kw[256];
+                snprintf(kw, sizeof(kw), "%s%s", word, kw2 ? "|" : "");
+                syn->keywords = SyntaxListAppend(syn->keywords, kw);
+            }
         }
     }
 
-    return cx;
+    free(line);
+    return syn->filetype != NULL && syn->filematch[0] != NULL;
 }
 
-void EditorScroll()
+/* Syntaxes read from *.syntax in $KILO_SYNTAX_DIR (default ~/.kilo/syntax).
+ * They are matched before HLDB, so they can also replace a built-in one. */
+struct EditorSyntax* syntax_files = NULL;
+int syntax_file_count = -1;
+
+void EditorLoadSyntaxes()
 {
-    E.rx = 0;
-    if (E.cy < E.numrows)
-    {
-        E.rx = EditorRowCxToRx(&E.row[E.cy], E.cx);
-    }
+    syntax_file_count = 0;
 
-    if (E.cy < E.rowoff)
+    char dir[4096];
+    char* env = getenv("KILO_SYNTAX_DIR");
+    char* home = getenv("HOME");
+    if (env)
     {
-        E.rowoff = E.cy;
+        snprintf(dir, sizeof(dir), "%s", env);
     }
-    
-    if (E.cy >= E.rowoff + E.screenrows)
+    else if (home)
     {
-        E.rowoff = E.cy - E.screenrows + 1;
-    }
-
-    if (E.rx < E.coloff)
-    {   
-        E.coloff = E.rx;
+        snprintf(dir, sizeof(dir), "%s/.kilo/syntax", home);
     }
-
-    if (E.rx >= E.coloff + E.screencols)
+    else
     {
-        E.coloff = E.rx - E.screencols + 1;
+        return;
     }
-}
 
-void EditorDrawStatusBar(struct ABuf* ab)
-{
-    AbAppend(ab, "\x1b[7m", 4);
-    
-    char status[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.filename ? E.filename : "[No Name]",
-            E.numrows, E.dirty? "(modified)" : "");
-    if (len > E.screencols)
-    {       
-        len = E.screencols;
+    DIR* d = opendir(dir);
+    if (d == NULL)
+    {
+        return;
     }
 
-    char rstatus[80];
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
-    AbAppend(ab, status, len);
-
-    while (len < E.screencols)
+    struct dirent* ent;
+    while ((ent = readdir(d)) != NULL)
     {
-        if (E.screencols - len == rlen)
+        char* ext = strrchr(ent->d_name, '.');
+        if (ext == NULL || strcmp(ext, ".syntax"))
         {
-            AbAppend(ab, rstatus, rlen);
-            break;
+            continue;
         }
-        else
+
+        char path[8192];
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        FILE* fp = fopen(path, "r");
+        if (fp == NULL)
         {
-            AbAppend(ab, " ", 1);
-            len += 1;
+            continue;
+        }
+
+        struct EditorSyntax syn;
+        if (EditorParseSyntax(fp, &syn))
+        {
+            syntax_files = (struct EditorSyntax*)realloc(syntax_files, sizeof(syn) * (syntax_file_count + 1));
+            syntax_files[syntax_file_count++] = syn;
         }
+        fclose(fp);
     }
-    AbAppend(ab, "\x1b[m", 3);
-    AbAppend(ab, "\r\n", 2);
+    closedir(d);
 }
 
-void EditorDrawMessageBar(struct ABuf* ab)
+int SyntaxTrieNode(struct SyntaxTable* t)
 {
-    AbAppend(ab, "\x1b[K", 3);
-    int msglen = strlen(E.statusmsg);
-    if (msglen > E.screencols)
-    {
-        msglen = E.screencols;
-    }
-    if (msglen && time(NULL) - E.statusmsg_time < 5)
+    if (t->nodes == t->cap)
     {
-        AbAppend(ab, E.statusmsg, msglen);
+        t->cap = t->cap ? t->cap * 2 : 64;
+        t->trie = (unsigned short (*)[256])realloc(t->trie, sizeof(*t->trie) * t->cap);
+        t->accept = (unsigned char*)realloc(t->accept, t->cap);
     }
+    memset(t->trie[t->nodes], 0, sizeof(*t->trie));
+    t->accept[t->nodes] = 0;
+    return t->nodes++;
 }
 
-void EditorRefreshScreen()
+/* Adds a token to the trie. Returns -1, leaving it out, once the trie has
+ * KILO_SYNTAX_NODES nodes, as many as its unsigned short links can name. */
+int SyntaxTrieAdd(struct SyntaxTable* t, const char* token, int len, int kind)
 {
-    EditorScroll();
-
-    struct ABuf aBuf = ABUF_INIT;
-
-    AbAppend(&aBuf, "\x1b[?25l", 6);
-    AbAppend(&aBuf, "\x1b[H", 3);
-
-    EditorDrawRows(&aBuf);
-    EditorDrawStatusBar(&aBuf);
-    EditorDrawMessageBar(&aBuf);
-
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy - E.rowoff + 1, E.rx - E.coloff + 1);
-    AbAppend(&aBuf, buf, strlen(buf));
+    if (len <= 0)
+    {
+        return 0;
+    }
 
-    AbAppend(&aBuf, "\x1b[?25h", 6);
-    write(STDOUT_FILENO, aBuf.b, aBuf.len);
-    AbFree(&aBuf);
+    int node = 0;
+    for (int i = 0; i < len; ++i)
+    {
+        unsigned char c = token[i];
+        if (t->trie[node][c] == 0)
+        {
+            if (t->nodes == KILO_SYNTAX_NODES)
+            {
+                return -1;
+            }
+            int child = SyntaxTrieNode(t);
+            t->trie[node][c] = child;
+        }
+        node = t->trie[node][c];
+    }
+    t->accept[node] |= kind;
+    t->cls[(unsigned char)token[0]] |= SC_TOKEN;
+    return 0;
 }
 
-int GetCursorPosition(int* rows, int* cols)
+/* Builds the tables EditorHighlightLine runs on, so a byte costs one class
+ * lookup and one transition unless it can start a comment or keyword. */
+struct SyntaxTable* EditorCompileSyntax(struct EditorSyntax* syn)
 {
-    char buf[32];
-    unsigned int i = 0;
-
-    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4)
+    struct SyntaxTable* t = (struct SyntaxTable*)calloc(1, sizeof(struct SyntaxTable));
+    int numbers = syn->flags & HL_HIGHLIGHT_NUMBERS;
+    int strings = (syn->flags & HL_HIGHLIGHT_STRINGS) && syn->quotes;
+    const char* quotes = strings ? syn->quotes : "";
+    int nquotes = strlen(quotes) < KILO_SYNTAX_QUOTES ? (int)strlen(quotes) : KILO_SYNTAX_QUOTES;
+    const char* seps = syn->separators ? syn->separators : KILO_SEPARATORS;
+
+    for (int c = 0; c < 256; ++c)
     {
-        return -1;
+        if (isspace(c) || c == '\0' || strchr(seps, c) != NULL)
+        {
+            t->cls[c] = SC_SEP;
+        }
     }
-
-    while (i < sizeof(buf) - 1)
+    if (numbers)
     {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1)
+        for (int c = '0'; c <= '9'; ++c)
         {
-            break;
+            t->cls[c] = SC_DIGIT;
+        }
+        t->cls['.'] = SC_DOT;
+    }
+    if (strings)
+    {
+        t->cls['\\'] = SC_ESCAPE;
+        for (int q = 0; q < nquotes; ++q)
+        {
+            t->cls[(unsigned char)quotes[q]] = SC_QUOTE + q;
         }
+    }
 
-        if (buf[i] == 'R')
+    /* outside strings: a separator leads to SS_SEP, where numbers and
+     * keywords may start; anything else to SS_WORD */
+    int dot = strchr(seps, '.') != NULL ? SS_SEP : SS_WORD;
+    for (int s = SS_SEP; s <= SS_NUMBER; ++s)
+    {
+        for (int c = 0; c < SC_CLASSES; ++c)
         {
-           break; 
+            t->step[s][c] = (HL_NORMAL << 4) | SS_WORD;
+        }
+        t->step[s][SC_SEP] = (HL_NORMAL << 4) | SS_SEP;
+        t->step[s][SC_DOT] = (HL_NORMAL << 4) | dot;
+        for (int q = 0; q < nquotes; ++q)
+        {
+            t->step[s][SC_QUOTE + q] = (HL_STRING << 4) | (SS_STRING + q);
         }
+    }
+    t->step[SS_SEP][SC_DIGIT] = (HL_NUMBER << 4) | SS_NUMBER;
+    t->step[SS_NUMBER][SC_DIGIT] = (HL_NUMBER << 4) | SS_NUMBER;
+    t->step[SS_NUMBER][SC_DOT] = (HL_NUMBER << 4) | SS_NUMBER;
 
-        ++i;
+    /* strings end at their own quote; an escape takes the next byte along */
+    for (int q = 0; q < KILO_SYNTAX_QUOTES; ++q)
+    {
+        for (int c = 0; c < SC_CLASSES; ++c)
+        {
+            t->step[SS_STRING + q][c] = (HL_STRING << 4) | (SS_STRING + q);
+            t->step[SS_ESCAPE + q][c] = (HL_STRING << 4) | (SS_STRING + q);
+        }
+        t->step[SS_STRING + q][SC_ESCAPE] = (HL_STRING << 4) | (SS_ESCAPE + q);
+        t->step[SS_STRING + q][SC_QUOTE + q] = (HL_STRING << 4) | SS_SEP;
     }
-    buf[i] = '\0';
 
-    if (buf[0] != '\x1b' || buf[1] != '[')
+    SyntaxTrieNode(t);
+    char* scs = syn->singleline_comment_start;
+    char* mcs = syn->multiline_comment_start;
+    char* mce = syn->multiline_comment_end;
+    if (scs)
     {
-        return -1;
+        SyntaxTrieAdd(t, scs, strlen(scs), TOK_SCS);
     }
-    
-    if (sscanf(&buf[2], "%d;%d", rows, cols) != 2)
+    if (mcs && mce && mcs[0] && mce[0])
     {
-        return -1;
+        SyntaxTrieAdd(t, mcs, strlen(mcs), TOK_MCS);
+        t->mce = mce;
+        t->mce_len = strlen(mce);
+    }
+    for (int j = 0; syn->keywords[j] != NULL; ++j)
+    {
+        int klen = strlen(syn->keywords[j]);
+        int kw2 = klen > 0 && syn->keywords[j][klen - 1] == '|';
+        if (SyntaxTrieAdd(t, syn->keywords[j], klen - kw2, kw2 ? TOK_KEYWORD2 : TOK_KEYWORD1) == -1)
+        {
+            EditorSetStatusMessage("Too many keywords for %s, kept the first %d", syn->filetype, j);
+            break;
+        }
     }
 
-    return 0;
+    return t;
 }
 
-int GetWindowSize(int* rows, int* cols)
+int SyntaxMatches(struct EditorSyntax* s, const char* ext)
 {
-    struct winsize ws;
-
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+    for (unsigned int j = 0; s->filematch[j]; ++j)
     {
-        if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
+        int is_ext = (s->filematch[j][0] == '.');
+        if ((is_ext && ext && !strcmp(ext, s->filematch[j])) ||
+            (!is_ext && strstr(E.filename, s->filematch[j])))
         {
-            return -1;
+            return 1;
         }
-        return GetCursorPosition(rows, cols);
-    }
-    else
-    {
-        *cols = ws.ws_col;
-        *rows = ws.ws_row;
-        return 0;
     }
+    return 0;
 }
 
-void EditorOpen(const char* filename)
+void EditorSelectSyntaxHighlight()
 {
-    free(E.filename);
-    E.filename = strdup(filename);
-
-    EditorSelectSyntaxHighlight();
+    E.syntax = NULL;
+    if (E.filename == NULL)
+    {
+        return;
+    }
 
-    FILE* fp = fopen(filename, "r");
-    if (!fp)
+    if (syntax_file_count < 0)
     {
-        Die("Open");
+        EditorLoadSyntaxes();
     }
 
-    char* line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
+    /* x.c.gz highlights as x.c */
+    int suffix;
+    CodecFromName(E.filename, &suffix);
+    char* name = strndup(E.filename, strlen(E.filename) - suffix);
+    char* ext = strrchr(name, '.');
 
-    while((linelen = getline(&line, &linecap, fp)) != -1)
+    for (unsigned int i = 0; i < syntax_file_count + HLDB_ENTRIES; ++i)
     {
-        while(linelen > 0 && (line[linelen - 1] == '\r' || line[linelen - 1] == '\n'))
+        struct EditorSyntax* s = ((int)i < syntax_file_count) ? &syntax_files[i] : &HLDB[i - syntax_file_count];
+        if (!SyntaxMatches(s, ext))
+        {
+            continue;
+        }
+
+        if (s->table == NULL)
+        {
+            s->table = EditorCompileSyntax(s);
+        }
+        E.syntax = s;
+
+        for (int n = 0; n < E.numrows; ++n)
         {
-            linelen -= 1;
+            EditorUpdateRow(&E.row[n]);
         }
-        EditorInsertRow(E.numrows, line, linelen);
+        break;
     }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+    free(name);
 }
 
-void InitEditor()
+#ifndef KILO_NO_MAIN
+int main(int argc, char** argv)
 {
-    E.cx = 0;
-    E.cy = 0;
-    E.rx = 0;
-    E.rowoff = 0;
-    E.coloff = 0;
-    E.numrows = 0;
-    E.row = NULL;
-    E.filename = NULL;
-    E.statusmsg[0] = '\0';
-    E.statusmsg_time = 0;
-    E.dirty = 0;
-    E.syntax = NULL;
+    InitEditor();
+    E.watch.enabled = 1;
 
-    if (GetWindowSize(&E.screenrows, &E.screencols) == -1)
+    int follow = 0;
+    int indexed = 0;
+    int serve = 0;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-' && argv[arg][1] != '\0'; ++arg)
     {
-        Die("get windows size");
+        if (!strcmp(argv[arg], "-f"))
+        {
+            follow = 1;
+        }
+        else if (!strcmp(argv[arg], "-i"))
+        {
+            indexed = 1;
+        }
+        else if (!strcmp(argv[arg], "-S"))
+        {
+            serve = 1;
+        }
+        else if (!strcmp(argv[arg], "-s"))
+        {
+            E.snapshot.enabled = 1;
+        }
+        else if (!strcmp(argv[arg], "-a"))
+        {
+            EditorAttach();
+        }
     }
-    E.screenrows -= 2;
-}
+    char* filename = (arg < argc) ? argv[arg] : NULL;
 
-void EditorSelectSyntaxHighlight()
-{
-    E.syntax = NULL;
-    if (E.filename == NULL)
+    if (serve && filename && !strcmp(filename, "-"))
     {
-        return;
+        fprintf(stderr, "kilo: -S can't stream stdin\n");
+        return 1;
     }
 
-    char* ext = strrchr(E.filename, '.');
-
-    for (unsigned int i = 0; i < HLDB_ENTRIES; ++i)
+    if (filename && !strcmp(filename, "-"))
     {
-        struct EditorSyntax* s = &HLDB[i];
+        /* stdin carries the text, so keys have to come from the terminal */
+        if ((E.ifd = open("/dev/tty", O_RDWR)) == -1)
+        {
+            Die("/dev/tty");
+        }
+    }
 
-        unsigned int j = 0;
-        while (s->filematch[j])
+    if (serve)
+    {
+        EditorServe();
+    }
+    else
+    {
+        EnableRawModel();
+        if (GetWindowSize(&E.screenrows, &E.screencols) == -1)
         {
-            int is_ext = (s->filematch[j][0] == '.');
-            if ((is_ext && ext && !strcmp(ext, s->filematch[j])) ||
-                (!is_ext && strstr(E.filename, s->filematch[j])))
-            {
-                E.syntax = s;
+            Die("get windows size");
+        }
+        E.screenrows -= 2;
+    }
 
-                for (int n = 0; n < E.numrows; ++n)
-                {
-                    EditorUpdateRow(&E.row[n]);
-                }
+    TraceInit();
 
-                return;
-            }
+    char* record = getenv("KILO_RECORD");
+    if (record && (E.recordfd = open(record, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+    {
+        Die("record");
+    }
 
-            ++j;
+    /* a compressed file is neither indexed in place nor followed */
+    int compressed = 0;
+    if (filename && strcmp(filename, "-") && (indexed || follow))
+    {
+        int fd = open(filename, O_RDONLY);
+        compressed = fd != -1 && CodecProbe(fd) != CODEC_NONE;
+        if (fd != -1)
+        {
+            close(fd);
         }
     }
-}
 
-int main(int argc, char** argv)
-{
-    EnableRawModel();
-    InitEditor();
-    if (argc >=2 )
+    if (filename && !strcmp(filename, "-"))
+    {
+        EditorStreamStdin();
+    }
+    else if (filename && indexed && !compressed)
+    {
+        EditorOpenIndexed(filename);
+    }
+    else if (filename)
     {
-        EditorOpen(argv[1]);
+        off_t loaded = E.snapshot.enabled ? EditorOpenSnapshot(filename) : -1;
+        if (loaded == -1)
+        {
+            loaded = EditorOpen(filename);
+        }
+        if (loaded == -1)
+        {
+            Die("Open");
+        }
+        if (follow && !compressed)
+        {
+            EditorFollow(filename, loaded);
+        }
+        else
+        {
+            EditorWatch();
+        }
     }
 
-    EditorSetStatusMessage("HELO: CTRL-Q = quit | CTRL-S = save | CTRL-F = find");
+    /* unless opening the file had something to say */
+    if (E.statusmsg[0] == '\0')
+    {
+        EditorSetStatusMessage("HELO: CTRL-Q = quit | CTRL-S = save | CTRL-F = find");
+    }
 
     while (1)
     {
+        EditorWatchApply();
         EditorRefreshScreen();
+        EditorStreamWait();
         EditorProcessKey();
     }
     return 0;
 }
+#endif
@@ -0,0 +1,154 @@
+/*
+ * Headless keystroke replay.
+ *
+ * Feeds a recorded keystroke script (raw terminal bytes, e.g. captured with
+ * KILO_RECORD=keys.bin ./kilo file) through EditorProcessKey against a file,
+ * with the terminal output going to a null sink. Per-key latency is measured
+ * from the moment a key is decoded until the editor asks for the next one, so
+ * it covers the edit and the frame that shows it.
+ *
+ *   ./kilo-replay [-r rows] [-c cols] [-i] [-s] [-o out] script [file]
+ *
+ * With -i the file is opened read-only through its line index, as kilo -i does,
+ * and with -s it is restored from its snapshot, as kilo -s does.
+ */
+#define KILO_NO_MAIN
+#include "kilo.c"
+
+#include <sys/resource.h>
+
+long long replay_begin;
+
+int CompareLatency(const void* a, const void* b)
+{
+    long long x = *(const long long*)a;
+    long long y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+long long Percentile(long long* sorted, int n, int pct)
+{
+    if (n == 0)
+    {
+        return 0;
+    }
+    int i = (int)((long long)n * pct / 100);
+    if (i >= n)
+    {
+        i = n - 1;
+    }
+    return sorted[i];
+}
+
+void ReplayReport()
+{
+    long long total = NowNs() - replay_begin;
+
+    /* the key being processed when the script ran out has no successor */
+    KeyLatencyStop();
+
+    int n = E.lat.count;
+    qsort(E.lat.samples, n, sizeof(long long), CompareLatency);
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    fprintf(stderr, "{\"keys\": %d, \"rows\": %d, \"total_ms\": %.3f, \"keys_per_sec\": %.1f, "
+            "\"p50_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f, \"out_bytes\": %lld, "
+            "\"cache_hits\": %lld, \"cache_misses\": %lld, \"cache_bytes\": %lld, \"max_rss_kb\": %ld}\n",
+            n, E.numrows, total / 1e6, total ? n * 1e9 / total : 0.0,
+            Percentile(E.lat.samples, n, 50) / 1e3, Percentile(E.lat.samples, n, 99) / 1e3,
+            n ? E.lat.samples[n - 1] / 1e3 : 0.0, E.outbytes,
+            E.cache.hits, E.cache.misses, E.cache.bytes, ru.ru_maxrss);
+}
+
+int main(int argc, char** argv)
+{
+    int rows = 24;
+    int cols = 80;
+    char* out = NULL;
+    int indexed = 0;
+    int snapshot = 0;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; ++i)
+    {
+        if (i + 1 >= argc)
+        {
+            break;
+        }
+        if (!strcmp(argv[i], "-r"))
+        {
+            rows = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-c"))
+        {
+            cols = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-o"))
+        {
+            out = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-i"))
+        {
+            indexed = 1;
+        }
+        else if (!strcmp(argv[i], "-s"))
+        {
+            snapshot = 1;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (i >= argc || rows < 3 || cols < 1)
+    {
+        fprintf(stderr, "usage: %s [-r rows] [-c cols] [-i] [-s] [-o out] script [file]\n", argv[0]);
+        return 1;
+    }
+
+    InitEditor();
+    E.headless = 1;
+    E.screenrows = rows - 2;
+    E.screencols = cols;
+    E.ofd = -1;
+    E.lat.enabled = 1;
+    E.snapshot.enabled = snapshot;
+    TraceInit();
+
+    if ((E.ifd = open(argv[i], O_RDONLY)) == -1)
+    {
+        perror("script");
+        return 1;
+    }
+    if (out && (E.ofd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+    {
+        perror("out");
+        return 1;
+    }
+
+    if (i + 1 < argc && indexed)
+    {
+        EditorOpenIndexed(argv[i + 1]);
+    }
+    else if (i + 1 < argc && (!E.snapshot.enabled || EditorOpenSnapshot(argv[i + 1]) == -1))
+    {
+        if (EditorOpen(argv[i + 1]) == -1)
+        {
+            Die("Open");
+        }
+    }
+
+    replay_begin = NowNs();
+    atexit(ReplayReport);
+
+    /* EditorReadByte exits through ReplayReport once the script is exhausted */
+    while (1)
+    {
+        EditorRefreshScreen();
+        EditorProcessKey();
+    }
+    return 0;
+}